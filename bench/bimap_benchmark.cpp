@@ -0,0 +1,642 @@
+// Times every bimap operation over sorted, reverse-sorted, random and
+// Zipfian key streams, for integer and string keys, against a pair of
+// std::maps and, when available, boost::bimap. Each benchmark reports
+// time/op and the bytes allocated per stored pair.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bimap.h"
+
+#ifdef BIMAP_BENCH_BOOST
+#include <boost/bimap.hpp>
+#include <boost/bimap/set_of.hpp>
+#endif
+
+#ifndef BIMAP_BENCH_MAX_SIZE
+#define BIMAP_BENCH_MAX_SIZE 1000000
+#endif
+
+// every allocation of the process is counted, to derive bytes/entry; all
+// forms of the global operators are replaced so that each new is paired with
+// its own delete
+static std::atomic<std::size_t> allocated_bytes{0};
+
+namespace {
+
+void* counted_alloc(std::size_t size, std::size_t align) noexcept {
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (size == 0) {
+    size = 1;
+  }
+  if (align <= alignof(std::max_align_t)) {
+    return std::malloc(size);
+  }
+  // aligned_alloc wants a multiple of the alignment
+  return std::aligned_alloc(align, (size + align - 1) / align * align);
+}
+
+void* counted_alloc_or_throw(std::size_t size, std::size_t align) {
+  if (void* p = counted_alloc(size, align)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void counted_free(void* p) noexcept {
+  std::free(p);
+}
+
+} // namespace
+
+void* operator new(std::size_t size) {
+  return counted_alloc_or_throw(size, 0);
+}
+void* operator new[](std::size_t size) {
+  return counted_alloc_or_throw(size, 0);
+}
+void* operator new(std::size_t size, std::align_val_t align) {
+  return counted_alloc_or_throw(size, static_cast<std::size_t>(align));
+}
+void* operator new[](std::size_t size, std::align_val_t align) {
+  return counted_alloc_or_throw(size, static_cast<std::size_t>(align));
+}
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept {
+  return counted_alloc(size, 0);
+}
+void* operator new[](std::size_t size, std::nothrow_t const&) noexcept {
+  return counted_alloc(size, 0);
+}
+void* operator new(std::size_t size, std::align_val_t align, std::nothrow_t const&) noexcept {
+  return counted_alloc(size, static_cast<std::size_t>(align));
+}
+void* operator new[](std::size_t size, std::align_val_t align, std::nothrow_t const&) noexcept {
+  return counted_alloc(size, static_cast<std::size_t>(align));
+}
+
+void operator delete(void* p) noexcept {
+  counted_free(p);
+}
+void operator delete[](void* p) noexcept {
+  counted_free(p);
+}
+void operator delete(void* p, std::size_t) noexcept {
+  counted_free(p);
+}
+void operator delete[](void* p, std::size_t) noexcept {
+  counted_free(p);
+}
+void operator delete(void* p, std::align_val_t) noexcept {
+  counted_free(p);
+}
+void operator delete[](void* p, std::align_val_t) noexcept {
+  counted_free(p);
+}
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+  counted_free(p);
+}
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept {
+  counted_free(p);
+}
+void operator delete(void* p, std::nothrow_t const&) noexcept {
+  counted_free(p);
+}
+void operator delete[](void* p, std::nothrow_t const&) noexcept {
+  counted_free(p);
+}
+void operator delete(void* p, std::align_val_t, std::nothrow_t const&) noexcept {
+  counted_free(p);
+}
+void operator delete[](void* p, std::align_val_t, std::nothrow_t const&) noexcept {
+  counted_free(p);
+}
+
+namespace {
+
+enum class distribution { sorted, reverse, random, zipf };
+
+char const* name(distribution d) {
+  switch (d) {
+    case distribution::sorted:
+      return "sorted";
+    case distribution::reverse:
+      return "reverse";
+    case distribution::random:
+      return "random";
+    case distribution::zipf:
+      return "zipf";
+  }
+  return "";
+}
+
+// order in which the indices 0..n-1 are inserted or looked up; the Zipfian
+// stream draws n indices with popularity 1/rank, so it repeats hot keys
+std::vector<std::uint64_t> index_stream(distribution d, std::size_t n) {
+  std::vector<std::uint64_t> result(n);
+  std::mt19937_64 rng(n);
+  switch (d) {
+    case distribution::sorted:
+      for (std::size_t i = 0; i < n; ++i) {
+        result[i] = i;
+      }
+      break;
+    case distribution::reverse:
+      for (std::size_t i = 0; i < n; ++i) {
+        result[i] = n - 1 - i;
+      }
+      break;
+    case distribution::random:
+      for (std::size_t i = 0; i < n; ++i) {
+        result[i] = i;
+      }
+      std::shuffle(result.begin(), result.end(), rng);
+      break;
+    case distribution::zipf: {
+      std::vector<double> cdf(n);
+      double sum = 0;
+      for (std::size_t i = 0; i < n; ++i) {
+        cdf[i] = sum += 1.0 / static_cast<double>(i + 1);
+      }
+      // popular ranks are spread over the key space
+      std::vector<std::uint64_t> rank_to_index(n);
+      for (std::size_t i = 0; i < n; ++i) {
+        rank_to_index[i] = i;
+      }
+      std::shuffle(rank_to_index.begin(), rank_to_index.end(), rng);
+      std::uniform_real_distribution<double> uniform(0, sum);
+      for (auto& x : result) {
+        auto rank = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin();
+        x = rank_to_index[std::min<std::size_t>(static_cast<std::size_t>(rank), n - 1)];
+      }
+      break;
+    }
+  }
+  return result;
+}
+
+// keys are ordered like their indices on the left side and scrambled on
+// the right side, so the two trees see different insertion orders
+template <typename Key>
+Key make_key(std::uint64_t i);
+
+template <>
+std::uint64_t make_key<std::uint64_t>(std::uint64_t i) {
+  return i;
+}
+
+template <>
+std::string make_key<std::string>(std::uint64_t i) {
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "key-%020llu", static_cast<unsigned long long>(i));
+  return buf;
+}
+
+template <typename Key>
+Key left_key(std::uint64_t i) {
+  return make_key<Key>(2 * i);
+}
+
+template <typename Key>
+Key right_key(std::uint64_t i) {
+  return make_key<Key>(2 * (i * 0x9E3779B97F4A7C15ull >> 1));
+}
+
+template <typename Key>
+char const* key_name();
+template <>
+char const* key_name<std::uint64_t>() {
+  return "u64";
+}
+template <>
+char const* key_name<std::string>() {
+  return "string";
+}
+
+template <typename Key>
+struct bimap_adapter {
+  static char const* name() {
+    return "bimap";
+  }
+
+  bimap<Key, Key> m;
+
+  void insert(Key const& l, Key const& r) {
+    m.insert(l, r);
+  }
+  bool find_left(Key const& l) const {
+    return m.find_left(l) != m.end_left();
+  }
+  bool find_right(Key const& r) const {
+    return m.find_right(r) != m.end_right();
+  }
+  Key const& at_left(Key const& l) const {
+    return m.at_left(l);
+  }
+  Key const& at_right(Key const& r) const {
+    return m.at_right(r);
+  }
+  Key const& at_left_or_default(Key const& l) {
+    return m.at_left_or_default(l);
+  }
+  void erase_left(Key const& l) {
+    m.erase_left(l);
+  }
+  void erase_right(Key const& r) {
+    m.erase_right(r);
+  }
+  void erase_left_range(Key const& lo, Key const& hi) {
+    m.erase_left(m.lower_bound_left(lo), m.lower_bound_left(hi));
+  }
+  bool lower_bound_left(Key const& l) const {
+    return m.lower_bound_left(l) != m.end_left();
+  }
+  bool lower_bound_right(Key const& r) const {
+    return m.lower_bound_right(r) != m.end_right();
+  }
+  std::size_t iterate() const {
+    std::size_t n = 0;
+    for (auto it = m.begin_left(); it != m.end_left(); ++it) {
+      benchmark::DoNotOptimize(&*it.flip());
+      ++n;
+    }
+    return n;
+  }
+};
+
+template <typename Key>
+struct std_maps_adapter {
+  static char const* name() {
+    return "std_maps";
+  }
+
+  std::map<Key, Key> left;
+  std::map<Key, Key> right;
+
+  void insert(Key const& l, Key const& r) {
+    if (left.count(l) == 0 && right.count(r) == 0) {
+      left.emplace(l, r);
+      right.emplace(r, l);
+    }
+  }
+  bool find_left(Key const& l) const {
+    return left.find(l) != left.end();
+  }
+  bool find_right(Key const& r) const {
+    return right.find(r) != right.end();
+  }
+  Key const& at_left(Key const& l) const {
+    return left.at(l);
+  }
+  Key const& at_right(Key const& r) const {
+    return right.at(r);
+  }
+  Key const& at_left_or_default(Key const& l) {
+    auto it = left.find(l);
+    if (it != left.end()) {
+      return it->second;
+    }
+    auto old = right.find(Key());
+    if (old != right.end()) {
+      left.erase(old->second);
+      right.erase(old);
+    }
+    right.emplace(Key(), l);
+    return left.emplace(l, Key()).first->second;
+  }
+  void erase_left(Key const& l) {
+    auto it = left.find(l);
+    if (it != left.end()) {
+      right.erase(it->second);
+      left.erase(it);
+    }
+  }
+  void erase_right(Key const& r) {
+    auto it = right.find(r);
+    if (it != right.end()) {
+      left.erase(it->second);
+      right.erase(it);
+    }
+  }
+  void erase_left_range(Key const& lo, Key const& hi) {
+    auto first = left.lower_bound(lo);
+    auto last = left.lower_bound(hi);
+    for (auto it = first; it != last; ++it) {
+      right.erase(it->second);
+    }
+    left.erase(first, last);
+  }
+  bool lower_bound_left(Key const& l) const {
+    return left.lower_bound(l) != left.end();
+  }
+  bool lower_bound_right(Key const& r) const {
+    return right.lower_bound(r) != right.end();
+  }
+  std::size_t iterate() const {
+    std::size_t n = 0;
+    for (auto const& p : left) {
+      benchmark::DoNotOptimize(&right.find(p.second)->second);
+      ++n;
+    }
+    return n;
+  }
+};
+
+#ifdef BIMAP_BENCH_BOOST
+template <typename Key>
+struct boost_adapter {
+  static char const* name() {
+    return "boost_bimap";
+  }
+
+  using map_type = boost::bimaps::bimap<boost::bimaps::set_of<Key>,
+                                        boost::bimaps::set_of<Key>>;
+  map_type m;
+
+  void insert(Key const& l, Key const& r) {
+    m.insert(typename map_type::value_type(l, r));
+  }
+  bool find_left(Key const& l) const {
+    return m.left.find(l) != m.left.end();
+  }
+  bool find_right(Key const& r) const {
+    return m.right.find(r) != m.right.end();
+  }
+  Key const& at_left(Key const& l) const {
+    return m.left.at(l);
+  }
+  Key const& at_right(Key const& r) const {
+    return m.right.at(r);
+  }
+  Key const& at_left_or_default(Key const& l) {
+    auto it = m.left.find(l);
+    if (it != m.left.end()) {
+      return it->second;
+    }
+    m.right.erase(Key());
+    return m.left.insert(typename map_type::left_value_type(l, Key())).first->second;
+  }
+  void erase_left(Key const& l) {
+    m.left.erase(l);
+  }
+  void erase_right(Key const& r) {
+    m.right.erase(r);
+  }
+  void erase_left_range(Key const& lo, Key const& hi) {
+    m.left.erase(m.left.lower_bound(lo), m.left.lower_bound(hi));
+  }
+  bool lower_bound_left(Key const& l) const {
+    return m.left.lower_bound(l) != m.left.end();
+  }
+  bool lower_bound_right(Key const& r) const {
+    return m.right.lower_bound(r) != m.right.end();
+  }
+  std::size_t iterate() const {
+    std::size_t n = 0;
+    for (auto const& p : m.left) {
+      benchmark::DoNotOptimize(&p.second);
+      ++n;
+    }
+    return n;
+  }
+};
+#endif
+
+template <typename Map, typename Key>
+struct fixture {
+  std::size_t n;
+  std::vector<std::uint64_t> stream;
+  std::vector<Key> lefts;  // left key of every index
+  std::vector<Key> rights; // right key of every index
+  std::vector<Key> probes; // keys i: every other one is stored on the left
+
+  fixture(distribution d, std::size_t n) : n(n), stream(index_stream(d, n)) {
+    lefts.reserve(n);
+    rights.reserve(n);
+    probes.reserve(n);
+    for (std::size_t i = 0; i < n; ++i) {
+      lefts.push_back(left_key<Key>(i));
+      rights.push_back(right_key<Key>(i));
+      probes.push_back(make_key<Key>(i));
+    }
+  }
+
+  // inserts every index in stream order, returns the bytes allocated
+  std::size_t fill(Map& m) const {
+    std::size_t const before = allocated_bytes.load();
+    for (auto i : stream) {
+      m.insert(lefts[i], rights[i]);
+    }
+    return allocated_bytes.load() - before;
+  }
+
+  // map holding every index, for the lookup benchmarks
+  Map full(std::size_t& bytes) const {
+    Map m;
+    std::size_t const before = allocated_bytes.load();
+    for (std::size_t i = 0; i < n; ++i) {
+      m.insert(lefts[i], rights[i]);
+    }
+    bytes = allocated_bytes.load() - before;
+    return m;
+  }
+};
+
+void report(benchmark::State& state, std::size_t ops, std::size_t entries,
+            std::size_t bytes) {
+  state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * ops));
+  state.counters["time/op"] = benchmark::Counter(
+      static_cast<double>(state.iterations() * ops),
+      benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+  state.counters["bytes/entry"] =
+      entries == 0 ? 0.0 : static_cast<double>(bytes) / static_cast<double>(entries);
+}
+
+template <typename Map, typename Key>
+void bench_insert(benchmark::State& state, distribution d, std::size_t n) {
+  fixture<Map, Key> f(d, n);
+  std::size_t bytes = 0;
+  std::size_t entries = 0;
+  for (auto _ : state) {
+    auto* m = new Map();
+    bytes = f.fill(*m);
+    state.PauseTiming();
+    entries = m->iterate();
+    delete m;
+    state.ResumeTiming();
+  }
+  report(state, n, entries, bytes);
+}
+
+// Op(map, fixture, index) runs once per stream element on a full map
+template <typename Map, typename Key, typename Op>
+void bench_lookup(benchmark::State& state, distribution d, std::size_t n, Op op) {
+  fixture<Map, Key> f(d, n);
+  std::size_t bytes = 0;
+  Map const m = f.full(bytes);
+  for (auto _ : state) {
+    for (auto i : f.stream) {
+      op(m, f, i);
+    }
+  }
+  report(state, n, n, bytes);
+}
+
+// Op(map, fixture, index) runs once per stream element on a fresh full map
+template <typename Map, typename Key, typename Op>
+void bench_mutation(benchmark::State& state, distribution d, std::size_t n, Op op) {
+  fixture<Map, Key> f(d, n);
+  std::size_t bytes = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto* m = new Map(f.full(bytes));
+    state.ResumeTiming();
+    for (auto i : f.stream) {
+      op(*m, f, i);
+    }
+    state.PauseTiming();
+    delete m;
+    state.ResumeTiming();
+  }
+  report(state, n, n, bytes);
+}
+
+template <typename Map, typename Key>
+void bench_iterate(benchmark::State& state, distribution d, std::size_t n) {
+  fixture<Map, Key> f(d, n);
+  std::size_t bytes = 0;
+  Map const m = f.full(bytes);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(m.iterate());
+  }
+  report(state, n, n, bytes);
+}
+
+template <typename Map, typename Key>
+void bench_copy(benchmark::State& state, distribution d, std::size_t n) {
+  fixture<Map, Key> f(d, n);
+  std::size_t bytes = 0;
+  Map m;
+  bytes = f.fill(m);
+  for (auto _ : state) {
+    auto* copy = new Map(m);
+    benchmark::DoNotOptimize(copy);
+    state.PauseTiming();
+    delete copy;
+    state.ResumeTiming();
+  }
+  report(state, n, n, bytes);
+}
+
+template <typename Map, typename Key>
+void register_all(distribution d, std::size_t n) {
+  std::string const suffix = std::string("/") + Map::name() + "/" + key_name<Key>() +
+                             "/" + name(d) + "/" + std::to_string(n);
+  auto add = [&](char const* op, auto fn) {
+    benchmark::RegisterBenchmark((op + suffix).c_str(), fn)
+        ->Unit(benchmark::kMillisecond);
+  };
+  using F = fixture<Map, Key>;
+
+  add("insert", [=](benchmark::State& s) {
+    bench_insert<Map, Key>(s, d, n);
+  });
+  add("find_left", [=](benchmark::State& s) {
+    bench_lookup<Map, Key>(s, d, n, [](Map const& m, F const& f, std::uint64_t i) {
+      benchmark::DoNotOptimize(m.find_left(f.lefts[i]));
+    });
+  });
+  add("find_right", [=](benchmark::State& s) {
+    bench_lookup<Map, Key>(s, d, n, [](Map const& m, F const& f, std::uint64_t i) {
+      benchmark::DoNotOptimize(m.find_right(f.rights[i]));
+    });
+  });
+  add("at_left", [=](benchmark::State& s) {
+    bench_lookup<Map, Key>(s, d, n, [](Map const& m, F const& f, std::uint64_t i) {
+      benchmark::DoNotOptimize(&m.at_left(f.lefts[i]));
+    });
+  });
+  add("at_right", [=](benchmark::State& s) {
+    bench_lookup<Map, Key>(s, d, n, [](Map const& m, F const& f, std::uint64_t i) {
+      benchmark::DoNotOptimize(&m.at_right(f.rights[i]));
+    });
+  });
+  // half of the probes fall between stored keys
+  add("lower_bound_left", [=](benchmark::State& s) {
+    bench_lookup<Map, Key>(s, d, n, [](Map const& m, F const& f, std::uint64_t i) {
+      benchmark::DoNotOptimize(m.lower_bound_left(f.probes[i]));
+    });
+  });
+  add("lower_bound_right", [=](benchmark::State& s) {
+    bench_lookup<Map, Key>(s, d, n, [](Map const& m, F const& f, std::uint64_t i) {
+      benchmark::DoNotOptimize(m.lower_bound_right(f.rights[i]));
+    });
+  });
+  add("erase_left", [=](benchmark::State& s) {
+    bench_mutation<Map, Key>(s, d, n, [](Map& m, F const& f, std::uint64_t i) {
+      m.erase_left(f.lefts[i]);
+    });
+  });
+  add("erase_right", [=](benchmark::State& s) {
+    bench_mutation<Map, Key>(s, d, n, [](Map& m, F const& f, std::uint64_t i) {
+      m.erase_right(f.rights[i]);
+    });
+  });
+  // each step erases the stored keys of [i, i + 16)
+  add("erase_range", [=](benchmark::State& s) {
+    bench_mutation<Map, Key>(s, d, n, [](Map& m, F const&, std::uint64_t i) {
+      m.erase_left_range(left_key<Key>(i), left_key<Key>(i + 16));
+    });
+  });
+  // half of the probes are absent, each of those re-keys the default pair
+  add("at_left_or_default", [=](benchmark::State& s) {
+    bench_mutation<Map, Key>(s, d, n, [](Map& m, F const& f, std::uint64_t i) {
+      benchmark::DoNotOptimize(&m.at_left_or_default(f.probes[i]));
+    });
+  });
+  add("iterate", [=](benchmark::State& s) {
+    bench_iterate<Map, Key>(s, d, n);
+  });
+  add("copy", [=](benchmark::State& s) {
+    bench_copy<Map, Key>(s, d, n);
+  });
+}
+
+template <typename Key>
+void register_key() {
+  for (std::size_t n = 1000; n <= BIMAP_BENCH_MAX_SIZE; n *= 10) {
+    for (auto d : {distribution::sorted, distribution::reverse, distribution::random,
+                   distribution::zipf}) {
+      register_all<bimap_adapter<Key>, Key>(d, n);
+      register_all<std_maps_adapter<Key>, Key>(d, n);
+#ifdef BIMAP_BENCH_BOOST
+      register_all<boost_adapter<Key>, Key>(d, n);
+#endif
+    }
+  }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  register_key<std::uint64_t>();
+  register_key<std::string>();
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
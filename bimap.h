@@ -1,8 +1,22 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "fork_join.h"
 #include "intrusive_tree.h"
+#include "key_prefix.h"
 
 struct left_tag;
 struct right_tag;
@@ -13,12 +27,34 @@ using Other = std::conditional_t<
     right_tag,
     left_tag>;
 
+// marks input ordered by left keys without duplicate left keys
+struct sorted_unique_t {
+  explicit sorted_unique_t() = default;
+};
+inline constexpr sorted_unique_t sorted_unique{};
+
+// selects the parallel bulk builds; threads = 0 uses every hardware thread
+struct parallel_t {
+  unsigned threads{0};
+};
+inline constexpr parallel_t parallel{};
+
+// OrderStatistics keeps subtree sizes in both trees: one more word per
+// hook for O(log n) rank_*, nth_*, count_range_* and random access iterators
+//
+// Stats = tree_stats counts comparisons, descent depths, rotations and node
+// allocations, reported by stats(); the default no_stats costs nothing
 template <typename Left, typename Right,
           typename CompareLeft = std::less<Left>,
-          typename CompareRight = std::less<Right>>
-struct bimap {
+          typename CompareRight = std::less<Right>,
+          typename Allocator = std::allocator<std::pair<Left, Right>>,
+          bool OrderStatistics = false,
+          typename Stats = no_stats>
+struct bimap : private stats_holder<Stats, bimap<Left, Right, CompareLeft, CompareRight,
+                                                 Allocator, OrderStatistics, Stats>> {
   using left_t = Left;
   using right_t = Right;
+  using allocator_type = Allocator;
   template <typename Side>
   using key_t = std::conditional_t<
       std::is_same_v<Side, left_tag>,
@@ -33,26 +69,37 @@ struct bimap {
 
 private:
   struct node_t;
+  template <typename Side>
+  using tree_type = intr_tree<node_t, Side, key_t<Side>, Comparator<Side>,
+                              OrderStatistics, Stats>;
+  template <typename Side>
+  using hook_type = prefix_hook<std::conditional_t<OrderStatistics,
+                                                   counted_tree_element<Side>,
+                                                   tree_element<Side>>,
+                                Comparator<Side>>;
+  using node_allocator =
+      typename std::allocator_traits<Allocator>::template rebind_alloc<node_t>;
+  using node_traits = std::allocator_traits<node_allocator>;
 public:
 
   template <typename Side>
   struct base_iterator {
     friend bimap;
-    using iterator_category = std::bidirectional_iterator_tag;
+    using iterator_category = std::conditional_t<OrderStatistics,
+                                                 std::random_access_iterator_tag,
+                                                 std::bidirectional_iterator_tag>;
     using difference_type = std::ptrdiff_t;
     using value_type = key_t<Side>;
     using pointer = value_type const*;
     using reference = value_type const&;
 
-    using tree_t = intr_tree<node_t, Side, key_t<Side>,
-                                   Comparator<Side>>;
-    using tree_other_t = intr_tree<node_t, Other<Side>, key_t<Other<Side>>,
-                        Comparator<Other<Side>>>;
+    using tree_t = tree_type<Side>;
+    using tree_other_t = tree_type<Other<Side>>;
 
     base_iterator() = default;
 
-    base_iterator(base_iterator const& other) : it(other.it), map_p(other.map_p)
-    {}
+    base_iterator(base_iterator const& other) : it(other.it) {}
+    base_iterator& operator=(base_iterator const& other) = default;
 
     reference operator*() const {
       return it->template key<Side>();
@@ -81,15 +128,9 @@ public:
       return tmp;
     }
 
+    // O(1) without the map, end() goes to the other end()
     base_iterator<Other<Side>> flip() const {
-      if (it == map_p->template tree<Side>().end()) {
-        return base_iterator<Other<Side>>(
-            map_p->template tree<Other<Side>>().end(),
-            map_p);
-      }
-
-      return base_iterator<Other<Side>>(
-          tree_other_t::as_iterator(*it), map_p);
+      return base_iterator<Other<Side>>(tree_t::template flip<tree_other_t>(it));
     }
 
     friend bool operator==(base_iterator const& a, base_iterator const& b) {
@@ -100,12 +141,50 @@ public:
       return !(a == b);
     }
 
+    // random access in O(log n), only with OrderStatistics
+    base_iterator& operator+=(difference_type n) {
+      it = tree_t::advance(it, n);
+      return *this;
+    }
+    base_iterator& operator-=(difference_type n) {
+      return *this += -n;
+    }
+
+    friend base_iterator operator+(base_iterator a, difference_type n) {
+      return a += n;
+    }
+    friend base_iterator operator+(difference_type n, base_iterator a) {
+      return a += n;
+    }
+    friend base_iterator operator-(base_iterator a, difference_type n) {
+      return a -= n;
+    }
+    friend difference_type operator-(base_iterator const& a, base_iterator const& b) {
+      return static_cast<difference_type>(tree_t::index_of(a.it)) -
+             static_cast<difference_type>(tree_t::index_of(b.it));
+    }
+
+    reference operator[](difference_type n) const {
+      return *(*this + n);
+    }
+
+    friend bool operator<(base_iterator const& a, base_iterator const& b) {
+      return a - b < 0;
+    }
+    friend bool operator>(base_iterator const& a, base_iterator const& b) {
+      return b < a;
+    }
+    friend bool operator<=(base_iterator const& a, base_iterator const& b) {
+      return !(b < a);
+    }
+    friend bool operator>=(base_iterator const& a, base_iterator const& b) {
+      return !(a < b);
+    }
+
   private:
     typename tree_t::iterator it;
-    bimap const* map_p;
 
-    base_iterator(typename tree_t::iterator&& it, bimap const* p)
-        : it(std::move(it)), map_p(p) {}
+    explicit base_iterator(typename tree_t::iterator it) : it(it) {}
   };
 
   using right_iterator = base_iterator<right_tag>;
@@ -116,20 +195,152 @@ public:
       left_iterator,
       right_iterator>;
 
+  // owns a pair extracted from a bimap, keys may be modified before it is
+  // inserted back into this or another bimap with an equal allocator
+  struct node_type {
+    friend bimap;
+
+    node_type() noexcept = default;
+
+    node_type(node_type&& other) noexcept
+        : node(other.node), alloc(std::move(other.alloc)) {
+      other.node = nullptr;
+      other.alloc.reset();
+    }
+
+    node_type& operator=(node_type&& other) noexcept {
+      if (this != &other) {
+        reset();
+        node = other.node;
+        alloc = std::move(other.alloc);
+        other.node = nullptr;
+        other.alloc.reset();
+      }
+      return *this;
+    }
+
+    ~node_type() {
+      reset();
+    }
+
+    bool empty() const noexcept {
+      return node == nullptr;
+    }
+    explicit operator bool() const noexcept {
+      return !empty();
+    }
+
+    left_t& left() const {
+      return node->template key<left_tag>();
+    }
+    right_t& right() const {
+      return node->template key<right_tag>();
+    }
+
+    allocator_type get_allocator() const {
+      return allocator_type(*alloc);
+    }
+
+    void swap(node_type& other) noexcept {
+      std::swap(node, other.node);
+      std::swap(alloc, other.alloc);
+    }
+
+  private:
+    node_t* node{nullptr};
+    std::optional<node_allocator> alloc;
+
+    node_type(node_t* node, node_allocator const& alloc)
+        : node(node), alloc(alloc) {}
+
+    void reset() noexcept {
+      if (node) {
+        node_traits::destroy(*alloc, node);
+        node_traits::deallocate(*alloc, node, 1);
+        node = nullptr;
+      }
+      alloc.reset();
+    }
+  };
+
+  struct insert_return_type {
+    left_iterator position;
+    bool inserted;
+    node_type node;
+  };
+
   explicit bimap(CompareLeft compare_left = CompareLeft(),
-                 CompareRight compare_right = CompareRight())
+                 CompareRight compare_right = CompareRight(),
+                 Allocator const& alloc = Allocator())
       : left_tree(compare_left),
-        right_tree(compare_right) {}
+        right_tree(compare_right),
+        alloc_(alloc) {
+    left_tree.pair_ends(right_tree);
+  }
+
+  explicit bimap(Allocator const& alloc)
+      : alloc_(alloc) {
+    left_tree.pair_ends(right_tree);
+  }
+
+  // pairs are inserted one by one, later duplicates are skipped
+  template <typename InputIt>
+  bimap(InputIt first, InputIt last,
+        CompareLeft compare_left = CompareLeft(),
+        CompareRight compare_right = CompareRight(),
+        Allocator const& alloc = Allocator())
+      : bimap(compare_left, compare_right, alloc) {
+    assign(first, last);
+  }
+
+  // builds both trees directly in O(n log n) for the sort of right keys;
+  // pairs with an already taken right key are skipped
+  template <typename InputIt>
+  bimap(sorted_unique_t, InputIt first, InputIt last,
+        CompareLeft compare_left = CompareLeft(),
+        CompareRight compare_right = CompareRight(),
+        Allocator const& alloc = Allocator())
+      : bimap(compare_left, compare_right, alloc) {
+    assign(sorted_unique, first, last);
+  }
+
+  // builds both trees from pairs in any order on several threads: nodes
+  // are created in chunks, keys sorted by a parallel merge sort and the two
+  // trees linked at the same time. Keeps the same pairs as inserting them
+  // one by one, as bimap(first, last) does.
+  template <typename RandomIt>
+  bimap(parallel_t policy, RandomIt first, RandomIt last,
+        CompareLeft compare_left = CompareLeft(),
+        CompareRight compare_right = CompareRight(),
+        Allocator const& alloc = Allocator())
+      : bimap(compare_left, compare_right, alloc) {
+    assign(policy, first, last);
+  }
+
+  // copies other on several threads
+  bimap(parallel_t policy, bimap const& other)
+      : left_tree(other.left_tree),
+        right_tree(other.right_tree),
+        alloc_(node_traits::select_on_container_copy_construction(other.alloc_)) {
+    left_tree.pair_ends(right_tree);
+    copy_from(other, policy);
+  }
 
   bimap(bimap const& other)
       : left_tree(other.left_tree),
-        right_tree(other.right_tree) {
+        right_tree(other.right_tree),
+        alloc_(node_traits::select_on_container_copy_construction(other.alloc_)) {
+    left_tree.pair_ends(right_tree);
     copy_from(other);
   }
   bimap(bimap&& other) noexcept
       : left_tree(std::move(other.left_tree)),
         right_tree(std::move(other.right_tree)),
-        size_(other.size_) {}
+        alloc_(std::move(other.alloc_)),
+        size_(other.size_) {
+    left_tree.pair_ends(right_tree);
+    other.size_ = 0;
+  }
 
   bimap& operator=(bimap const &other) {
     if (this != &other) {
@@ -137,16 +348,32 @@ public:
       // change comparators:
       left_tree = other.left_tree;
       right_tree = other.right_tree;
+      if constexpr (node_traits::propagate_on_container_copy_assignment::value) {
+        alloc_ = other.alloc_;
+      }
       copy_from(other);
     }
     return *this;
   }
-  bimap& operator=(bimap &&other) noexcept {
+  bimap& operator=(bimap &&other) noexcept(
+      node_traits::propagate_on_container_move_assignment::value ||
+      node_traits::is_always_equal::value) {
     if (this != &other) {
       clear();
+      if constexpr (node_traits::propagate_on_container_move_assignment::value) {
+        alloc_ = std::move(other.alloc_);
+      } else if (alloc_ != other.alloc_) {
+        // nodes can't change hands, copy them into our own storage
+        left_tree = other.left_tree;
+        right_tree = other.right_tree;
+        copy_from(other);
+        other.clear();
+        return *this;
+      }
       left_tree = std::move(other.left_tree);
       right_tree = std::move(other.right_tree);
       size_ = other.size_;
+      other.size_ = 0;
     }
     return *this;
   }
@@ -154,9 +381,117 @@ public:
   void swap(bimap& other) {
     left_tree.swap(other.left_tree);
     right_tree.swap(other.right_tree);
+    if constexpr (node_traits::propagate_on_container_swap::value) {
+      std::swap(alloc_, other.alloc_);
+    }
     std::swap(size_, other.size_);
   }
 
+  template <typename InputIt>
+  void assign(InputIt first, InputIt last) {
+    clear();
+    for (; first != last; ++first) {
+      auto&& lr = *first;
+      insert(end_left(), std::get<0>(std::forward<decltype(lr)>(lr)),
+             std::get<1>(std::forward<decltype(lr)>(lr)));
+    }
+  }
+
+  template <typename InputIt>
+  void assign(sorted_unique_t, InputIt first, InputIt last) {
+    clear();
+    std::vector<node_t*> by_left;
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag,
+                      typename std::iterator_traits<InputIt>::iterator_category>) {
+      by_left.reserve(static_cast<std::size_t>(std::distance(first, last)));
+    }
+    try {
+      for (; first != last; ++first) {
+        auto&& lr = *first;
+        by_left.push_back(create_node(std::get<0>(std::forward<decltype(lr)>(lr)),
+                                      std::get<1>(std::forward<decltype(lr)>(lr))));
+      }
+      build_from_nodes(by_left, true);
+    } catch (...) {
+      for (auto* node : by_left) {
+        destroy_node(node);
+      }
+      throw;
+    }
+  }
+
+  template <typename RandomIt>
+  void assign(parallel_t policy, RandomIt first, RandomIt last) {
+    static_assert(std::is_base_of_v<std::random_access_iterator_tag,
+                      typename std::iterator_traits<RandomIt>::iterator_category>,
+                  "parallel build needs random access input");
+    clear();
+    auto const n = static_cast<std::size_t>(last - first);
+    unsigned const threads = fork_join::threads(policy.threads, n);
+    // in input order
+    std::vector<node_t*> nodes(n);
+    try {
+      create_nodes(nodes, threads, [&](std::size_t i) {
+        auto&& lr = first[static_cast<std::ptrdiff_t>(i)];
+        return construct_node(std::get<0>(lr), std::get<1>(lr));
+      });
+
+      // input positions by each key, stable so that equal keys stay in
+      // input order, and the number of the distinct key of every position
+      std::vector<std::size_t> by_left(n);
+      std::vector<std::size_t> by_right(n);
+      std::vector<std::size_t> left_key(n);
+      std::vector<std::size_t> right_key(n);
+      auto sort_left = [&] {
+        sort_positions<left_tag>(nodes, by_left, left_key, threads - threads / 2);
+      };
+      auto sort_right = [&] {
+        sort_positions<right_tag>(nodes, by_right, right_key, threads / 2);
+      };
+      if (threads > 1) {
+        fork_join::both(sort_left, sort_right);
+      } else {
+        sort_left();
+        sort_right();
+      }
+
+      // the choice of insert one by one: a pair is kept unless an earlier
+      // kept pair took one of its keys; only numbers are compared now
+      std::vector<bool> left_taken(n);
+      std::vector<bool> right_taken(n);
+      for (std::size_t i = 0; i < n; ++i) {
+        if (left_taken[left_key[i]] || right_taken[right_key[i]]) {
+          destroy_node(std::exchange(nodes[i], nullptr));
+        } else {
+          left_taken[left_key[i]] = right_taken[right_key[i]] = true;
+        }
+      }
+
+      std::vector<node_t*> left_order;
+      std::vector<node_t*> right_order;
+      left_order.reserve(n);
+      right_order.reserve(n);
+      for (std::size_t i : by_left) {
+        if (nodes[i] != nullptr) {
+          left_order.push_back(nodes[i]);
+        }
+      }
+      for (std::size_t i : by_right) {
+        if (nodes[i] != nullptr) {
+          right_order.push_back(nodes[i]);
+        }
+      }
+      link_sorted(left_order, right_order, threads);
+    } catch (...) {
+      destroy_nodes(nodes);
+      throw;
+    }
+  }
+
+  allocator_type get_allocator() const {
+    return allocator_type(alloc_);
+  }
+
   ~bimap() {
     clear();
   }
@@ -174,18 +509,144 @@ public:
     return insert_(std::move(left), std::move(right));
   }
 
+  // inserts right before hint in amortized O(1) on the left side
+  // when the hint is correct
+  left_iterator insert(left_iterator hint, left_t const& left, right_t const& right) {
+    return insert_hint_(hint, left, right);
+  }
+  left_iterator insert(left_iterator hint, left_t const& left, right_t&& right) {
+    return insert_hint_(hint, left, std::move(right));
+  }
+  left_iterator insert(left_iterator hint, left_t&& left, right_t const& right) {
+    return insert_hint_(hint, std::move(left), right);
+  }
+  left_iterator insert(left_iterator hint, left_t&& left, right_t&& right) {
+    return insert_hint_(hint, std::move(left), std::move(right));
+  }
+
+  // builds the pair from args in place, the node is discarded if either
+  // key is already present
+  template <typename... Args>
+  left_iterator emplace_hint(left_iterator hint, Args&&... args) {
+    auto* node = create_node(std::forward<Args>(args)...);
+    return link_or_discard(
+        node, left_tree.find_insert_position(hint.it, node->template key<left_tag>()));
+  }
+
+  // builds the pair in place from anything std::pair<left_t, right_t>
+  // accepts; a key given as is (or as the only element of its tuple with
+  // std::piecewise_construct) is probed before the node is allocated
+  template <typename... Args>
+  left_iterator emplace(Args&&... args) {
+    if constexpr (is_key_pair<Args...>()) {
+      return insert_(std::forward<Args>(args)...);
+    } else {
+      auto* node = create_node(std::forward<Args>(args)...);
+      return link_or_discard(
+          node, left_tree.find_insert_position(node->template key<left_tag>()));
+    }
+  }
+
+  template <typename LeftArgs, typename RightArgs>
+  left_iterator emplace(std::piecewise_construct_t, LeftArgs&& left_args,
+                        RightArgs&& right_args) {
+    constexpr bool probe_left = is_key_tuple<left_tag, LeftArgs>();
+    constexpr bool probe_right = is_key_tuple<right_tag, RightArgs>();
+
+    auto left_pos = [&] {
+      if constexpr (probe_left) {
+        return left_tree.find_insert_position(std::get<0>(left_args));
+      } else {
+        return insert_position<left_tag>{};
+      }
+    }();
+    if (probe_left && left_pos.found != left_tree.end()) {
+      return end_left();
+    }
+    auto right_pos = [&] {
+      if constexpr (probe_right) {
+        return right_tree.find_insert_position(std::get<0>(right_args));
+      } else {
+        return insert_position<right_tag>{};
+      }
+    }();
+    if (probe_right && right_pos.found != right_tree.end()) {
+      return end_left();
+    }
+
+    auto* node = create_node(std::piecewise_construct,
+                             std::forward<LeftArgs>(left_args),
+                             std::forward<RightArgs>(right_args));
+    if constexpr (!probe_left) {
+      return link_or_discard(
+          node, left_tree.find_insert_position(node->template key<left_tag>()));
+    } else if constexpr (!probe_right) {
+      return link_or_discard(node, left_pos);
+    } else {
+      return link_node(node, left_pos, right_pos);
+    }
+  }
+
+  // relinks an extracted pair without allocating; on a key conflict the
+  // pair stays in the returned node
+  insert_return_type insert(node_type&& nh) {
+    if (nh.empty()) {
+      return {end_left(), false, node_type()};
+    }
+    auto* node = nh.node;
+    // the keys may have been changed through the handle
+    node->template refresh_prefix<left_tag>();
+    node->template refresh_prefix<right_tag>();
+    auto left_pos = left_tree.find_insert_position(node->template key<left_tag>());
+    if (left_pos.found == left_tree.end()) {
+      auto right_pos = right_tree.find_insert_position(node->template key<right_tag>());
+      if (right_pos.found == right_tree.end()) {
+        nh.node = nullptr;
+        nh.alloc.reset();
+        return {link_node(node, left_pos, right_pos), true, node_type()};
+      }
+    }
+    return {end_left(), false, std::move(nh)};
+  }
+
+  // unlinks the pair from both trees without freeing it
+  node_type extract_left(left_iterator it) {
+    return extract<left_tag>(it);
+  }
+  node_type extract_left(left_t const& left) {
+    return extract<left_tag>(find_left(left));
+  }
+  node_type extract_right(right_iterator it) {
+    return extract<right_tag>(it);
+  }
+  node_type extract_right(right_t const& right) {
+    return extract<right_tag>(find_right(right));
+  }
+
   left_iterator erase_left(left_iterator it) {
     return erase<left_tag>(it);
   }
   bool erase_left(left_t const& left) {
-    return erase<left_tag>(left);
+    return erase_key<left_tag>(left);
+  }
+  // heterogeneous lookups below need CompareLeft/CompareRight
+  // to define is_transparent
+  template <typename K, typename C = CompareLeft, typename = typename C::is_transparent,
+      typename = std::enable_if_t<!std::is_convertible_v<K const&, left_iterator>>>
+  bool erase_left(K const& left) {
+    return erase_key<left_tag>(left);
   }
 
   right_iterator erase_right(right_iterator it) {
     return erase<right_tag>(it);
   }
   bool erase_right(right_t const& right) {
-    return erase<right_tag>(right);
+    return erase_key<right_tag>(right);
+  }
+  template <typename K, typename C = CompareRight, typename = typename C::is_transparent,
+      typename = std::enable_if_t<!std::is_convertible_v<K const&, right_iterator>>>
+  bool erase_right(K const& right) {
+    return erase_key<right_tag>(right);
   }
 
   left_iterator erase_left(left_iterator first, left_iterator last) {
@@ -195,19 +656,171 @@ public:
       return erase<right_tag>(first, last);
   }
 
+  // moves the pairs of source with both keys absent here without
+  // allocating, as std::map::merge does; the others stay in source.
+  // The allocators must compare equal. A small source is relinked pair
+  // by pair, a large one by a linear walk and a rebuild of both maps.
+  // Should a comparison throw, the linear walk leaves both maps unchanged;
+  // pair by pair, both stay valid with every pair in one of them.
+  void merge(bimap& source) {
+    if (&source == this || source.empty()) {
+      return;
+    }
+    std::size_t depth = 1;
+    for (std::size_t n = size_; n > 1; n /= 2) {
+      ++depth;
+    }
+    if (source.size_ * depth < size_) {
+      merge_by_insert(source);
+    } else {
+      merge_linear(source);
+    }
+  }
+  void merge(bimap&& source) {
+    merge(source);
+  }
+
+  // copies the pairs of other with both keys absent here, with O(n + m)
+  // key comparisons; the k copies are matched to the right order by
+  // address in O((n + m) log k). Returns the number of pairs of other
+  // left out because one of their keys is paired with a different key here
+  std::size_t union_with(bimap const& other) {
+    if (&other == this || other.empty()) {
+      return 0;
+    }
+    merge_plan plan = plan_merge(other);
+    std::vector<std::pair<node_t const*, node_t*>> copies;
+    copies.reserve(plan.left.size() - size_);
+    try {
+      for (std::size_t i = 0; i < plan.left.size(); ++i) {
+        if (plan.from_source[i]) {
+          node_t const* source = plan.left[i];
+          copies.emplace_back(source, create_node(source->template key<left_tag>(),
+                                                  source->template key<right_tag>()));
+          plan.left[i] = copies.back().second;
+        }
+      }
+    } catch (...) {
+      for (auto const& copy : copies) {
+        destroy_node(copy.second);
+      }
+      throw;
+    }
+    // the right order refers to the same pairs of other
+    std::sort(copies.begin(), copies.end());
+    for (auto& node : plan.right) {
+      auto copy = std::lower_bound(copies.begin(), copies.end(),
+                                   std::pair<node_t const*, node_t*>(node, nullptr));
+      if (copy != copies.end() && copy->first == node) {
+        node = copy->second;
+      }
+    }
+    rebuild(plan.left, plan.right);
+    return plan.conflicts;
+  }
+
+  // keeps only the pairs also in other, in O(n + m); returns the number
+  // of pairs removed
+  std::size_t intersect_with(bimap const& other) {
+    return &other == this ? 0 : filter_by<true>(other);
+  }
+
+  // removes the pairs also in other, in O(n + m); returns their number
+  std::size_t difference_with(bimap const& other) {
+    if (&other == this) {
+      std::size_t removed = size_;
+      clear();
+      return removed;
+    }
+    return filter_by<false>(other);
+  }
+
+  // moves the pairs with left keys not less than left into the returned
+  // map: O(log n) on the left side, and on the right side the smaller of
+  // the two parts is unlinked, sorted and rebuilt as one batch
+  bimap split_left(left_t const& left) {
+    return split<left_tag>(left_tree.lower_bound(left));
+  }
+  bimap split_right(right_t const& right) {
+    return split<right_tag>(right_tree.lower_bound(right));
+  }
+
+  // moves the pairs of other here, as merge does. When all keys of one
+  // side of other are greater than those here, as after a split, that
+  // side is joined in O(log n) and only the other side relinks, pair by
+  // pair with hints or, when other is not the smaller map, by one merge
+  // and rebuild; pairs whose key there is taken stay in other. Should a
+  // comparison throw, both maps stay valid with every pair in one of them.
+  void join(bimap&& other) {
+    if (&other == this || other.empty()) {
+      return;
+    }
+    if (empty()) {
+      swap_nodes(other);
+    } else if (static_cast<CompareLeft const&>(left_tree)(
+                   std::prev(left_tree.end())->template key<left_tag>(),
+                   other.left_tree.begin()->template key<left_tag>())) {
+      join_above<left_tag>(other);
+    } else if (static_cast<CompareRight const&>(right_tree)(
+                   std::prev(right_tree.end())->template key<right_tag>(),
+                   other.right_tree.begin()->template key<right_tag>())) {
+      join_above<right_tag>(other);
+    } else {
+      merge(other);
+    }
+  }
+
   left_iterator find_left(left_t const& left) const {
     return find<left_tag>(left);
   }
+  template <typename K, typename C = CompareLeft, typename = typename C::is_transparent>
+  left_iterator find_left(K const& left) const {
+    return find<left_tag>(left);
+  }
   right_iterator find_right(right_t const& right) const {
     return find<right_tag>(right);
   }
+  template <typename K, typename C = CompareRight, typename = typename C::is_transparent>
+  right_iterator find_right(K const& right) const {
+    return find<right_tag>(right);
+  }
+
+  // batched find_left: writes an iterator for every key of the forward
+  // range [first, last) to out, overlapping the descents' cache misses
+  template <typename KeyIt, typename OutIt>
+  OutIt find_left_batch(KeyIt first, KeyIt last, OutIt out) const {
+    return find_batch<left_tag>(first, last, out);
+  }
+  template <typename KeyIt, typename OutIt>
+  OutIt find_right_batch(KeyIt first, KeyIt last, OutIt out) const {
+    return find_batch<right_tag>(first, last, out);
+  }
+
+  // batched at_left: writes the paired keys to out, throws
+  // std::out_of_range at the first missing key
+  template <typename KeyIt, typename OutIt>
+  OutIt at_left_batch(KeyIt first, KeyIt last, OutIt out) const {
+    return at_batch<left_tag>(first, last, out);
+  }
+  template <typename KeyIt, typename OutIt>
+  OutIt at_right_batch(KeyIt first, KeyIt last, OutIt out) const {
+    return at_batch<right_tag>(first, last, out);
+  }
 
   right_t const& at_left(left_t const& key) const {
     return at<left_tag>(key);
   }
+  template <typename K, typename C = CompareLeft, typename = typename C::is_transparent>
+  right_t const& at_left(K const& key) const {
+    return at<left_tag>(key);
+  }
   left_t const& at_right(right_t const& key) const {
     return at<right_tag>(key);
   }
+  template <typename K, typename C = CompareRight, typename = typename C::is_transparent>
+  left_t const& at_right(K const& key) const {
+    return at<right_tag>(key);
+  }
 
   template <typename U = right_t,
       typename = std::enable_if_t<std::is_default_constructible_v<U>>>
@@ -223,16 +836,56 @@ public:
   left_iterator lower_bound_left(left_t const& left) const {
     return lower_bound<left_tag>(left);
   }
+  template <typename K, typename C = CompareLeft, typename = typename C::is_transparent>
+  left_iterator lower_bound_left(K const& left) const {
+    return lower_bound<left_tag>(left);
+  }
   left_iterator upper_bound_left(left_t const& left) const {
     return upper_bound<left_tag>(left);
   }
+  template <typename K, typename C = CompareLeft, typename = typename C::is_transparent>
+  left_iterator upper_bound_left(K const& left) const {
+    return upper_bound<left_tag>(left);
+  }
 
   right_iterator lower_bound_right(right_t const& right) const {
     return lower_bound<right_tag>(right);
   }
+  template <typename K, typename C = CompareRight, typename = typename C::is_transparent>
+  right_iterator lower_bound_right(K const& right) const {
+    return lower_bound<right_tag>(right);
+  }
   right_iterator upper_bound_right(right_t const& right) const {
     return upper_bound<right_tag>(right);
   }
+  template <typename K, typename C = CompareRight, typename = typename C::is_transparent>
+  right_iterator upper_bound_right(K const& right) const {
+    return upper_bound<right_tag>(right);
+  }
+
+  // number of pairs with left keys less than left
+  std::size_t rank_left(left_t const& left) const {
+    return left_tree.count_less(left);
+  }
+  std::size_t rank_right(right_t const& right) const {
+    return right_tree.count_less(right);
+  }
+
+  // pair with the given position by the side's order, end if out of range
+  left_iterator nth_left(std::size_t index) const {
+    return left_iterator(left_tree.nth(index));
+  }
+  right_iterator nth_right(std::size_t index) const {
+    return right_iterator(right_tree.nth(index));
+  }
+
+  // number of pairs with lo <= left <= hi
+  std::size_t count_range_left(left_t const& lo, left_t const& hi) const {
+    return count_range<left_tag>(lo, hi);
+  }
+  std::size_t count_range_right(right_t const& lo, right_t const& hi) const {
+    return count_range<right_tag>(lo, hi);
+  }
 
   left_iterator begin_left() const {
     return begin<left_tag>();
@@ -256,6 +909,56 @@ public:
     return size_;
   }
 
+  // bound on the longest root-to-leaf path of the side's tree, O(log n),
+  // cheap enough to sample; with Stats, stats().deepest_descent() is the
+  // deepest search actually seen
+  std::size_t height_left() const noexcept {
+    return left_tree.height();
+  }
+  std::size_t height_right() const noexcept {
+    return right_tree.height();
+  }
+
+  // nodes on the longest root-to-leaf path of the side's tree, O(n)
+  std::size_t exact_height_left() const noexcept {
+    return left_tree.exact_height();
+  }
+  std::size_t exact_height_right() const noexcept {
+    return right_tree.exact_height();
+  }
+
+  // black height of the side's tree, O(log n); the height is at most twice it
+  std::size_t black_height_left() const noexcept {
+    return left_tree.black_height();
+  }
+  std::size_t black_height_right() const noexcept {
+    return right_tree.black_height();
+  }
+
+  // checks both trees, see intr_tree::verify, and that each holds size()
+  // pairs; O(n log n), meant for tests and debugging
+  bool verify() const {
+    return left_tree.verify() && right_tree.verify() &&
+           static_cast<std::size_t>(std::distance(left_tree.begin(), left_tree.end())) == size_ &&
+           static_cast<std::size_t>(std::distance(right_tree.begin(), right_tree.end())) == size_;
+  }
+
+  // counters of both trees and of the node allocations, only with Stats enabled
+  template <typename S = Stats, typename = std::enable_if_t<S::enabled>>
+  Stats stats() const noexcept {
+    Stats result = this->stats_ref();
+    result += left_tree.stats();
+    result += right_tree.stats();
+    return result;
+  }
+
+  template <typename S = Stats, typename = std::enable_if_t<S::enabled>>
+  void reset_stats() noexcept {
+    this->stats_ref().reset();
+    left_tree.reset_stats();
+    right_tree.reset_stats();
+  }
+
   friend bool operator==(bimap const &a, bimap const &b) {
     if (a.size() != b.size()) {
       return false;
@@ -275,13 +978,31 @@ public:
 
 private:
   struct node_t
-      : tree_element<left_tag>,
-        tree_element<right_tag> {
+      : hook_type<left_tag>,
+        hook_type<right_tag> {
     node_t() = delete;
 
-    template <typename L, typename R>
-    node_t(L&& left, R&& right)
-        : lr(std::forward<L>(left), std::forward<R>(right)) {}
+    // anything std::pair<left_t, right_t> is constructible from,
+    // including std::piecewise_construct with two tuples
+    template <typename... Args>
+    explicit node_t(Args&&... args)
+        : lr(std::forward<Args>(args)...) {
+      refresh_prefix<left_tag>();
+      refresh_prefix<right_tag>();
+    }
+
+    template <typename Side>
+    auto key_prefix() const noexcept {
+      return static_cast<hook_type<Side> const&>(*this).key_prefix;
+    }
+
+    // recomputes the prefix cached for the Side key, if any
+    template <typename Side>
+    void refresh_prefix() noexcept {
+      if constexpr (has_key_prefix_v<Comparator<Side>>) {
+        static_cast<hook_type<Side>&>(*this).key_prefix = Comparator<Side>::prefix(key<Side>());
+      }
+    }
 
     template <typename Side>
     key_t<Side>& key() {
@@ -313,14 +1034,27 @@ private:
     std::pair<left_t, right_t> lr;
   };
 
-  intr_tree<node_t, left_tag, key_t<left_tag>,
-                  Comparator<left_tag>> left_tree;
-  intr_tree<node_t, right_tag, key_t<right_tag>,
-                  Comparator<right_tag>> right_tree;
+public:
+  // bytes taken by one stored pair
+  static constexpr std::size_t node_size = sizeof(node_t);
+
+private:
+  tree_type<left_tag> left_tree;
+  tree_type<right_tag> right_tree;
+  node_allocator alloc_;
   size_t size_{0};
 
   template <typename Side>
-  intr_tree<node_t, Side, key_t<Side>, Comparator<Side>> const& tree() const {
+  tree_type<Side> const& tree() const {
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return left_tree;
+    } else {
+      return right_tree;
+    }
+  }
+
+  template <typename Side>
+  tree_type<Side>& tree() {
     if constexpr (std::is_same_v<Side, left_tag>) {
       return left_tree;
     } else {
@@ -330,12 +1064,12 @@ private:
 
   template <typename Side>
   iterator<Side> begin() const {
-    return iterator<Side>(tree<Side>().begin(), this);
+    return iterator<Side>(tree<Side>().begin());
   }
 
   template <typename Side>
   iterator<Side> end() const {
-    return iterator<Side>(tree<Side>().end(), this);
+    return iterator<Side>(tree<Side>().end());
   }
 
   template <typename Side>
@@ -347,33 +1081,85 @@ private:
     --size_;
     auto* node = (it.it).operator->();
     auto next = ++it;
-    delete node;
+    left_tree.unlink(*node);
+    right_tree.unlink(*node);
+    destroy_node(node);
 
     return next;
   }
 
   template <typename Side>
-  bool erase(key_t<Side> const& key) {
-    auto erase_res = erase<Side>(find<Side>(key));
-    return !empty() ? erase_res != end<Side>() : erase_res == end<Side>();
+  node_type extract(iterator<Side> it) {
+    if (it == end<Side>()) {
+      return node_type();
+    }
+    auto* node = (it.it).operator->();
+    left_tree.unlink(*node);
+    right_tree.unlink(*node);
+    --size_;
+    return node_type(node, alloc_);
   }
 
+  template <typename Side, typename K>
+  bool erase_key(K const& key) {
+    auto it = find<Side>(key);
+    if (it == end<Side>()) {
+      return false;
+    }
+    erase<Side>(it);
+    return true;
+  }
+
+  // cuts [first, last) out of tree<Side>() with two splits and a join in
+  // O(log n). Up to half of the pairs, the other tree then loses the cut
+  // nodes one unlink and fixup at a time; past it, its survivors are
+  // relinked by build_from_sorted in O(n), which is no slower there
   template <typename Side>
   iterator<Side> erase(iterator<Side> first, iterator<Side> last) {
-    auto it = first;
-    while (it != last) {
-      it = erase<Side>(it);
+    if (first == last) {
+      return last;
+    }
+    tree_type<Side> range(tree<Side>());
+    tree_type<Side> rest(tree<Side>());
+    tree<Side>().split(first.it, range);
+    if (last != end<Side>()) {
+      range.split(last.it, rest);
+      tree<Side>().join(rest);
+    }
+
+    if (tree<Side>().empty()) {
+      tree<Other<Side>>().release();
+      range.clear_and_dispose([this](node_t* node) noexcept {
+        tree_type<Other<Side>>::unhook(*node);
+        destroy_node(node);
+      });
+      size_ = 0;
+      return last;
     }
-    return it;
+    auto const cut = static_cast<std::size_t>(std::distance(range.begin(), range.end()));
+    if (cut > size_ / range_rebuild_fraction) {
+      try {
+        rebuild_without_cut<Side>(range, cut);
+        return last;
+      } catch (std::bad_alloc const&) {
+        // no room for the survivors: unlink them one by one below
+      }
+    }
+    range.clear_and_dispose([this](node_t* node) noexcept {
+      tree<Other<Side>>().unlink(*node);
+      destroy_node(node);
+      --size_;
+    });
+    return last;
   }
 
-  template <typename Side>
-  iterator<Side> find(key_t<Side> const& key) const {
-    return iterator<Side>(tree<Side>().find(key), this);
+  template <typename Side, typename K>
+  iterator<Side> find(K const& key) const {
+    return iterator<Side>(tree<Side>().find(key));
   }
 
-  template <typename Side>
-  key_t<Other<Side>> const& at(key_t<Side> const& key) const {
+  template <typename Side, typename K>
+  key_t<Other<Side>> const& at(K const& key) const {
     auto it = find<Side>(key);
     if (it == end<Side>()) {
       throw std::out_of_range("No such element");
@@ -381,68 +1167,786 @@ private:
     return *it.flip();
   }
 
+  template <typename Side, typename KeyIt, typename OutIt>
+  OutIt find_batch(KeyIt first, KeyIt last, OutIt out) const {
+    tree<Side>().find_batch(first, last, [&](auto it) {
+      *out = iterator<Side>(std::move(it));
+      ++out;
+    });
+    return out;
+  }
+
+  template <typename Side, typename KeyIt, typename OutIt>
+  OutIt at_batch(KeyIt first, KeyIt last, OutIt out) const {
+    tree<Side>().find_batch(first, last, [&](auto it) {
+      if (it == tree<Side>().end()) {
+        throw std::out_of_range("No such element");
+      }
+      *out = *iterator<Side>(std::move(it)).flip();
+      ++out;
+    });
+    return out;
+  }
+
+  template <typename Side, typename K>
+  iterator<Side> lower_bound(K const& key) const {
+    return iterator<Side>(tree<Side>().lower_bound(key));
+  }
+  template <typename Side, typename K>
+  iterator<Side> upper_bound(K const& key) const {
+    return iterator<Side>(tree<Side>().upper_bound(key));
+  }
+
   template <typename Side>
-  iterator<Side> lower_bound(key_t<Side> const& key) const {
-    return iterator<Side>(tree<Side>().lower_bound(key), this);
+  std::size_t count_range(key_t<Side> const& lo, key_t<Side> const& hi) const {
+    auto const not_greater = tree<Side>().count_not_greater(hi);
+    auto const less = tree<Side>().count_less(lo);
+    return not_greater > less ? not_greater - less : 0;
   }
+
   template <typename Side>
-  iterator<Side> upper_bound(key_t<Side> const& key) const {
-    return iterator<Side>(tree<Side>().upper_bound(key), this);
+  using insert_position = typename tree_type<Side>::insert_position;
+
+  template <typename... Args>
+  static constexpr bool is_key_pair() {
+    return std::is_same_v<std::tuple<std::decay_t<Args>...>,
+                          std::tuple<left_t, right_t>>;
   }
 
+  // a tuple holding nothing but a key of Side
+  template <typename Side, typename Tuple>
+  static constexpr bool is_key_tuple() {
+    using tuple = std::decay_t<Tuple>;
+    if constexpr (std::tuple_size_v<tuple> == 1) {
+      return std::is_same_v<std::decay_t<std::tuple_element_t<0, tuple>>, key_t<Side>>;
+    } else {
+      return false;
+    }
+  }
+
+  // one descent per tree: the positions found while checking for
+  // duplicates are reused to link the node
   template <typename L, typename R>
   left_iterator insert_(L&& left, R&& right) {
-    if (find_left(left) != end_left() || find_right(right) != end_right()) {
+    auto left_pos = left_tree.find_insert_position(left);
+    if (left_pos.found != left_tree.end()) {
+      return end_left();
+    }
+    auto right_pos = right_tree.find_insert_position(right);
+    if (right_pos.found != right_tree.end()) {
       return end_left();
     }
 
-    return insert_no_check(std::forward<L>(left),
+    return insert_no_check(left_pos, right_pos,
+                           std::forward<L>(left),
                            std::forward<R>(right));
   }
 
   template <typename L, typename R>
-  left_iterator insert_no_check(L&& left, R&& right) {
+  left_iterator insert_hint_(left_iterator hint, L&& left, R&& right) {
+    auto left_pos = left_tree.find_insert_position(hint.it, left);
+    if (left_pos.found != left_tree.end()) {
+      return end_left();
+    }
+    auto right_pos = right_tree.find_insert_position(right);
+    if (right_pos.found != right_tree.end()) {
+      return end_left();
+    }
+
+    return insert_no_check(left_pos, right_pos,
+                           std::forward<L>(left),
+                           std::forward<R>(right));
+  }
+
+  template <typename L, typename R>
+  left_iterator insert_no_check(insert_position<left_tag> const& left_pos,
+                                insert_position<right_tag> const& right_pos,
+                                L&& left, R&& right) {
+    return link_node(create_node(std::forward<L>(left),
+                                 std::forward<R>(right)),
+                     left_pos, right_pos);
+  }
+
+  // links a freshly built node unless either key is taken, in which
+  // case it is destroyed
+  left_iterator link_or_discard(node_t* node,
+                                insert_position<left_tag> const& left_pos) noexcept {
+    if (left_pos.found == left_tree.end()) {
+      auto right_pos = right_tree.find_insert_position(node->template key<right_tag>());
+      if (right_pos.found == right_tree.end()) {
+        return link_node(node, left_pos, right_pos);
+      }
+    }
+    destroy_node(node);
+    return end_left();
+  }
+
+  left_iterator link_node(node_t* node,
+                          insert_position<left_tag> const& left_pos,
+                          insert_position<right_tag> const& right_pos) noexcept {
     ++size_;
-    auto* node = new node_t(std::forward<L>(left),
-                            std::forward<R>(right));
-    left_tree.insert(*node);
-    right_tree.insert(*node);
+    left_tree.insert_at(left_pos, *node);
+    right_tree.insert_at(right_pos, *node);
 
-    return left_iterator(left_tree.as_iterator(*node), this);
+    return left_iterator(left_tree.as_iterator(*node));
   }
 
+  template <typename L, typename R>
+  left_iterator insert_no_check(L&& left, R&& right) {
+    return insert_no_check(left_tree.find_insert_position(left),
+                           right_tree.find_insert_position(right),
+                           std::forward<L>(left),
+                           std::forward<R>(right));
+  }
+
+  // a hit costs one descent and a miss one descent per tree; if the
+  // default value is already paired, that pair is re-keyed by moving its
+  // node within tree<Side>(): an unlink and a relink next to the slot the
+  // first descent found, amortized O(1) on top of the rebalancing
   template <typename Side,
       typename = std::enable_if_t<
           std::is_default_constructible_v<key_t<Other<Side>>>>>
   key_t<Other<Side>> const& at_or_default(key_t<Side> const& key) {
-    auto it_side = find<Side>(key);
-    if (it_side != end<Side>()) {
-      return *it_side.flip();
+    auto pos = tree<Side>().find_insert_position(key);
+    if (pos.found != tree<Side>().end()) {
+      return pos.found->template key<Other<Side>>();
+    }
+
+    key_t<Other<Side>> other = key_t<Other<Side>>();
+    auto other_pos = tree<Other<Side>>().find_insert_position(other);
+    if (other_pos.found != tree<Other<Side>>().end()) {
+      node_t& node = *other_pos.found;
+      rekey<Side>(node, key, tree<Side>().next_of(pos));
+      return node.template key<Other<Side>>();
+    }
+
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return *insert_no_check(pos, other_pos, key, std::move(other)).flip();
     } else {
-      key_t<Other<Side>> other = key_t<Other<Side>>();
-      auto it_other = find<Other<Side>>(other);
+      return *insert_no_check(other_pos, pos, std::move(other), key);
+    }
+  }
 
-      if (it_other != end<Other<Side>>()) {
-        it_other.it->template key<Side>() = key;
-        return *it_other;
-      } else {
-        if constexpr (std::is_same_v<Side, left_tag>) {
-          return *insert_no_check(key, std::move(other)).flip();
+  // gives node the Side key key, which must be absent from the map, and
+  // relinks it before next, the element that follows key; if the key
+  // cannot be assigned the pair is erased
+  template <typename Side>
+  void rekey(node_t& node, key_t<Side> const& key, typename tree_type<Side>::iterator next) {
+    key_t<Side> copy(key);
+    if (next == tree<Side>().as_iterator(node)) {
+      ++next;
+    }
+    tree<Side>().unlink(node);
+    try {
+      node.template key<Side>() = std::move(copy);
+      node.template refresh_prefix<Side>();
+    } catch (...) {
+      tree<Other<Side>>().unlink(node);
+      --size_;
+      destroy_node(&node);
+      throw;
+    }
+    tree<Side>().insert(next, node);
+  }
+
+  template <typename... Args>
+  node_t* create_node(Args&&... args) {
+    node_t* node = construct_node(std::forward<Args>(args)...);
+    if constexpr (Stats::enabled) {
+      ++this->stats_ref().allocations;
+    }
+    return node;
+  }
+
+  // create_node without counting, safe to call from several threads
+  // when the allocator is
+  template <typename... Args>
+  node_t* construct_node(Args&&... args) {
+    node_t* node = node_traits::allocate(alloc_, 1);
+    try {
+      node_traits::construct(alloc_, node, std::forward<Args>(args)...);
+    } catch (...) {
+      node_traits::deallocate(alloc_, node, 1);
+      throw;
+    }
+    return node;
+  }
+
+  // nodes[i] = make(i) for every slot, in one chunk per thread when the
+  // allocator has no state (the global heap is thread-safe, pools are
+  // not); on exception the slots of the nodes made are left non-null
+  template <typename Make>
+  void create_nodes(std::vector<node_t*>& nodes, unsigned threads, Make const& make) {
+    std::fill(nodes.begin(), nodes.end(), nullptr);
+    if constexpr (!node_traits::is_always_equal::value) {
+      threads = 1;
+    }
+    std::size_t const n = nodes.size();
+    try {
+      fork_join::for_each_index(threads, [&](std::size_t t) {
+        for (std::size_t i = n * t / threads, e = n * (t + 1) / threads; i < e; ++i) {
+          nodes[i] = make(i);
+        }
+      });
+    } catch (...) {
+      count_allocations(nodes);
+      throw;
+    }
+    count_allocations(nodes);
+  }
+
+  void count_allocations(std::vector<node_t*> const& nodes) noexcept {
+    if constexpr (Stats::enabled) {
+      this->stats_ref().allocations += static_cast<std::size_t>(
+          nodes.size() - std::count(nodes.begin(), nodes.end(), nullptr));
+    }
+  }
+
+  // destroys the nodes made by create_nodes
+  void destroy_nodes(std::vector<node_t*>& nodes) noexcept {
+    for (auto* node : nodes) {
+      if (node != nullptr) {
+        destroy_node(node);
+      }
+    }
+    nodes.clear();
+  }
+
+  void destroy_node(node_t* node) noexcept {
+    node_traits::destroy(alloc_, node);
+    node_traits::deallocate(alloc_, node, 1);
+    if constexpr (Stats::enabled) {
+      ++this->stats_ref().deallocations;
+    }
+  }
+
+  // takes the left tree apart and resets the right hooks on the way, so
+  // destroying a node never unlinks or rebalances anything
+  void clear() noexcept {
+    right_tree.release();
+    left_tree.clear_and_dispose([this](node_t* node) noexcept {
+      decltype(right_tree)::unhook(*node);
+      destroy_node(node);
+    });
+    size_ = 0;
+  }
+
+  // links unlinked nodes ordered by left keys, right keys are sorted here;
+  // on exception the nodes are left unlinked
+  void build_from_nodes(std::vector<node_t*>& by_left, bool skip_right_duplicates,
+                        unsigned threads = 1) {
+    std::vector<node_t*> by_right(by_left);
+    auto const& cmp_right = static_cast<CompareRight const&>(right_tree);
+    auto less_right = [&cmp_right](node_t const* a, node_t const* b) {
+      return cmp_right(a->template key<right_tag>(), b->template key<right_tag>());
+    };
+
+    if (skip_right_duplicates) {
+      // stable: the pair met first keeps the right key, as with insert
+      fork_join::stable_sort(by_right.begin(), by_right.end(), less_right, threads);
+      std::vector<node_t*> skipped;
+      auto out = by_right.begin();
+      for (auto it = by_right.begin(); it != by_right.end(); ++it) {
+        if (out != by_right.begin() && !less_right(*(out - 1), *it)) {
+          skipped.push_back(*it);
         } else {
-          return *insert_no_check(std::move(other), key);
+          *out++ = *it;
         }
       }
+      by_right.erase(out, by_right.end());
+
+      if (!skipped.empty()) {
+        std::sort(skipped.begin(), skipped.end());
+        by_left.erase(std::remove_if(by_left.begin(), by_left.end(),
+                                     [&skipped](node_t* node) {
+                                       return std::binary_search(skipped.begin(),
+                                                                 skipped.end(), node);
+                                     }),
+                      by_left.end());
+        for (auto* node : skipped) {
+          destroy_node(node);
+        }
+      }
+    } else if (threads > 1) {
+      fork_join::stable_sort(by_right.begin(), by_right.end(), less_right, threads);
+    } else {
+      std::sort(by_right.begin(), by_right.end(), less_right);
+    }
+    link_sorted(by_left, by_right, threads);
+  }
+
+  // order gets the positions of nodes sorted by Side key, equal keys in
+  // position order, and number[i] the rank of the distinct key of nodes[i]
+  template <typename Side>
+  void sort_positions(std::vector<node_t*> const& nodes, std::vector<std::size_t>& order,
+                      std::vector<std::size_t>& number, unsigned threads) const {
+    auto const& cmp = static_cast<Comparator<Side> const&>(tree<Side>());
+    auto less = [&cmp, &nodes](std::size_t a, std::size_t b) {
+      return cmp(nodes[a]->template key<Side>(), nodes[b]->template key<Side>());
+    };
+    std::iota(order.begin(), order.end(), std::size_t(0));
+    fork_join::stable_sort(order.begin(), order.end(), less, threads);
+    std::size_t key = 0;
+    for (std::size_t j = 0; j < order.size(); ++j) {
+      if (j != 0 && less(order[j - 1], order[j])) {
+        ++key;
+      }
+      number[order[j]] = key;
     }
   }
 
-  void clear() {
-    erase_left(begin_left(), end_left());
+  // links both trees from the same nodes in left and in right key order
+  void link_sorted(std::vector<node_t*> const& by_left, std::vector<node_t*> const& by_right,
+                   unsigned threads) noexcept {
+    if (threads > 1) {
+      // the trees share no hook, so they are linked at the same time
+      auto link_left = [&]() noexcept {
+        left_tree.build_from_sorted(by_left.begin(), by_left.end(), threads / 2);
+      };
+      auto link_right = [&]() noexcept {
+        right_tree.build_from_sorted(by_right.begin(), by_right.end(), threads - threads / 2);
+      };
+      static_assert(noexcept(fork_join::both(link_left, link_right)));
+      fork_join::both(link_left, link_right);
+    } else {
+      left_tree.build_from_sorted(by_left.begin(), by_left.end());
+      right_tree.build_from_sorted(by_right.begin(), by_right.end());
+    }
+    size_ = by_left.size();
   }
 
-  void copy_from(bimap const& other) {
+  template <typename Side>
+  bimap split(typename tree_type<Side>::iterator pos) {
+    bimap result(static_cast<CompareLeft const&>(left_tree),
+                 static_cast<CompareRight const&>(right_tree), allocator_type(alloc_));
+    tree<Side>().split(pos, result.tree<Side>());
+
+    // the smaller part leaves the other tree, counted in lockstep
+    std::size_t small = 0;
+    auto a = tree<Side>().begin();
+    auto b = result.tree<Side>().begin();
+    for (; a != tree<Side>().end() && b != result.tree<Side>().end(); ++a, ++b) {
+      ++small;
+    }
+    bool const moved_small = b == result.tree<Side>().end();
+    std::size_t const moved = moved_small ? small : size_ - small;
+    auto& small_part = moved_small ? result.tree<Side>() : tree<Side>();
+
+    std::vector<node_t*> nodes;
+    try {
+      nodes.reserve(small);
+      for (auto it = small_part.begin(); it != small_part.end(); ++it) {
+        nodes.push_back(&*it);
+      }
+      auto const& cmp = static_cast<Comparator<Other<Side>> const&>(tree<Other<Side>>());
+      std::sort(nodes.begin(), nodes.end(), [&cmp](node_t const* x, node_t const* y) {
+        return cmp(x->template key<Other<Side>>(), y->template key<Other<Side>>());
+      });
+    } catch (...) {
+      tree<Side>().join(result.tree<Side>());
+      throw;
+    }
+
+    for (auto* node : nodes) {
+      tree<Other<Side>>().unlink(*node);
+    }
+    if (!moved_small) {
+      tree<Other<Side>>().swap(result.tree<Other<Side>>());
+    }
+    auto& rebuilt = moved_small ? result.tree<Other<Side>>() : tree<Other<Side>>();
+    rebuilt.build_from_sorted(nodes.begin(), nodes.end());
+    size_ -= moved;
+    result.size_ = moved;
+    return result;
+  }
+
+  // every Side key of other is greater than those here
+  template <typename Side>
+  void join_above(bimap& other) {
+    auto& from = other.tree<Other<Side>>();
+    auto& to = tree<Other<Side>>();
+    std::vector<node_t*> staying;
+    std::vector<node_t*> moved;
+    staying.reserve(other.size_);
+    moved.reserve(other.size_);
+
+    // keys arrive in increasing order, so the successor of the last one
+    // linked is a good hint for the next while other is the smaller map;
+    // from the same size on, one merge of both orders is cheaper. Only
+    // the comparisons throw, before their node is touched, and the Side
+    // trees are fixed up below either way.
+    std::exception_ptr error;
+    try {
+      if (other.size_ >= size_) {
+        merge_paired_trees<Side>(other);
+      } else {
+        auto hint = to.end();
+        for (auto it = from.begin(); it != from.end();) {
+          node_t& node = *it;
+          auto pos = to.find_insert_position(hint, node.template key<Other<Side>>());
+          if (pos.found != to.end()) {
+            ++it;
+            continue;
+          }
+          it = from.erase(node);
+          hint = std::next(to.insert_at(pos, node));
+        }
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    // the nodes left in from stay in other, the others join the Side tree
+    // here; told apart by address, without comparing keys
+    for (auto it = from.begin(); it != from.end(); ++it) {
+      staying.push_back(&*it);
+    }
+    std::sort(staying.begin(), staying.end());
+    auto const kept = static_cast<std::ptrdiff_t>(staying.size());
+    for (auto it = other.tree<Side>().begin(); it != other.tree<Side>().end(); ++it) {
+      if (std::binary_search(staying.begin(), staying.begin() + kept, &*it)) {
+        staying.push_back(&*it);
+      } else {
+        moved.push_back(&*it);
+      }
+    }
+    other.tree<Side>().release();
+    for (auto it = staying.begin() + kept; it != staying.end(); ++it) {
+      tree_type<Side>::unhook(**it);
+    }
+    for (auto* node : moved) {
+      tree_type<Side>::unhook(*node);
+    }
+    other.tree<Side>().build_from_sorted(staying.begin() + kept, staying.end());
+    tree_type<Side> moving(other.tree<Side>());
+    moving.build_from_sorted(moved.begin(), moved.end());
+    tree<Side>().join(moving);
+    size_ += moved.size();
+    other.size_ = static_cast<std::size_t>(kept);
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  // moves the Other<Side> tree of other into the one here by merging both
+  // key orders and rebuilding both trees in O(n + m); the pairs whose key
+  // is taken here stay in other. Throws before touching either tree.
+  template <typename Side>
+  void merge_paired_trees(bimap& other) {
+    auto& from = other.tree<Other<Side>>();
+    auto& to = tree<Other<Side>>();
+    auto const& cmp = static_cast<Comparator<Other<Side>> const&>(to);
+    std::vector<node_t*> merged;
+    std::vector<node_t*> staying;
+    merged.reserve(size_ + other.size_);
+    staying.reserve(other.size_);
+    auto a = to.begin();
+    for (auto b = from.begin(); b != from.end(); ++b) {
+      auto const& key = b->template key<Other<Side>>();
+      for (; a != to.end() && cmp(a->template key<Other<Side>>(), key); ++a) {
+        merged.push_back(&*a);
+      }
+      bool const taken = a != to.end() && !cmp(key, a->template key<Other<Side>>());
+      (taken ? staying : merged).push_back(&*b);
+    }
+    for (; a != to.end(); ++a) {
+      merged.push_back(&*a);
+    }
+    to.release();
+    from.release();
+    to.build_from_sorted(merged.begin(), merged.end());
+    from.build_from_sorted(staying.begin(), staying.end());
+  }
+
+  // exchanges the pairs, not the allocators
+  void swap_nodes(bimap& other) noexcept {
+    left_tree.swap(other.left_tree);
+    right_tree.swap(other.right_tree);
+    std::swap(size_, other.size_);
+  }
+
+  // relinks pairs of source one by one, for sources much smaller than
+  // this map
+  void merge_by_insert(bimap& source) {
+    for (auto it = source.left_tree.begin(); it != source.left_tree.end();) {
+      node_t& node = *it;
+      ++it;
+      auto left_pos = left_tree.find_insert_position(node.template key<left_tag>());
+      if (left_pos.found != left_tree.end()) {
+        continue;
+      }
+      auto right_pos = right_tree.find_insert_position(node.template key<right_tag>());
+      if (right_pos.found != right_tree.end()) {
+        continue;
+      }
+      source.left_tree.unlink(node);
+      source.right_tree.unlink(node);
+      --source.size_;
+      link_node(&node, left_pos, right_pos);
+    }
+  }
+
+  void merge_linear(bimap& source) {
+    merge_plan plan = plan_merge(source);
+    std::vector<node_t*> rejected_left;
+    std::vector<node_t*> rejected_right;
+    rejected_left.reserve(plan.rejected.size());
+    rejected_right.reserve(plan.rejected.size());
+    auto rejected = [&plan](node_t* node) {
+      return std::binary_search(plan.rejected.begin(), plan.rejected.end(), node);
+    };
+    for (auto it = source.left_tree.begin(); it != source.left_tree.end(); ++it) {
+      if (rejected(&*it)) {
+        rejected_left.push_back(&*it);
+      }
+    }
+    for (auto it = source.right_tree.begin(); it != source.right_tree.end(); ++it) {
+      if (rejected(&*it)) {
+        rejected_right.push_back(&*it);
+      }
+    }
+    source.rebuild(rejected_left, rejected_right);
+    rebuild(plan.left, plan.right);
+  }
+
+  // result of walking the trees of this map and of a source side by side
+  struct merge_plan {
+    // nodes of both maps that the merged map links, in left and right order
+    std::vector<node_t*> left;
+    std::vector<node_t*> right;
+    // whether left[i] comes from the source
+    std::vector<bool> from_source;
+    // source nodes with a taken key, by address
+    std::vector<node_t*> rejected;
+    // rejected pairs that are not also in this map
+    std::size_t conflicts{0};
+  };
+
+  // only compares keys and allocates, neither map is modified
+  merge_plan plan_merge(bimap const& source) const {
+    auto const& cmp_left = static_cast<CompareLeft const&>(left_tree);
+    auto const& cmp_right = static_cast<CompareRight const&>(right_tree);
+    auto same_right = [&cmp_right](node_t const& a, node_t const& b) {
+      return !cmp_right(a.template key<right_tag>(), b.template key<right_tag>()) &&
+             !cmp_right(b.template key<right_tag>(), a.template key<right_tag>());
+    };
+
+    merge_plan plan;
+    plan.left.reserve(size_ + source.size_);
+    plan.right.reserve(size_ + source.size_);
+    plan.from_source.reserve(size_ + source.size_);
+
+    // source nodes whose left key is taken
+    std::vector<node_t*> left_taken;
+    for (auto a = left_tree.begin(), b = source.left_tree.begin();
+         a != left_tree.end() || b != source.left_tree.end();) {
+      if (b == source.left_tree.end() ||
+          (a != left_tree.end() &&
+           cmp_left(a->template key<left_tag>(), b->template key<left_tag>()))) {
+        plan.left.push_back(&*a++);
+        plan.from_source.push_back(false);
+      } else if (a == left_tree.end() ||
+                 cmp_left(b->template key<left_tag>(), a->template key<left_tag>())) {
+        plan.left.push_back(&*b++);
+        plan.from_source.push_back(true);
+      } else {
+        if (!same_right(*a, *b)) {
+          ++plan.conflicts;
+        }
+        left_taken.push_back(&*b++);
+        plan.left.push_back(&*a++);
+        plan.from_source.push_back(false);
+      }
+    }
+    std::sort(left_taken.begin(), left_taken.end());
+    auto is_left_taken = [&left_taken](node_t* node) {
+      return std::binary_search(left_taken.begin(), left_taken.end(), node);
+    };
+
+    // source nodes whose right key is taken but not their left key
+    std::vector<node_t*> right_taken;
+    for (auto a = right_tree.begin(), b = source.right_tree.begin();
+         a != right_tree.end() || b != source.right_tree.end();) {
+      if (b == source.right_tree.end() ||
+          (a != right_tree.end() &&
+           cmp_right(a->template key<right_tag>(), b->template key<right_tag>()))) {
+        plan.right.push_back(&*a++);
+      } else if (a == right_tree.end() ||
+                 cmp_right(b->template key<right_tag>(), a->template key<right_tag>())) {
+        node_t* node = &*b++;
+        if (!is_left_taken(node)) {
+          plan.right.push_back(node);
+        }
+      } else {
+        node_t* node = &*b++;
+        if (!is_left_taken(node)) {
+          ++plan.conflicts;
+          right_taken.push_back(node);
+        }
+        plan.right.push_back(&*a++);
+      }
+    }
+
+    if (!right_taken.empty()) {
+      std::sort(right_taken.begin(), right_taken.end());
+      std::size_t out = 0;
+      for (std::size_t i = 0; i < plan.left.size(); ++i) {
+        if (!plan.from_source[i] ||
+            !std::binary_search(right_taken.begin(), right_taken.end(), plan.left[i])) {
+          plan.left[out] = plan.left[i];
+          plan.from_source[out] = plan.from_source[i];
+          ++out;
+        }
+      }
+      plan.left.resize(out);
+      plan.from_source.resize(out);
+    }
+
+    plan.rejected.resize(left_taken.size() + right_taken.size());
+    std::merge(left_taken.begin(), left_taken.end(),
+               right_taken.begin(), right_taken.end(), plan.rejected.begin());
+    return plan;
+  }
+
+  // range erase relinks the other tree from scratch once more than
+  // size_ / 2 pairs go; on a million pairs that is about where the O(n)
+  // rebuild catches up with the unlinks
+  static constexpr std::size_t range_rebuild_fraction = 2;
+
+  // frees the cut nodes of range and rebuilds the other tree from the
+  // rest; throws before changing anything if the nodes don't fit
+  template <typename Side>
+  void rebuild_without_cut(tree_type<Side>& range, std::size_t cut) {
+    std::vector<node_t*> kept;
+    std::vector<node_t*> dropped;
+    kept.reserve(size_ - cut);
+    dropped.reserve(cut);
+
+    // an unhooked Side hook marks a cut node on the walk by the other keys
+    range.clear_and_dispose([](node_t*) noexcept {});
+    for (auto& node : tree<Other<Side>>()) {
+      (static_cast<hook_type<Side> const&>(node).in_tree() ? kept : dropped).push_back(&node);
+    }
+    tree<Other<Side>>().release();
+    for (auto* node : dropped) {
+      tree_type<Other<Side>>::unhook(*node);
+      destroy_node(node);
+    }
+    tree<Other<Side>>().build_from_sorted(kept.begin(), kept.end());
+    size_ -= cut;
+  }
+
+  // keeps the pairs that are in other when Keep, the others otherwise
+  template <bool Keep>
+  std::size_t filter_by(bimap const& other) {
+    auto const& cmp_left = static_cast<CompareLeft const&>(left_tree);
+    auto const& cmp_right = static_cast<CompareRight const&>(right_tree);
+    std::vector<node_t*> kept;
+    std::vector<node_t*> dropped;
+    kept.reserve(size_);
+    dropped.reserve(size_);
+    auto b = other.left_tree.begin();
+    for (auto a = left_tree.begin(); a != left_tree.end(); ++a) {
+      while (b != other.left_tree.end() &&
+             cmp_left(b->template key<left_tag>(), a->template key<left_tag>())) {
+        ++b;
+      }
+      bool const present =
+          b != other.left_tree.end() &&
+          !cmp_left(a->template key<left_tag>(), b->template key<left_tag>()) &&
+          !cmp_right(a->template key<right_tag>(), b->template key<right_tag>()) &&
+          !cmp_right(b->template key<right_tag>(), a->template key<right_tag>());
+      (present == Keep ? kept : dropped).push_back(&*a);
+    }
+    if (dropped.empty()) {
+      return 0;
+    }
+    std::vector<node_t*> kept_right;
+    kept_right.reserve(kept.size());
+
+    // an unhooked left hook marks a dropped node on the walk by right keys
+    left_tree.release();
+    for (auto* node : dropped) {
+      decltype(left_tree)::unhook(*node);
+    }
+    for (auto it = right_tree.begin(); it != right_tree.end(); ++it) {
+      if (static_cast<hook_type<left_tag> const&>(*it).in_tree()) {
+        kept_right.push_back(&*it);
+      }
+    }
+    right_tree.release();
+    for (auto* node : dropped) {
+      decltype(right_tree)::unhook(*node);
+      destroy_node(node);
+    }
+    left_tree.build_from_sorted(kept.begin(), kept.end());
+    right_tree.build_from_sorted(kept_right.begin(), kept_right.end());
+    size_ = kept.size();
+    return dropped.size();
+  }
+
+  // relinks exactly the given nodes, ordered by left and by right keys
+  void rebuild(std::vector<node_t*> const& by_left,
+               std::vector<node_t*> const& by_right) noexcept {
+    left_tree.release();
+    right_tree.release();
+    left_tree.build_from_sorted(by_left.begin(), by_left.end());
+    right_tree.build_from_sorted(by_right.begin(), by_right.end());
+    size_ = by_left.size();
+  }
+
+  void copy_from(bimap const& other, parallel_t policy) {
     clear();
+    unsigned const threads = fork_join::threads(policy.threads, other.size());
+    std::vector<node_t const*> source;
+    source.reserve(other.size());
     for (auto it = other.left_tree.begin(); it != other.left_tree.end(); ++it) {
-      insert(it->template key<left_tag>(), it->template key<right_tag>());
+      source.push_back(&*it);
+    }
+    std::vector<node_t*> by_left(source.size());
+    try {
+      create_nodes(by_left, threads, [&](std::size_t i) {
+        return construct_node(source[i]->template key<left_tag>(),
+                              source[i]->template key<right_tag>());
+      });
+      build_from_nodes(by_left, false, threads);
+    } catch (...) {
+      destroy_nodes(by_left);
+      throw;
+    }
+  }
+
+  void copy_from(bimap const& other) {
+    clear();
+    std::vector<node_t*> by_left;
+    by_left.reserve(other.size());
+    try {
+      for (auto it = other.left_tree.begin(); it != other.left_tree.end(); ++it) {
+        by_left.push_back(create_node(it->template key<left_tag>(),
+                                      it->template key<right_tag>()));
+      }
+      build_from_nodes(by_left, false);
+    } catch (...) {
+      for (auto* node : by_left) {
+        destroy_node(node);
+      }
+      throw;
     }
   }
 };
+
+// Node size report, bytes per pair on LP64
+//                              vptr hooks (before)   packed hooks
+// bimap<uint32_t, uint32_t>             72                56
+// bimap<uint64_t, uint64_t>             80                64
+// bimap<uint64_t, std::string>          104               88
+// OrderStatistics adds a word per hook: 16 bytes per pair
+static_assert(bimap<uint32_t, uint32_t>::node_size ==
+              2 * sizeof(base_tree_element) + 2 * sizeof(uint32_t));
+static_assert(bimap<uint64_t, uint64_t>::node_size ==
+              2 * sizeof(base_tree_element) + 2 * sizeof(uint64_t));
+static_assert(bimap<uint64_t, std::string>::node_size ==
+              2 * sizeof(base_tree_element) + sizeof(uint64_t) + sizeof(std::string));
+static_assert(bimap<uint32_t, uint32_t, std::less<uint32_t>, std::less<uint32_t>,
+                    std::allocator<std::pair<uint32_t, uint32_t>>, true>::node_size ==
+              2 * (sizeof(base_tree_element) + sizeof(std::size_t)) + 2 * sizeof(uint32_t));
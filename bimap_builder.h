@@ -0,0 +1,370 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <exception>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "bimap.h"
+
+// Builds a Map (bimap or flat_bimap) from pairs pushed one at a time, off
+// the pushing thread. Pairs are gathered in chunks; a worker thread sorts
+// each full chunk by left key and drops its left duplicates, so the pushing
+// thread only copies pairs. finish() has the worker merge the sorted runs
+// and build the map with its O(n) sorted_unique constructor; publish the
+// result with move assignment or swap, or concurrent_bimap::assign.
+//
+// Of pairs with equal left keys the one pushed first is kept; of the rest,
+// pairs with equal right keys are resolved as by the sorted_unique
+// constructor, the least left key keeps it.
+//
+// At most about three chunks of pairs are held besides the map. When the
+// keys are trivially copyable, runs other than the last one are written to
+// a temporary file, so memory stays bounded however many pairs are pushed;
+// otherwise the runs stay in memory.
+template <typename Map>
+struct bimap_builder {
+  using map_type = Map;
+  using left_t = typename Map::left_t;
+  using right_t = typename Map::right_t;
+  using compare_left = typename Map::template Comparator<left_tag>;
+  using compare_right = typename Map::template Comparator<right_tag>;
+  using allocator_type = typename Map::allocator_type;
+
+  static constexpr std::size_t default_chunk_size = std::size_t(1) << 20;
+
+  explicit bimap_builder(std::size_t chunk_size = default_chunk_size,
+                         compare_left cmp_left = compare_left(),
+                         compare_right cmp_right = compare_right(),
+                         allocator_type const& alloc = allocator_type())
+      : chunk_size(std::max<std::size_t>(chunk_size, 1)),
+        cmp_left(cmp_left), cmp_right(cmp_right), alloc(alloc) {
+    filling.reserve(this->chunk_size);
+    worker = std::thread([this] {
+      work();
+    });
+  }
+
+  bimap_builder(bimap_builder const&) = delete;
+  bimap_builder& operator=(bimap_builder const&) = delete;
+
+  // abandons an unfinished build; waits for a finished one to complete
+  ~bimap_builder() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      stopping = true;
+    }
+    changed.notify_all();
+    worker.join();
+  }
+
+  // blocks while the worker is behind by a whole chunk; rethrows
+  // an exception of the worker
+  void push(left_t left, right_t right) {
+    if (finished) {
+      throw std::logic_error("bimap_builder is finished");
+    }
+    filling.push_back(entry{std::move(left), std::move(right)});
+    if (filling.size() >= chunk_size) {
+      hand_off(false);
+    }
+  }
+
+  // number of pairs pushed so far, duplicates included
+  std::size_t pushed() const noexcept {
+    return handed_off + filling.size();
+  }
+
+  // the map is built on the worker thread; no more pairs can be pushed
+  std::future<Map> finish() {
+    if (finished) {
+      throw std::logic_error("bimap_builder is finished");
+    }
+    std::future<Map> future = result.get_future();
+    hand_off(true);
+    finished = true;
+    return future;
+  }
+
+private:
+  struct entry {
+    left_t left;
+    right_t right;
+  };
+  using chunk = std::vector<entry>;
+
+  static constexpr bool spills =
+      std::is_trivially_copyable_v<entry> && std::is_default_constructible_v<entry>;
+
+  struct file_closer {
+    void operator()(std::FILE* file) const noexcept {
+      std::fclose(file);
+    }
+  };
+
+  // sorted entries, in memory or in the temporary file, read back in blocks
+  struct run {
+    chunk buffer;
+    std::size_t pos{0};
+    long offset{0};
+    std::size_t unread{0};
+  };
+
+  std::size_t const chunk_size;
+  compare_left cmp_left;
+  compare_right cmp_right;
+  allocator_type alloc;
+
+  // touched by the pushing thread only
+  chunk filling;
+  std::size_t handed_off{0};
+  bool finished{false};
+
+  // handed to the worker under m
+  std::mutex m;
+  std::condition_variable changed;
+  chunk pending;
+  bool has_pending{false};
+  bool last_pending{false};
+  bool stopping{false};
+  std::exception_ptr error;
+
+  // touched by the worker only
+  std::vector<run> runs;
+  std::unique_ptr<std::FILE, file_closer> file;
+  std::vector<std::size_t> heap;
+  std::size_t block_size{0};
+  std::promise<Map> result;
+
+  std::thread worker;
+
+  void hand_off(bool last) {
+    std::unique_lock<std::mutex> lock(m);
+    changed.wait(lock, [this] {
+      return !has_pending || error;
+    });
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    handed_off += filling.size();
+    pending = std::move(filling);
+    has_pending = true;
+    last_pending = last;
+    lock.unlock();
+    changed.notify_all();
+
+    filling = chunk();
+    if (!last) {
+      filling.reserve(chunk_size);
+    }
+  }
+
+  void work() {
+    for (;;) {
+      chunk c;
+      bool last;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        changed.wait(lock, [this] {
+          return has_pending || stopping;
+        });
+        if (!has_pending || (stopping && !last_pending)) {
+          return;
+        }
+        c = std::move(pending);
+        pending = chunk();
+        has_pending = false;
+        last = last_pending;
+      }
+      changed.notify_all();
+
+      try {
+        sort_chunk(c);
+        if (last) {
+          runs.push_back(run{std::move(c), 0, 0, 0});
+          result.set_value(merge_runs());
+          return;
+        }
+        runs.push_back(spill(std::move(c)));
+      } catch (...) {
+        if (last) {
+          result.set_exception(std::current_exception());
+          return;
+        }
+        {
+          std::lock_guard<std::mutex> lock(m);
+          error = std::current_exception();
+        }
+        changed.notify_all();
+        return;
+      }
+    }
+  }
+
+  // stable: of equal left keys the first pushed is kept
+  void sort_chunk(chunk& c) const {
+    auto less_left = [this](entry const& a, entry const& b) {
+      return cmp_left(a.left, b.left);
+    };
+    std::stable_sort(c.begin(), c.end(), less_left);
+    c.erase(std::unique(c.begin(), c.end(),
+                        [this](entry const& a, entry const& b) {
+                          return !cmp_left(a.left, b.left);
+                        }),
+            c.end());
+  }
+
+  run spill(chunk&& c) {
+    if constexpr (spills) {
+      if (!file) {
+        file.reset(std::tmpfile());
+        if (!file) {
+          throw std::system_error(errno, std::generic_category(), "bimap_builder runs");
+        }
+      }
+      long const offset = std::ftell(file.get());
+      if (offset < 0 ||
+          std::fwrite(c.data(), sizeof(entry), c.size(), file.get()) != c.size()) {
+        throw std::system_error(errno, std::generic_category(), "bimap_builder runs");
+      }
+      return run{chunk(), 0, offset, c.size()};
+    } else {
+      return run{std::move(c), 0, 0, 0};
+    }
+  }
+
+  // makes the next entry of r available, false when r is exhausted
+  bool refill(run& r) {
+    if (r.pos < r.buffer.size()) {
+      return true;
+    }
+    if constexpr (spills) {
+      if (r.unread != 0) {
+        std::size_t const n = std::min(block_size, r.unread);
+        r.buffer.resize(n);
+        if (std::fseek(file.get(), r.offset, SEEK_SET) != 0 ||
+            std::fread(r.buffer.data(), sizeof(entry), n, file.get()) != n) {
+          throw std::runtime_error("bimap_builder could not read back a run");
+        }
+        r.offset += static_cast<long>(n * sizeof(entry));
+        r.unread -= n;
+        r.pos = 0;
+        return true;
+      }
+    }
+    r.buffer = chunk();
+    return false;
+  }
+
+  entry& head(std::size_t i) {
+    return runs[i].buffer[runs[i].pos];
+  }
+
+  // heap order: least key on top, of equal keys the earliest run
+  bool after(std::size_t a, std::size_t b) {
+    entry const& x = head(a);
+    entry const& y = head(b);
+    if (cmp_left(y.left, x.left)) {
+      return true;
+    }
+    return !cmp_left(x.left, y.left) && a > b;
+  }
+
+  void push_run(std::size_t i) {
+    if (refill(runs[i])) {
+      heap.push_back(i);
+      std::push_heap(heap.begin(), heap.end(), [this](std::size_t a, std::size_t b) {
+        return after(a, b);
+      });
+    }
+  }
+
+  std::size_t pop_run() {
+    std::pop_heap(heap.begin(), heap.end(), [this](std::size_t a, std::size_t b) {
+      return after(a, b);
+    });
+    std::size_t const i = heap.back();
+    heap.pop_back();
+    return i;
+  }
+
+  // the next entry of all runs in left order, skipping left duplicates
+  bool next(std::optional<entry>& out) {
+    if (heap.empty()) {
+      out.reset();
+      return false;
+    }
+    std::size_t const i = pop_run();
+    out.emplace(std::move(head(i)));
+    ++runs[i].pos;
+    while (!heap.empty() && !cmp_left(out->left, head(heap.front()).left)) {
+      std::size_t const j = pop_run();
+      ++runs[j].pos;
+      push_run(j);
+    }
+    push_run(i);
+    return true;
+  }
+
+  // single pass over the merged runs, moving the keys out
+  struct merged_iterator {
+    using iterator_category = std::input_iterator_tag;
+    using value_type = std::pair<left_t, right_t>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = value_type;
+
+    merged_iterator() = default;
+    explicit merged_iterator(bimap_builder* b) : b(b) {
+      ++*this;
+    }
+
+    value_type operator*() {
+      return value_type(std::move(current->left), std::move(current->right));
+    }
+
+    merged_iterator& operator++() {
+      if (!b->next(current)) {
+        b = nullptr;
+      }
+      return *this;
+    }
+
+    friend bool operator==(merged_iterator const& a, merged_iterator const& b) {
+      return a.b == b.b;
+    }
+    friend bool operator!=(merged_iterator const& a, merged_iterator const& b) {
+      return !(a == b);
+    }
+
+  private:
+    bimap_builder* b{nullptr};
+    std::optional<entry> current;
+  };
+
+  Map merge_runs() {
+    // the blocks read back share about one chunk
+    block_size = std::max<std::size_t>(chunk_size / runs.size(), 64);
+    heap.reserve(runs.size());
+    for (std::size_t i = 0; i < runs.size(); ++i) {
+      push_run(i);
+    }
+    Map map(sorted_unique, merged_iterator(this), merged_iterator(),
+            cmp_left, cmp_right, alloc);
+    runs.clear();
+    file.reset();
+    return map;
+  }
+};
@@ -0,0 +1,896 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "bimap.h"
+
+// keys that compact_bimap can store: copied as bytes, at most 8 bytes each
+template <typename Left, typename Right>
+inline constexpr bool compact_keys =
+    std::is_trivially_copyable_v<Left> && std::is_trivially_copyable_v<Right> &&
+    sizeof(Left) <= 8 && sizeof(Right) <= 8;
+
+// Red-black tree map for small trivially copyable keys, laid out for
+// memory. It is a container of its own with the core of bimap's interface:
+// insertion, erasure, lookups, bounds and flipping iterators, but no hints,
+// node handles, merging or splitting. Pairs live in a pool of 64K-node
+// blocks and link to each other by 32-bit indices into it, the color of a
+// node taking the high bit of its left index. The first block starts at 64
+// nodes and doubles as the map grows, so small maps stay small. There are
+// no parent links;
+// insertion and erasure rebalance top-down in a single descent (Walker's
+// algorithms), so a pair costs its keys and four indices, 24 bytes for two
+// 32-bit keys against 56 in bimap.
+//
+// A link with no child below threads to the in-order neighbor on its side
+// instead, told apart by its second highest bit, so ++ and -- step in
+// amortized O(1) without parents. An iterator is just an index, which both
+// trees share, so flip() is free. Erasing a pair invalidates only its
+// iterators. While the first block grows, insertion moves the pairs in it,
+// invalidating references to keys but no iterators. At most 2^30 - 1 pairs.
+template <typename Left, typename Right,
+          typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>,
+          typename Allocator = std::allocator<std::pair<Left, Right>>>
+struct compact_bimap;
+
+namespace compact_detail {
+
+// keeps the comparator of one side as an empty base when it is stateless
+template <typename Side, typename Compare>
+struct comparator_holder : Compare {
+  explicit comparator_holder(Compare const& cmp) : Compare(cmp) {}
+};
+
+} // namespace compact_detail
+
+template <typename Left, typename Right, typename CompareLeft, typename CompareRight,
+          typename Allocator>
+struct compact_bimap
+    : private compact_detail::comparator_holder<left_tag, CompareLeft>,
+      private compact_detail::comparator_holder<right_tag, CompareRight> {
+  using left_t = Left;
+  using right_t = Right;
+  using allocator_type = Allocator;
+  template <typename Side>
+  using key_t = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      left_t,
+      right_t>;
+
+  template <typename Side>
+  using Comparator = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      CompareLeft,
+      CompareRight>;
+
+  static_assert(compact_keys<Left, Right>,
+                "compact_bimap stores trivially copyable keys of at most 8 bytes");
+
+private:
+  using index_t = std::uint32_t;
+  static constexpr index_t nil = 0;
+  static constexpr index_t red_bit = index_t(1) << 31;
+  static constexpr index_t thread_bit = index_t(1) << 30;
+  static constexpr index_t max_index = thread_bit - 1;
+  static constexpr unsigned block_bits = 16;
+  static constexpr std::size_t block_nodes = std::size_t(1) << block_bits;
+  static constexpr std::size_t first_nodes = 64;
+
+  // children or threads in one tree; link[0] also holds the color
+  struct hook {
+    index_t link[2];
+  };
+
+  struct node {
+    hook hooks[2];
+    left_t left;
+    right_t right;
+  };
+  static_assert(std::is_trivially_copyable_v<node>);
+
+  using node_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<node>;
+  using node_traits = std::allocator_traits<node_allocator>;
+  using block_allocator =
+      typename std::allocator_traits<Allocator>::template rebind_alloc<node*>;
+
+  template <typename Side>
+  static constexpr int side_index = std::is_same_v<Side, left_tag> ? 0 : 1;
+
+public:
+  template <typename Side>
+  struct base_iterator {
+    friend compact_bimap;
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = key_t<Side>;
+    using pointer = value_type const*;
+    using reference = value_type const&;
+
+    base_iterator() = default;
+
+    reference operator*() const {
+      return map_p->template key<Side>(index);
+    }
+    pointer operator->() const {
+      return &**this;
+    }
+
+    base_iterator& operator++() {
+      index = map_p->template next<Side>(index);
+      return *this;
+    }
+    base_iterator operator++(int) {
+      base_iterator tmp(*this);
+      ++*this;
+      return tmp;
+    }
+
+    base_iterator& operator--() {
+      index = map_p->template prev<Side>(index);
+      return *this;
+    }
+    base_iterator operator--(int) {
+      base_iterator tmp(*this);
+      --*this;
+      return tmp;
+    }
+
+    // the pair is one node of both trees
+    base_iterator<Other<Side>> flip() const {
+      return base_iterator<Other<Side>>(map_p, index);
+    }
+
+    friend bool operator==(base_iterator const& a, base_iterator const& b) {
+      return a.index == b.index;
+    }
+    friend bool operator!=(base_iterator const& a, base_iterator const& b) {
+      return a.index != b.index;
+    }
+
+  private:
+    compact_bimap const* map_p{nullptr};
+    index_t index{nil};
+
+    base_iterator(compact_bimap const* p, index_t index) : map_p(p), index(index) {}
+  };
+
+  using left_iterator = base_iterator<left_tag>;
+  using right_iterator = base_iterator<right_tag>;
+  template <typename Side>
+  using iterator = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      left_iterator,
+      right_iterator>;
+
+  explicit compact_bimap(CompareLeft compare_left = CompareLeft(),
+                         CompareRight compare_right = CompareRight(),
+                         Allocator const& alloc = Allocator())
+      : compact_detail::comparator_holder<left_tag, CompareLeft>(compare_left),
+        compact_detail::comparator_holder<right_tag, CompareRight>(compare_right),
+        alloc_(alloc), blocks(block_allocator(alloc)) {}
+
+  explicit compact_bimap(Allocator const& alloc)
+      : compact_bimap(CompareLeft(), CompareRight(), alloc) {}
+
+  // pairs are inserted one by one, later duplicates are skipped
+  template <typename InputIt>
+  compact_bimap(InputIt first, InputIt last,
+                CompareLeft compare_left = CompareLeft(),
+                CompareRight compare_right = CompareRight(),
+                Allocator const& alloc = Allocator())
+      : compact_bimap(compare_left, compare_right, alloc) {
+    assign(first, last);
+  }
+
+  // indices do not depend on where the blocks are, so a copy is a copy of
+  // the blocks
+  compact_bimap(compact_bimap const& other)
+      : compact_detail::comparator_holder<left_tag, CompareLeft>(other.comparator<left_tag>()),
+        compact_detail::comparator_holder<right_tag, CompareRight>(
+            other.comparator<right_tag>()),
+        alloc_(node_traits::select_on_container_copy_construction(other.alloc_)),
+        blocks(block_allocator(alloc_)) {
+    copy_from(other);
+  }
+
+  compact_bimap(compact_bimap&& other) noexcept
+      : compact_detail::comparator_holder<left_tag, CompareLeft>(other.comparator<left_tag>()),
+        compact_detail::comparator_holder<right_tag, CompareRight>(
+            other.comparator<right_tag>()),
+        alloc_(std::move(other.alloc_)),
+        blocks(block_allocator(alloc_)) {
+    take(other);
+  }
+
+  compact_bimap& operator=(compact_bimap const& other) {
+    if (this != &other) {
+      compact_bimap copy(other);
+      swap(copy);
+    }
+    return *this;
+  }
+
+  compact_bimap& operator=(compact_bimap&& other) noexcept {
+    if (this != &other) {
+      release_blocks();
+      comparator<left_tag>() = other.comparator<left_tag>();
+      comparator<right_tag>() = other.comparator<right_tag>();
+      alloc_ = std::move(other.alloc_);
+      take(other);
+    }
+    return *this;
+  }
+
+  ~compact_bimap() {
+    release_blocks();
+  }
+
+  void swap(compact_bimap& other) noexcept {
+    using std::swap;
+    swap(comparator<left_tag>(), other.comparator<left_tag>());
+    swap(comparator<right_tag>(), other.comparator<right_tag>());
+    swap(alloc_, other.alloc_);
+    blocks.swap(other.blocks);
+    swap(heads, other.heads);
+    swap(first_size, other.first_size);
+    swap(used, other.used);
+    swap(free_list, other.free_list);
+    swap(count, other.count);
+  }
+
+  allocator_type get_allocator() const {
+    return allocator_type(alloc_);
+  }
+
+  template <typename InputIt>
+  void assign(InputIt first, InputIt last) {
+    clear();
+    for (; first != last; ++first) {
+      auto&& lr = *first;
+      insert(std::get<0>(lr), std::get<1>(lr));
+    }
+  }
+
+  // returns end_left() if either key is taken
+  left_iterator insert(left_t const& left, right_t const& right) {
+    // the keys may be in the first block, which can move
+    node const fresh{{hook{{nil, nil}}, hook{{nil, nil}}}, left, right};
+    index_t const i = allocate_node();
+    ::new (static_cast<void*>(&at(i))) node(fresh);
+    if (!link<left_tag>(i)) {
+      free_node(i);
+      return end_left();
+    }
+    if (!link<right_tag>(i)) {
+      unlink<left_tag>(i);
+      free_node(i);
+      return end_left();
+    }
+    ++count;
+    return left_iterator(this, i);
+  }
+
+  left_iterator erase_left(left_iterator it) {
+    return erase<left_tag>(it);
+  }
+  bool erase_left(left_t const& left) {
+    return erase_key<left_tag>(left);
+  }
+  right_iterator erase_right(right_iterator it) {
+    return erase<right_tag>(it);
+  }
+  bool erase_right(right_t const& right) {
+    return erase_key<right_tag>(right);
+  }
+
+  left_iterator find_left(left_t const& left) const {
+    return left_iterator(this, find_index<left_tag>(left));
+  }
+  right_iterator find_right(right_t const& right) const {
+    return right_iterator(this, find_index<right_tag>(right));
+  }
+
+  right_t const& at_left(left_t const& key) const {
+    return at_key<left_tag>(key);
+  }
+  left_t const& at_right(right_t const& key) const {
+    return at_key<right_tag>(key);
+  }
+
+  left_iterator lower_bound_left(left_t const& left) const {
+    return left_iterator(this, bound<left_tag, false>(left));
+  }
+  left_iterator upper_bound_left(left_t const& left) const {
+    return left_iterator(this, bound<left_tag, true>(left));
+  }
+  right_iterator lower_bound_right(right_t const& right) const {
+    return right_iterator(this, bound<right_tag, false>(right));
+  }
+  right_iterator upper_bound_right(right_t const& right) const {
+    return right_iterator(this, bound<right_tag, true>(right));
+  }
+
+  left_iterator begin_left() const {
+    return left_iterator(this, extreme<left_tag>(0));
+  }
+  left_iterator end_left() const {
+    return left_iterator(this, nil);
+  }
+
+  right_iterator begin_right() const {
+    return right_iterator(this, extreme<right_tag>(0));
+  }
+  right_iterator end_right() const {
+    return right_iterator(this, nil);
+  }
+
+  bool empty() const {
+    return count == 0;
+  }
+
+  std::size_t size() const {
+    return count;
+  }
+
+  // allocates the blocks for n pairs up front
+  void reserve(std::size_t n) {
+    if (n > max_index) {
+      throw std::length_error("compact_bimap is too large");
+    }
+    if (capacity() < n + 1) {
+      grow(n + 1);
+    }
+  }
+
+  // keeps the blocks for reuse
+  void clear() noexcept {
+    heads[0] = heads[1] = hook{{nil, nil}};
+    used = 1;
+    free_list = nil;
+    count = 0;
+  }
+
+  friend bool operator==(compact_bimap const& a, compact_bimap const& b) {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    for (auto i = a.begin_left(), j = b.begin_left(); i != a.end_left(); ++i, ++j) {
+      if (*i != *j || *i.flip() != *j.flip()) {
+        return false;
+      }
+    }
+    return true;
+  }
+  friend bool operator!=(compact_bimap const& a, compact_bimap const& b) {
+    return !(a == b);
+  }
+
+  // checks the red-black rules, the key order and the threads of both
+  // trees and that each holds size() pairs; O(n), meant for tests and
+  // debugging
+  bool verify() const {
+    return verify_tree<left_tag>() && verify_tree<right_tag>();
+  }
+
+  static constexpr std::size_t node_size = sizeof(node);
+
+private:
+  node_allocator alloc_;
+  std::vector<node*, block_allocator> blocks;
+  // nodes in blocks[0], block_nodes once there is a second block
+  std::size_t first_size{0};
+  // heads[s].link[1] is the root of tree s, as below a sentinel
+  hook heads[2]{hook{{nil, nil}}, hook{{nil, nil}}};
+  // slot 0 is never used, its index being nil
+  index_t used{1};
+  index_t free_list{nil};
+  std::size_t count{0};
+
+  template <typename Side>
+  Comparator<Side>& comparator() noexcept {
+    return static_cast<compact_detail::comparator_holder<Side, Comparator<Side>>&>(*this);
+  }
+  template <typename Side>
+  Comparator<Side> const& comparator() const noexcept {
+    return static_cast<compact_detail::comparator_holder<Side, Comparator<Side>> const&>(*this);
+  }
+
+  node& at(index_t i) noexcept {
+    return blocks[i >> block_bits][i & (block_nodes - 1)];
+  }
+  node const& at(index_t i) const noexcept {
+    return blocks[i >> block_bits][i & (block_nodes - 1)];
+  }
+
+  template <typename Side>
+  key_t<Side> const& key(index_t i) const noexcept {
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return at(i).left;
+    } else {
+      return at(i).right;
+    }
+  }
+
+  template <typename Side>
+  bool less(key_t<Side> const& a, key_t<Side> const& b) const {
+    return comparator<Side>()(a, b);
+  }
+
+  template <typename Side>
+  bool verify_tree() const {
+    std::size_t nodes = 0;
+    return !is_red<Side>(root<Side>()) &&
+           checked_black_height<Side>(root<Side>(), nil, nil, nodes) != 0 && nodes == count;
+  }
+
+  // black nodes on every path down from i, nil counting as one; 0 when the
+  // subtree breaks a rule, holds a key outside (lo, hi) or has a thread
+  // that leads elsewhere than to lo or hi, its neighbors (nil: none)
+  template <typename Side>
+  std::size_t checked_black_height(index_t i, index_t lo, index_t hi,
+                                   std::size_t& nodes) const {
+    if (i == nil) {
+      return 1;
+    }
+    ++nodes;
+    key_t<Side> const& k = key<Side>(i);
+    if ((lo != nil && !less<Side>(key<Side>(lo), k)) ||
+        (hi != nil && !less<Side>(k, key<Side>(hi)))) {
+      return 0;
+    }
+    index_t const* links = at(i).hooks[side_index<Side>].link;
+    for (int dir = 0; dir < 2; ++dir) {
+      bool const threaded = (links[dir] & thread_bit) != 0;
+      if (threaded ? (links[dir] & max_index) != (dir == 0 ? lo : hi)
+                   : (links[dir] & max_index) == nil) {
+        return 0;
+      }
+    }
+    index_t const l = down<Side>(i, 0);
+    index_t const r = down<Side>(i, 1);
+    if (is_red<Side>(i) && (is_red<Side>(l) || is_red<Side>(r))) {
+      return 0;
+    }
+    std::size_t const a = checked_black_height<Side>(l, lo, i, nodes);
+    std::size_t const b = checked_black_height<Side>(r, i, hi, nodes);
+    if (a == 0 || a != b) {
+      return 0;
+    }
+    return a + !is_red<Side>(i);
+  }
+
+  // nil stands for the sentinel in the links of a mutation
+  template <typename Side>
+  hook& hook_of(index_t i) noexcept {
+    return i == nil ? heads[side_index<Side>] : at(i).hooks[side_index<Side>];
+  }
+
+  // nil for a thread
+  template <typename Side>
+  index_t child(index_t i, int dir) noexcept {
+    index_t const l = hook_of<Side>(i).link[dir];
+    return (l & thread_bit) != 0 ? nil : l & max_index;
+  }
+
+  // c is nil only for the root of an empty tree
+  template <typename Side>
+  void set_child(index_t i, int dir, index_t c) noexcept {
+    index_t& l = hook_of<Side>(i).link[dir];
+    l = (l & red_bit) | c;
+  }
+
+  // i has no child on side dir, n is its neighbor there
+  template <typename Side>
+  void set_thread(index_t i, int dir, index_t n) noexcept {
+    index_t& l = at(i).hooks[side_index<Side>].link[dir];
+    l = (l & red_bit) | thread_bit | n;
+  }
+
+  // where the thread of i on side dir leads, i having no child there
+  template <typename Side>
+  index_t thread(index_t i, int dir) const noexcept {
+    return at(i).hooks[side_index<Side>].link[dir] & max_index;
+  }
+
+  // the node of the subtree at i furthest on side dir
+  template <typename Side>
+  index_t furthest(index_t i, int dir) const noexcept {
+    for (index_t c; (c = down<Side>(i, dir)) != nil;) {
+      i = c;
+    }
+    return i;
+  }
+
+  template <typename Side>
+  bool is_red(index_t i) const noexcept {
+    return i != nil && (at(i).hooks[side_index<Side>].link[0] & red_bit) != 0;
+  }
+
+  template <typename Side>
+  void set_red(index_t i, bool red) noexcept {
+    if (i != nil) {
+      index_t& l = at(i).hooks[side_index<Side>].link[0];
+      l = red ? (l | red_bit) : (l & ~red_bit);
+    }
+  }
+
+  // child of a node in a lookup, which never meets the sentinel
+  template <typename Side>
+  index_t down(index_t i, int dir) const noexcept {
+    index_t const l = at(i).hooks[side_index<Side>].link[dir];
+    return (l & thread_bit) != 0 ? nil : l & max_index;
+  }
+
+  template <typename Side>
+  index_t root() const noexcept {
+    return heads[side_index<Side>].link[1] & max_index;
+  }
+
+  template <typename Side>
+  index_t find_index(key_t<Side> const& k) const {
+    index_t cur = root<Side>();
+    while (cur != nil) {
+      if (less<Side>(k, key<Side>(cur))) {
+        cur = down<Side>(cur, 0);
+      } else if (less<Side>(key<Side>(cur), k)) {
+        cur = down<Side>(cur, 1);
+      } else {
+        return cur;
+      }
+    }
+    return nil;
+  }
+
+  // first node not less than k, or greater than k when Upper
+  template <typename Side, bool Upper>
+  index_t bound(key_t<Side> const& k) const {
+    index_t cur = root<Side>();
+    index_t result = nil;
+    while (cur != nil) {
+      bool const go_left =
+          Upper ? less<Side>(k, key<Side>(cur)) : !less<Side>(key<Side>(cur), k);
+      if (go_left) {
+        result = cur;
+        cur = down<Side>(cur, 0);
+      } else {
+        cur = down<Side>(cur, 1);
+      }
+    }
+    return result;
+  }
+
+  // minimum (dir 0) or maximum (dir 1)
+  template <typename Side>
+  index_t extreme(int dir) const noexcept {
+    index_t const r = root<Side>();
+    return r == nil ? nil : furthest<Side>(r, dir);
+  }
+
+  // the neighbor of i on side dir: its thread, or the node furthest
+  // back in the subtree on that side
+  template <typename Side>
+  index_t neighbor(index_t i, int dir) const noexcept {
+    index_t const c = down<Side>(i, dir);
+    return c == nil ? thread<Side>(i, dir) : furthest<Side>(c, !dir);
+  }
+
+  template <typename Side>
+  index_t next(index_t i) const noexcept {
+    return neighbor<Side>(i, 1);
+  }
+
+  // the maximum for nil, so that --end() is the last pair
+  template <typename Side>
+  index_t prev(index_t i) const noexcept {
+    return i == nil ? extreme<Side>(1) : neighbor<Side>(i, 0);
+  }
+
+  template <typename Side>
+  key_t<Other<Side>> const& at_key(key_t<Side> const& k) const {
+    index_t const i = find_index<Side>(k);
+    if (i == nil) {
+      throw std::out_of_range("No such element");
+    }
+    return key<Other<Side>>(i);
+  }
+
+  // rotates r away from dir, the child taking its place turns black; if
+  // that child has no inner subtree for r, r threads to it
+  template <typename Side>
+  index_t rotate(index_t r, int dir) noexcept {
+    index_t const save = child<Side>(r, !dir);
+    if (index_t const inner = child<Side>(save, dir); inner != nil) {
+      set_child<Side>(r, !dir, inner);
+    } else {
+      set_thread<Side>(r, !dir, save);
+    }
+    set_child<Side>(save, dir, r);
+    set_red<Side>(r, true);
+    set_red<Side>(save, false);
+    return save;
+  }
+
+  template <typename Side>
+  index_t rotate_twice(index_t r, int dir) noexcept {
+    set_child<Side>(r, !dir, rotate<Side>(child<Side>(r, !dir), !dir));
+    return rotate<Side>(r, dir);
+  }
+
+  // links z splitting 4-nodes on the way down; if its key is taken the
+  // descent stops there and returns false, the tree rebalanced but valid
+  template <typename Side>
+  bool link(index_t z) {
+    set_red<Side>(z, true);
+    index_t q = root<Side>();
+    if (q == nil) {
+      set_child<Side>(nil, 1, z);
+      set_thread<Side>(z, 0, nil);
+      set_thread<Side>(z, 1, nil);
+      set_red<Side>(z, false);
+      return true;
+    }
+    // great-grandparent (nil: sentinel), grandparent, parent
+    index_t t = nil;
+    index_t g = nil;
+    index_t p = nil;
+    int dir = 0;
+    int last = 0;
+    bool has_g = false;
+    bool has_p = false;
+    for (;;) {
+      if (q == nil) {
+        // z takes over the thread of p on its side and leads back to p
+        q = z;
+        set_thread<Side>(z, dir, thread<Side>(p, dir));
+        set_thread<Side>(z, !dir, p);
+        set_child<Side>(p, dir, q);
+      } else if (is_red<Side>(child<Side>(q, 0)) && is_red<Side>(child<Side>(q, 1))) {
+        set_red<Side>(q, true);
+        set_red<Side>(child<Side>(q, 0), false);
+        set_red<Side>(child<Side>(q, 1), false);
+      }
+      if (has_g && is_red<Side>(q) && is_red<Side>(p)) {
+        int const dir2 = child<Side>(t, 1) == g;
+        if (q == child<Side>(p, last)) {
+          set_child<Side>(t, dir2, rotate<Side>(g, !last));
+        } else {
+          set_child<Side>(t, dir2, rotate_twice<Side>(g, !last));
+        }
+      }
+      if (q == z) {
+        break;
+      }
+      bool const q_less = less<Side>(key<Side>(q), key<Side>(z));
+      if (!q_less && !less<Side>(key<Side>(z), key<Side>(q))) {
+        set_red<Side>(root<Side>(), false);
+        return false;
+      }
+      last = dir;
+      dir = q_less;
+      if (has_g) {
+        t = g;
+      }
+      g = p;
+      has_g = has_p;
+      p = q;
+      has_p = true;
+      q = child<Side>(q, dir);
+    }
+    set_red<Side>(root<Side>(), false);
+    return true;
+  }
+
+  // unlinks f, pushing a red node down the search path so that the node
+  // removed is red or has a red child; f's predecessor takes its place
+  template <typename Side>
+  void unlink(index_t f) noexcept {
+    key_t<Side> const& k = key<Side>(f);
+    index_t q = nil;
+    index_t p = nil;
+    index_t g = nil;
+    int dir = 1;
+    while (child<Side>(q, dir) != nil) {
+      int const last = dir;
+      g = p;
+      p = q;
+      q = child<Side>(q, dir);
+      dir = q != f && less<Side>(key<Side>(q), k);
+      if (!is_red<Side>(q) && !is_red<Side>(child<Side>(q, dir))) {
+        if (is_red<Side>(child<Side>(q, !dir))) {
+          index_t const n = rotate<Side>(q, dir);
+          set_child<Side>(p, last, n);
+          p = n;
+        } else {
+          index_t const s = child<Side>(p, !last);
+          if (s != nil) {
+            if (!is_red<Side>(child<Side>(s, !last)) && !is_red<Side>(child<Side>(s, last))) {
+              set_red<Side>(p, false);
+              set_red<Side>(s, true);
+              set_red<Side>(q, true);
+            } else {
+              int const dir2 = child<Side>(g, 1) == p;
+              if (is_red<Side>(child<Side>(s, last))) {
+                set_child<Side>(g, dir2, rotate_twice<Side>(p, last));
+              } else {
+                set_child<Side>(g, dir2, rotate<Side>(p, last));
+              }
+              index_t const n = child<Side>(g, dir2);
+              set_red<Side>(q, true);
+              set_red<Side>(n, true);
+              set_red<Side>(child<Side>(n, 0), false);
+              set_red<Side>(child<Side>(n, 1), false);
+            }
+          }
+        }
+      }
+    }
+
+    // q has at most one child c and p is its parent; the thread from the
+    // far end of c, or from p if there is no c, skips q
+    int const dq = child<Side>(p, 1) == q;
+    int const dc = child<Side>(q, 0) == nil;
+    if (index_t const c = child<Side>(q, dc); c != nil) {
+      set_child<Side>(p, dq, c);
+      set_thread<Side>(furthest<Side>(c, !dc), !dc, thread<Side>(q, !dc));
+    } else if (p == nil) {
+      set_child<Side>(nil, 1, nil);
+    } else {
+      set_thread<Side>(p, dq, thread<Side>(q, dq));
+    }
+    if (q != f) {
+      index_t pf = nil;
+      int df = 1;
+      while (child<Side>(pf, df) != f) {
+        pf = child<Side>(pf, df);
+        df = less<Side>(key<Side>(pf), k);
+      }
+      at(q).hooks[side_index<Side>] = at(f).hooks[side_index<Side>];
+      set_child<Side>(pf, df, q);
+      // the neighbors of f below it thread to q now
+      for (int d = 0; d < 2; ++d) {
+        if (index_t const c = child<Side>(q, d); c != nil) {
+          set_thread<Side>(furthest<Side>(c, !d), !d, q);
+        }
+      }
+    }
+    set_red<Side>(root<Side>(), false);
+  }
+
+  template <typename Side>
+  iterator<Side> erase(iterator<Side> it) {
+    index_t const i = it.index;
+    index_t const following = next<Side>(i);
+    unlink<left_tag>(i);
+    unlink<right_tag>(i);
+    free_node(i);
+    --count;
+    return iterator<Side>(this, following);
+  }
+
+  template <typename Side>
+  bool erase_key(key_t<Side> const& k) {
+    index_t const i = find_index<Side>(k);
+    if (i == nil) {
+      return false;
+    }
+    unlink<left_tag>(i);
+    unlink<right_tag>(i);
+    free_node(i);
+    --count;
+    return true;
+  }
+
+  std::size_t capacity() const noexcept {
+    return blocks.empty() ? 0 : first_size + (blocks.size() - 1) * block_nodes;
+  }
+
+  // makes room for n slots: the first block doubles up to block_nodes,
+  // taking the slots in use along, then whole blocks are added
+  void grow(std::size_t n) {
+    if (first_size < block_nodes) {
+      std::size_t size = first_size == 0 ? first_nodes : first_size * 2;
+      while (size < n && size < block_nodes) {
+        size *= 2;
+      }
+      if (blocks.empty()) {
+        blocks.reserve(1);
+        blocks.push_back(node_traits::allocate(alloc_, size));
+      } else {
+        node* block = node_traits::allocate(alloc_, size);
+        if (used > 1) {
+          std::memcpy(static_cast<void*>(block + 1), blocks[0] + 1, (used - 1) * sizeof(node));
+        }
+        node_traits::deallocate(alloc_, blocks[0], first_size);
+        blocks[0] = block;
+      }
+      first_size = size;
+    }
+    while (capacity() < n) {
+      blocks.reserve(blocks.size() + 1);
+      blocks.push_back(node_traits::allocate(alloc_, block_nodes));
+    }
+  }
+
+  // erased slots are reused before the pool grows
+  index_t allocate_node() {
+    if (free_list != nil) {
+      index_t const i = free_list;
+      free_list = at(i).hooks[0].link[0];
+      return i;
+    }
+    if (used > max_index) {
+      throw std::length_error("compact_bimap is too large");
+    }
+    if (used >= capacity()) {
+      grow(used + std::size_t(1));
+    }
+    return used++;
+  }
+
+  void free_node(index_t i) noexcept {
+    at(i).hooks[0].link[0] = free_list;
+    free_list = i;
+  }
+
+  void release_blocks() noexcept {
+    for (std::size_t b = 0; b < blocks.size(); ++b) {
+      node_traits::deallocate(alloc_, blocks[b], b == 0 ? first_size : block_nodes);
+    }
+    blocks.clear();
+    first_size = 0;
+    clear();
+  }
+
+  void copy_from(compact_bimap const& other) {
+    std::size_t const n = other.used;
+    try {
+      if (n > 1) {
+        grow(n);
+      }
+    } catch (...) {
+      release_blocks();
+      throw;
+    }
+    for (std::size_t b = 0; b * block_nodes < n; ++b) {
+      std::size_t const first = b == 0 ? 1 : 0;
+      std::size_t const last = std::min(b == 0 ? first_size : block_nodes, n - b * block_nodes);
+      if (first < last) {
+        std::memcpy(static_cast<void*>(blocks[b] + first), other.blocks[b] + first,
+                    (last - first) * sizeof(node));
+      }
+    }
+    heads[0] = other.heads[0];
+    heads[1] = other.heads[1];
+    used = other.used;
+    free_list = other.free_list;
+    count = other.count;
+  }
+
+  void take(compact_bimap& other) noexcept {
+    blocks.swap(other.blocks);
+    std::swap(first_size, other.first_size);
+    heads[0] = other.heads[0];
+    heads[1] = other.heads[1];
+    used = other.used;
+    free_list = other.free_list;
+    count = other.count;
+    other.clear();
+  }
+};
+
+// Node size report, bytes per pair
+//                                   compact_bimap
+// compact_bimap<uint32_t, uint32_t>      24
+// compact_bimap<uint64_t, uint64_t>      32
+static_assert(compact_bimap<uint32_t, uint32_t>::node_size == 24);
+static_assert(compact_bimap<uint64_t, uint64_t>::node_size == 32);
@@ -0,0 +1,29 @@
+#include "concurrent_bimap.h"
+
+#include <functional>
+#include <thread>
+
+std::size_t read_indicator::this_thread_stripe() noexcept {
+  thread_local std::size_t const stripe =
+      std::hash<std::thread::id>()(std::this_thread::get_id()) % stripes;
+  return stripe;
+}
+
+std::size_t read_indicator::arrive() noexcept {
+  std::size_t const stripe = this_thread_stripe();
+  counters[stripe].readers.fetch_add(1);
+  return stripe;
+}
+
+void read_indicator::depart(std::size_t stripe) noexcept {
+  counters[stripe].readers.fetch_sub(1);
+}
+
+bool read_indicator::empty() const noexcept {
+  for (auto const& c : counters) {
+    if (c.readers.load() != 0) {
+      return false;
+    }
+  }
+  return true;
+}
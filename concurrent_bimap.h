@@ -0,0 +1,212 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include "bimap.h"
+
+// Counts the readers inside a critical section. Each thread arrives on one
+// of several cache-line sized stripes, so readers on different cores do not
+// write to a shared line.
+struct read_indicator {
+  static constexpr std::size_t stripes = 64;
+
+  read_indicator() noexcept = default;
+
+  read_indicator(read_indicator const&) = delete;
+  read_indicator& operator=(read_indicator const&) = delete;
+
+  // returns the stripe to pass to depart
+  std::size_t arrive() noexcept;
+
+  void depart(std::size_t stripe) noexcept;
+
+  bool empty() const noexcept;
+
+ private:
+  struct alignas(64) counter {
+    std::atomic<std::size_t> readers{0};
+  };
+
+  counter counters[stripes];
+
+  static std::size_t this_thread_stripe() noexcept;
+};
+
+// bimap for read-mostly workloads shared between threads, using the
+// Left-Right technique: two bimap instances hold the same pairs. Readers
+// take no lock and never wait, they announce themselves on a read_indicator
+// and search the instance currently published for reading. A writer, one at
+// a time, modifies the other instance, publishes it, waits until no reader
+// is left on the old one and repeats the modification there. Nodes are thus
+// never freed under a reader, at the cost of twice the memory and of every
+// write being done twice.
+//
+// Lookups return copies. Iterators and flip() are only valid inside read(f),
+// which sees a consistent snapshot: no writer modifies the instance f is
+// reading until f returns. Writers are blocked meanwhile, so f should be short.
+template <typename Left, typename Right,
+          typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>,
+          typename Allocator = std::allocator<std::pair<Left, Right>>>
+struct concurrent_bimap {
+  using map_type = bimap<Left, Right, CompareLeft, CompareRight, Allocator>;
+  using left_t = Left;
+  using right_t = Right;
+
+  explicit concurrent_bimap(CompareLeft compare_left = CompareLeft(),
+                            CompareRight compare_right = CompareRight(),
+                            Allocator const& alloc = Allocator())
+      : maps{map_type(compare_left, compare_right, alloc),
+             map_type(compare_left, compare_right, alloc)} {}
+
+  concurrent_bimap(concurrent_bimap const&) = delete;
+  concurrent_bimap& operator=(concurrent_bimap const&) = delete;
+
+  // calls f(map_type const&) on a consistent snapshot and returns its result
+  template <typename F>
+  decltype(auto) read(F&& f) const {
+    std::size_t const version = version_index.load();
+    std::size_t const stripe = indicators[version].arrive();
+    struct departure {
+      read_indicator& indicator;
+      std::size_t stripe;
+      ~departure() {
+        indicator.depart(stripe);
+      }
+    } guard{indicators[version], stripe};
+    return std::invoke(std::forward<F>(f), maps[read_index.load()]);
+  }
+
+  std::optional<right_t> find_left(left_t const& left) const {
+    return read([&](map_type const& m) -> std::optional<right_t> {
+      auto it = m.find_left(left);
+      if (it == m.end_left()) {
+        return std::nullopt;
+      }
+      return *it.flip();
+    });
+  }
+
+  std::optional<left_t> find_right(right_t const& right) const {
+    return read([&](map_type const& m) -> std::optional<left_t> {
+      auto it = m.find_right(right);
+      if (it == m.end_right()) {
+        return std::nullopt;
+      }
+      return *it.flip();
+    });
+  }
+
+  right_t at_left(left_t const& key) const {
+    return read([&](map_type const& m) {
+      return m.at_left(key);
+    });
+  }
+
+  left_t at_right(right_t const& key) const {
+    return read([&](map_type const& m) {
+      return m.at_right(key);
+    });
+  }
+
+  std::size_t size() const {
+    return read([](map_type const& m) {
+      return m.size();
+    });
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  bool insert(left_t const& left, right_t const& right) {
+    return modify([&](map_type& m) {
+      return m.insert(left, right) != m.end_left();
+    });
+  }
+
+  bool erase_left(left_t const& left) {
+    return modify([&](map_type& m) {
+      return m.erase_left(left);
+    });
+  }
+
+  bool erase_right(right_t const& right) {
+    return modify([&](map_type& m) {
+      return m.erase_right(right);
+    });
+  }
+
+  // replaces the contents by fresh, e.g. a map from bimap_builder: readers
+  // move to it at once by the pointer swap of a write. The copy for the
+  // second instance is made first, so an exception changes nothing.
+  void assign(map_type fresh) {
+    std::lock_guard<std::mutex> lock(writer);
+    map_type copy(fresh);
+    std::size_t const current = read_index.load();
+    maps[1 - current].swap(fresh);
+    read_index.store(1 - current);
+    wait_for_readers();
+    maps[current].swap(copy);
+  }
+
+  // applies f(map_type&) to both instances and returns the first result.
+  // f must behave the same on equal maps, and must leave the map unchanged
+  // when it throws. Should the second application throw, the instances
+  // are resynchronized by copying before the exception is rethrown.
+  template <typename F>
+  std::invoke_result_t<F&, map_type&> modify(F&& f) {
+    std::lock_guard<std::mutex> lock(writer);
+    std::size_t const current = read_index.load();
+    if constexpr (std::is_void_v<std::invoke_result_t<F&, map_type&>>) {
+      std::invoke(f, maps[1 - current]);
+      replay(f, current);
+    } else {
+      std::invoke_result_t<F&, map_type&> result = std::invoke(f, maps[1 - current]);
+      replay(f, current);
+      return result;
+    }
+  }
+
+private:
+  map_type maps[2];
+  std::atomic<std::size_t> read_index{0};
+  std::atomic<std::size_t> version_index{0};
+  mutable read_indicator indicators[2];
+  std::mutex writer;
+
+  // publishes the modified instance, then repeats f on the old one
+  template <typename F>
+  void replay(F& f, std::size_t current) {
+    read_index.store(1 - current);
+    wait_for_readers();
+    try {
+      std::invoke(f, maps[current]);
+    } catch (...) {
+      maps[current] = maps[1 - current];
+      throw;
+    }
+  }
+
+  // a reader may have read read_index before the store, it is either
+  // counted on the current version or will arrive on the next one
+  void wait_for_readers() {
+    std::size_t const prev = version_index.load();
+    std::size_t const next = 1 - prev;
+    while (!indicators[next].empty()) {
+      std::this_thread::yield();
+    }
+    version_index.store(next);
+    while (!indicators[prev].empty()) {
+      std::this_thread::yield();
+    }
+  }
+};
@@ -0,0 +1,692 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "bimap.h"
+#include "flat_search.h"
+
+// Sorted-array engine with the interface of bimap. Each side keeps its keys
+// in one contiguous sorted array, so a lookup is a binary search over
+// adjacent keys instead of a pointer chase, and next to every key the
+// position of its pair in the other side's array, which is what flip()
+// follows. Insertion and erasure shift both arrays: O(n), invalidating
+// all iterators. Suited for read-mostly maps.
+template <typename Left, typename Right,
+          typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>,
+          typename Allocator = std::allocator<std::pair<Left, Right>>>
+struct flat_bimap {
+  using left_t = Left;
+  using right_t = Right;
+  using allocator_type = Allocator;
+  template <typename Side>
+  using key_t = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      left_t,
+      right_t>;
+
+  template <typename Side>
+  using Comparator = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      CompareLeft,
+      CompareRight>;
+
+private:
+  // positions on the other side, at most 2^32 - 1 pairs
+  using index_t = std::uint32_t;
+
+  template <typename T>
+  using vector_t = std::vector<
+      T, typename std::allocator_traits<Allocator>::template rebind_alloc<T>>;
+
+  template <typename Side>
+  struct side_t : Comparator<Side> {
+    vector_t<key_t<Side>> keys;
+    vector_t<index_t> other;
+
+    side_t(Comparator<Side> const& cmp, Allocator const& alloc)
+        : Comparator<Side>(cmp), keys(alloc), other(alloc) {}
+
+    Comparator<Side> const& comparator() const {
+      return *this;
+    }
+  };
+
+public:
+  template <typename Side>
+  struct base_iterator {
+    friend flat_bimap;
+    using iterator_category = std::random_access_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = key_t<Side>;
+    using pointer = value_type const*;
+    using reference = value_type const&;
+
+    base_iterator() = default;
+
+    reference operator*() const {
+      return map_p->template side<Side>().keys[pos];
+    }
+    pointer operator->() const {
+      return &**this;
+    }
+    reference operator[](difference_type n) const {
+      return *(*this + n);
+    }
+
+    base_iterator& operator++() {
+      ++pos;
+      return *this;
+    }
+    base_iterator operator++(int) {
+      base_iterator tmp(*this);
+      ++*this;
+      return tmp;
+    }
+
+    base_iterator& operator--() {
+      --pos;
+      return *this;
+    }
+    base_iterator operator--(int) {
+      base_iterator tmp(*this);
+      --*this;
+      return tmp;
+    }
+
+    base_iterator& operator+=(difference_type n) {
+      pos = static_cast<std::size_t>(static_cast<difference_type>(pos) + n);
+      return *this;
+    }
+    base_iterator& operator-=(difference_type n) {
+      return *this += -n;
+    }
+
+    friend base_iterator operator+(base_iterator a, difference_type n) {
+      return a += n;
+    }
+    friend base_iterator operator+(difference_type n, base_iterator a) {
+      return a += n;
+    }
+    friend base_iterator operator-(base_iterator a, difference_type n) {
+      return a -= n;
+    }
+    friend difference_type operator-(base_iterator const& a, base_iterator const& b) {
+      return static_cast<difference_type>(a.pos) - static_cast<difference_type>(b.pos);
+    }
+
+    base_iterator<Other<Side>> flip() const {
+      auto const& s = map_p->template side<Side>();
+      if (pos == s.keys.size()) {
+        return base_iterator<Other<Side>>(map_p, pos);
+      }
+      return base_iterator<Other<Side>>(map_p, s.other[pos]);
+    }
+
+    friend bool operator==(base_iterator const& a, base_iterator const& b) {
+      return a.pos == b.pos;
+    }
+    friend bool operator!=(base_iterator const& a, base_iterator const& b) {
+      return !(a == b);
+    }
+    friend bool operator<(base_iterator const& a, base_iterator const& b) {
+      return a.pos < b.pos;
+    }
+    friend bool operator>(base_iterator const& a, base_iterator const& b) {
+      return b < a;
+    }
+    friend bool operator<=(base_iterator const& a, base_iterator const& b) {
+      return !(b < a);
+    }
+    friend bool operator>=(base_iterator const& a, base_iterator const& b) {
+      return !(a < b);
+    }
+
+  private:
+    flat_bimap const* map_p{nullptr};
+    std::size_t pos{0};
+
+    base_iterator(flat_bimap const* p, std::size_t pos) : map_p(p), pos(pos) {}
+  };
+
+  using right_iterator = base_iterator<right_tag>;
+  using left_iterator = base_iterator<left_tag>;
+  template <typename Side>
+  using iterator = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      left_iterator,
+      right_iterator>;
+
+  explicit flat_bimap(CompareLeft compare_left = CompareLeft(),
+                      CompareRight compare_right = CompareRight(),
+                      Allocator const& alloc = Allocator())
+      : left_side(compare_left, alloc),
+        right_side(compare_right, alloc) {}
+
+  explicit flat_bimap(Allocator const& alloc)
+      : flat_bimap(CompareLeft(), CompareRight(), alloc) {}
+
+  // pairs are inserted one by one, later duplicates are skipped
+  template <typename InputIt>
+  flat_bimap(InputIt first, InputIt last,
+             CompareLeft compare_left = CompareLeft(),
+             CompareRight compare_right = CompareRight(),
+             Allocator const& alloc = Allocator())
+      : flat_bimap(compare_left, compare_right, alloc) {
+    assign(first, last);
+  }
+
+  // input ordered by left keys without duplicates, O(n log n);
+  // pairs with an already taken right key are skipped
+  template <typename InputIt>
+  flat_bimap(sorted_unique_t, InputIt first, InputIt last,
+             CompareLeft compare_left = CompareLeft(),
+             CompareRight compare_right = CompareRight(),
+             Allocator const& alloc = Allocator())
+      : flat_bimap(compare_left, compare_right, alloc) {
+    assign(sorted_unique, first, last);
+  }
+
+  void swap(flat_bimap& other) {
+    std::swap(left_side, other.left_side);
+    std::swap(right_side, other.right_side);
+  }
+
+  allocator_type get_allocator() const {
+    return allocator_type(left_side.keys.get_allocator());
+  }
+
+  template <typename InputIt>
+  void assign(InputIt first, InputIt last) {
+    clear();
+    for (; first != last; ++first) {
+      auto&& lr = *first;
+      insert_(std::get<0>(std::forward<decltype(lr)>(lr)),
+              std::get<1>(std::forward<decltype(lr)>(lr)));
+    }
+  }
+
+  template <typename InputIt>
+  void assign(sorted_unique_t, InputIt first, InputIt last) {
+    clear();
+    vector_t<right_t> rights(get_allocator());
+    for (; first != last; ++first) {
+      auto&& lr = *first;
+      left_side.keys.push_back(std::get<0>(std::forward<decltype(lr)>(lr)));
+      rights.push_back(std::get<1>(std::forward<decltype(lr)>(lr)));
+    }
+    check_size(rights.size());
+
+    // stable: the pair met first keeps the right key, as with insert
+    std::vector<index_t> order(rights.size());
+    for (std::size_t i = 0; i < order.size(); ++i) {
+      order[i] = static_cast<index_t>(i);
+    }
+    auto const& cmp = right_side.comparator();
+    std::stable_sort(order.begin(), order.end(), [&](index_t a, index_t b) {
+      return cmp(rights[a], rights[b]);
+    });
+
+    std::vector<bool> kept(rights.size(), false);
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < order.size(); ++i) {
+      if (count == 0 || cmp(rights[order[count - 1]], rights[order[i]])) {
+        kept[order[i]] = true;
+        order[count++] = order[i];
+      }
+    }
+    order.resize(count);
+
+    // new left positions of the kept pairs
+    std::vector<index_t> left_pos(rights.size());
+    std::size_t kept_left = 0;
+    for (std::size_t i = 0; i < rights.size(); ++i) {
+      left_pos[i] = static_cast<index_t>(kept_left);
+      if (kept[i]) {
+        if (kept_left != i) {
+          left_side.keys[kept_left] = std::move(left_side.keys[i]);
+        }
+        ++kept_left;
+      }
+    }
+    left_side.keys.erase(left_side.keys.begin() + static_cast<std::ptrdiff_t>(count),
+                         left_side.keys.end());
+
+    left_side.other.resize(count);
+    right_side.other.resize(count);
+    right_side.keys.reserve(count);
+    for (std::size_t q = 0; q < count; ++q) {
+      right_side.keys.push_back(std::move(rights[order[q]]));
+      index_t p = left_pos[order[q]];
+      right_side.other[q] = p;
+      left_side.other[p] = static_cast<index_t>(q);
+    }
+  }
+
+  left_iterator insert(left_t const& left, right_t const& right) {
+    return insert_(left, right);
+  }
+  left_iterator insert(left_t const& left, right_t&& right) {
+    return insert_(left, std::move(right));
+  }
+  left_iterator insert(left_t&& left, right_t const& right) {
+    return insert_(std::move(left), right);
+  }
+  left_iterator insert(left_t&& left, right_t&& right) {
+    return insert_(std::move(left), std::move(right));
+  }
+
+  left_iterator erase_left(left_iterator it) {
+    return erase<left_tag>(it);
+  }
+  bool erase_left(left_t const& left) {
+    return erase_key<left_tag>(left);
+  }
+
+  right_iterator erase_right(right_iterator it) {
+    return erase<right_tag>(it);
+  }
+  bool erase_right(right_t const& right) {
+    return erase_key<right_tag>(right);
+  }
+
+  left_iterator erase_left(left_iterator first, left_iterator last) {
+    return erase<left_tag>(first, last);
+  }
+  right_iterator erase_right(right_iterator first, right_iterator last) {
+    return erase<right_tag>(first, last);
+  }
+
+  left_iterator find_left(left_t const& left) const {
+    return find<left_tag>(left);
+  }
+  template <typename K, typename C = CompareLeft, typename = typename C::is_transparent>
+  left_iterator find_left(K const& left) const {
+    return find<left_tag>(left);
+  }
+  right_iterator find_right(right_t const& right) const {
+    return find<right_tag>(right);
+  }
+  template <typename K, typename C = CompareRight, typename = typename C::is_transparent>
+  right_iterator find_right(K const& right) const {
+    return find<right_tag>(right);
+  }
+
+  template <typename KeyIt, typename OutIt>
+  OutIt find_left_batch(KeyIt first, KeyIt last, OutIt out) const {
+    for (; first != last; ++first, ++out) {
+      *out = find<left_tag>(*first);
+    }
+    return out;
+  }
+  template <typename KeyIt, typename OutIt>
+  OutIt find_right_batch(KeyIt first, KeyIt last, OutIt out) const {
+    for (; first != last; ++first, ++out) {
+      *out = find<right_tag>(*first);
+    }
+    return out;
+  }
+
+  template <typename KeyIt, typename OutIt>
+  OutIt at_left_batch(KeyIt first, KeyIt last, OutIt out) const {
+    for (; first != last; ++first, ++out) {
+      *out = at<left_tag>(*first);
+    }
+    return out;
+  }
+  template <typename KeyIt, typename OutIt>
+  OutIt at_right_batch(KeyIt first, KeyIt last, OutIt out) const {
+    for (; first != last; ++first, ++out) {
+      *out = at<right_tag>(*first);
+    }
+    return out;
+  }
+
+  right_t const& at_left(left_t const& key) const {
+    return at<left_tag>(key);
+  }
+  template <typename K, typename C = CompareLeft, typename = typename C::is_transparent>
+  right_t const& at_left(K const& key) const {
+    return at<left_tag>(key);
+  }
+  left_t const& at_right(right_t const& key) const {
+    return at<right_tag>(key);
+  }
+  template <typename K, typename C = CompareRight, typename = typename C::is_transparent>
+  left_t const& at_right(K const& key) const {
+    return at<right_tag>(key);
+  }
+
+  template <typename U = right_t,
+      typename = std::enable_if_t<std::is_default_constructible_v<U>>>
+  right_t const& at_left_or_default(left_t const& key) {
+    return at_or_default<left_tag>(key);
+  }
+  template <typename U = left_t,
+      typename = std::enable_if_t<std::is_default_constructible_v<U>>>
+  left_t const& at_right_or_default(right_t const& key) {
+    return at_or_default<right_tag>(key);
+  }
+
+  left_iterator lower_bound_left(left_t const& left) const {
+    return lower_bound<left_tag>(left);
+  }
+  template <typename K, typename C = CompareLeft, typename = typename C::is_transparent>
+  left_iterator lower_bound_left(K const& left) const {
+    return lower_bound<left_tag>(left);
+  }
+  left_iterator upper_bound_left(left_t const& left) const {
+    return upper_bound<left_tag>(left);
+  }
+  template <typename K, typename C = CompareLeft, typename = typename C::is_transparent>
+  left_iterator upper_bound_left(K const& left) const {
+    return upper_bound<left_tag>(left);
+  }
+
+  right_iterator lower_bound_right(right_t const& right) const {
+    return lower_bound<right_tag>(right);
+  }
+  template <typename K, typename C = CompareRight, typename = typename C::is_transparent>
+  right_iterator lower_bound_right(K const& right) const {
+    return lower_bound<right_tag>(right);
+  }
+  right_iterator upper_bound_right(right_t const& right) const {
+    return upper_bound<right_tag>(right);
+  }
+  template <typename K, typename C = CompareRight, typename = typename C::is_transparent>
+  right_iterator upper_bound_right(K const& right) const {
+    return upper_bound<right_tag>(right);
+  }
+
+  left_iterator begin_left() const {
+    return left_iterator(this, 0);
+  }
+  left_iterator end_left() const {
+    return left_iterator(this, size());
+  }
+
+  right_iterator begin_right() const {
+    return right_iterator(this, 0);
+  }
+  right_iterator end_right() const {
+    return right_iterator(this, size());
+  }
+
+  bool empty() const {
+    return left_side.keys.empty();
+  }
+
+  std::size_t size() const {
+    return left_side.keys.size();
+  }
+
+  void reserve(std::size_t n) {
+    left_side.keys.reserve(n);
+    left_side.other.reserve(n);
+    right_side.keys.reserve(n);
+    right_side.other.reserve(n);
+  }
+
+  friend bool operator==(flat_bimap const& a, flat_bimap const& b) {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    for (std::size_t i = 0; i < a.size(); ++i) {
+      if (a.left_side.keys[i] != b.left_side.keys[i] ||
+          a.right_side.keys[a.left_side.other[i]] !=
+              b.right_side.keys[b.left_side.other[i]]) {
+        return false;
+      }
+    }
+    return true;
+  }
+  friend bool operator!=(flat_bimap const& a, flat_bimap const& b) {
+    return !(a == b);
+  }
+
+private:
+  side_t<left_tag> left_side;
+  side_t<right_tag> right_side;
+
+  template <typename Side>
+  side_t<Side>& side() {
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return left_side;
+    } else {
+      return right_side;
+    }
+  }
+
+  template <typename Side>
+  side_t<Side> const& side() const {
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return left_side;
+    } else {
+      return right_side;
+    }
+  }
+
+  static void check_size(std::size_t n) {
+    if (n > std::numeric_limits<index_t>::max()) {
+      throw std::length_error("flat_bimap is too large");
+    }
+  }
+
+  template <typename Side, typename K>
+  std::size_t lower_bound_pos(K const& key) const {
+    auto const& s = side<Side>();
+    return static_cast<std::size_t>(
+        flat_search::lower_bound(s.keys.begin(), s.keys.end(), key, s.comparator()) -
+        s.keys.begin());
+  }
+
+  template <typename Side, typename K>
+  std::size_t upper_bound_pos(K const& key) const {
+    auto const& s = side<Side>();
+    return static_cast<std::size_t>(
+        flat_search::upper_bound(s.keys.begin(), s.keys.end(), key, s.comparator()) -
+        s.keys.begin());
+  }
+
+  // position of key, size() if absent
+  template <typename Side, typename K>
+  std::size_t find_pos(K const& key) const {
+    auto const& s = side<Side>();
+    std::size_t pos = lower_bound_pos<Side>(key);
+    if (pos != s.keys.size() && s.comparator()(key, s.keys[pos])) {
+      return s.keys.size();
+    }
+    return pos;
+  }
+
+  template <typename Side, typename K>
+  iterator<Side> find(K const& key) const {
+    return iterator<Side>(this, find_pos<Side>(key));
+  }
+
+  template <typename Side, typename K>
+  key_t<Other<Side>> const& at(K const& key) const {
+    auto it = find<Side>(key);
+    if (it == iterator<Side>(this, size())) {
+      throw std::out_of_range("No such element");
+    }
+    return *it.flip();
+  }
+
+  template <typename Side, typename K>
+  iterator<Side> lower_bound(K const& key) const {
+    return iterator<Side>(this, lower_bound_pos<Side>(key));
+  }
+
+  template <typename Side, typename K>
+  iterator<Side> upper_bound(K const& key) const {
+    return iterator<Side>(this, upper_bound_pos<Side>(key));
+  }
+
+  template <typename T>
+  static void grow(vector_t<T>& v) {
+    if (v.size() == v.capacity()) {
+      v.reserve(std::max<std::size_t>(2 * v.capacity(), 8));
+    }
+  }
+
+  template <typename L, typename R>
+  left_iterator insert_(L&& left, R&& right) {
+    std::size_t p = lower_bound_pos<left_tag>(left);
+    if (p != size() && !left_side.comparator()(left, left_side.keys[p])) {
+      return end_left();
+    }
+    std::size_t q = lower_bound_pos<right_tag>(right);
+    if (q != size() && !right_side.comparator()(right, right_side.keys[q])) {
+      return end_left();
+    }
+    return insert_at(p, q, std::forward<L>(left), std::forward<R>(right));
+  }
+
+  // p and q are the free positions of the keys on their sides
+  template <typename L, typename R>
+  left_iterator insert_at(std::size_t p, std::size_t q, L&& left, R&& right) {
+    check_size(size() + 1);
+    grow(left_side.keys);
+    grow(left_side.other);
+    grow(right_side.keys);
+    grow(right_side.other);
+
+    left_side.keys.insert(left_side.keys.begin() + static_cast<std::ptrdiff_t>(p),
+                          std::forward<L>(left));
+    try {
+      right_side.keys.insert(right_side.keys.begin() + static_cast<std::ptrdiff_t>(q),
+                             std::forward<R>(right));
+    } catch (...) {
+      left_side.keys.erase(left_side.keys.begin() + static_cast<std::ptrdiff_t>(p));
+      throw;
+    }
+
+    for (auto& i : left_side.other) {
+      i += (i >= q);
+    }
+    for (auto& i : right_side.other) {
+      i += (i >= p);
+    }
+    left_side.other.insert(left_side.other.begin() + static_cast<std::ptrdiff_t>(p),
+                           static_cast<index_t>(q));
+    right_side.other.insert(right_side.other.begin() + static_cast<std::ptrdiff_t>(q),
+                            static_cast<index_t>(p));
+    return left_iterator(this, p);
+  }
+
+  template <typename Side>
+  iterator<Side> erase(iterator<Side> it) {
+    if (it.pos == size()) {
+      return it;
+    }
+    return erase<Side>(it, std::next(it));
+  }
+
+  // compacts both sides in one O(n) pass
+  template <typename Side>
+  iterator<Side> erase(iterator<Side> first, iterator<Side> last) {
+    std::size_t const f = first.pos;
+    std::size_t const l = last.pos;
+    if (f == l) {
+      return first;
+    }
+    auto& s = side<Side>();
+    auto& o = side<Other<Side>>();
+    std::size_t const n = size();
+    std::size_t const gone = l - f;
+
+    // new positions on the other side, the erased ones are marked with n
+    std::vector<index_t> remap(n, 0);
+    for (std::size_t i = f; i < l; ++i) {
+      remap[s.other[i]] = static_cast<index_t>(n);
+    }
+    std::size_t kept = 0;
+    for (std::size_t j = 0; j < n; ++j) {
+      if (remap[j] != n) {
+        remap[j] = static_cast<index_t>(kept);
+        if (kept != j) {
+          o.keys[kept] = std::move(o.keys[j]);
+          o.other[kept] = o.other[j];
+        }
+        ++kept;
+      }
+    }
+    o.keys.erase(o.keys.begin() + static_cast<std::ptrdiff_t>(kept), o.keys.end());
+    o.other.resize(kept);
+    for (auto& i : o.other) {
+      i -= (i >= l) ? static_cast<index_t>(gone) : 0;
+    }
+
+    s.keys.erase(s.keys.begin() + static_cast<std::ptrdiff_t>(f),
+                 s.keys.begin() + static_cast<std::ptrdiff_t>(l));
+    s.other.erase(s.other.begin() + static_cast<std::ptrdiff_t>(f),
+                  s.other.begin() + static_cast<std::ptrdiff_t>(l));
+    for (auto& i : s.other) {
+      i = remap[i];
+    }
+    return iterator<Side>(this, f);
+  }
+
+  template <typename Side>
+  bool erase_key(key_t<Side> const& key) {
+    std::size_t pos = find_pos<Side>(key);
+    if (pos == size()) {
+      return false;
+    }
+    erase<Side>(iterator<Side>(this, pos));
+    return true;
+  }
+
+  template <typename Side,
+      typename = std::enable_if_t<
+          std::is_default_constructible_v<key_t<Other<Side>>>>>
+  key_t<Other<Side>> const& at_or_default(key_t<Side> const& key) {
+    std::size_t pos = lower_bound_pos<Side>(key);
+    if (pos != size() && !side<Side>().comparator()(key, side<Side>().keys[pos])) {
+      return *iterator<Side>(this, pos).flip();
+    }
+
+    // the pair holding the default other key is re-keyed to key
+    key_t<Other<Side>> other = key_t<Other<Side>>();
+    std::size_t other_pos = find_pos<Other<Side>>(other);
+    if (other_pos != size()) {
+      erase<Other<Side>>(iterator<Other<Side>>(this, other_pos));
+      pos = lower_bound_pos<Side>(key);
+    }
+    std::size_t q = lower_bound_pos<Other<Side>>(other);
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return *insert_at(pos, q, key, std::move(other)).flip();
+    } else {
+      return *insert_at(q, pos, std::move(other), key);
+    }
+  }
+
+  void clear() noexcept {
+    left_side.keys.clear();
+    left_side.other.clear();
+    right_side.keys.clear();
+    right_side.other.clear();
+  }
+};
+
+// storage engines behind the bimap interface
+struct tree_storage;
+struct flat_storage;
+
+template <typename Storage, typename Left, typename Right,
+          typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>,
+          typename Allocator = std::allocator<std::pair<Left, Right>>>
+using basic_bimap = std::conditional_t<
+    std::is_same_v<Storage, flat_storage>,
+    flat_bimap<Left, Right, CompareLeft, CompareRight, Allocator>,
+    bimap<Left, Right, CompareLeft, CompareRight, Allocator>>;
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Search kernels over sorted arrays. For 32- and 64-bit integral keys
+// ordered by std::less the range is narrowed by a branchless binary search
+// down to one cache line, whose keys are then counted with vector compares.
+// Other keys and comparators go through std::lower_bound/upper_bound.
+namespace flat_search {
+
+template <typename T, typename K, typename Compare>
+constexpr bool is_vectorizable() {
+  return std::is_integral_v<T> && !std::is_same_v<T, bool> &&
+         (sizeof(T) == 4 || sizeof(T) == 8) &&
+         std::is_same_v<std::decay_t<K>, T> &&
+         (std::is_same_v<Compare, std::less<T>> ||
+          std::is_same_v<Compare, std::less<>>);
+}
+
+namespace detail {
+
+// unsigned keys are compared as signed after flipping the sign bit
+template <typename T>
+auto to_signed(T x) {
+  using U = std::make_unsigned_t<T>;
+  using S = std::make_signed_t<T>;
+  constexpr U bias = std::is_signed_v<T> ? U(0) : U(U(1) << (8 * sizeof(T) - 1));
+  return static_cast<S>(static_cast<U>(x) ^ bias);
+}
+
+// number of keys in p[0..n) less than key, or not greater when Upper
+template <bool Upper, typename T>
+std::size_t count(T const* p, std::size_t n, T key) {
+  std::size_t i = 0;
+  std::size_t result = 0;
+  auto const k = to_signed(key);
+  (void)k;
+  if constexpr (sizeof(T) == 4) {
+#if defined(__AVX2__)
+    __m256i vk = _mm256_set1_epi32(k);
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 8 <= n; i += 8) {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p + i));
+      if constexpr (!std::is_signed_v<T>) {
+        v = _mm256_xor_si256(v, _mm256_set1_epi32(INT32_MIN));
+      }
+      acc = _mm256_sub_epi32(acc, Upper ? _mm256_cmpgt_epi32(v, vk)
+                                        : _mm256_cmpgt_epi32(vk, v));
+    }
+    alignas(32) std::int32_t lanes[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    for (std::int32_t c : lanes) {
+      result += static_cast<std::size_t>(c);
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128i vk = _mm_set1_epi32(k);
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + i));
+      if constexpr (!std::is_signed_v<T>) {
+        v = _mm_xor_si128(v, _mm_set1_epi32(INT32_MIN));
+      }
+      acc = _mm_sub_epi32(acc, Upper ? _mm_cmpgt_epi32(v, vk)
+                                     : _mm_cmpgt_epi32(vk, v));
+    }
+    alignas(16) std::int32_t lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    for (std::int32_t c : lanes) {
+      result += static_cast<std::size_t>(c);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    int32x4_t vk = vdupq_n_s32(k);
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 4 <= n; i += 4) {
+      int32x4_t v = vreinterpretq_s32_u32(
+          veorq_u32(vld1q_u32(reinterpret_cast<std::uint32_t const*>(p + i)),
+                    vdupq_n_u32(std::is_signed_v<T> ? 0u : 0x80000000u)));
+      acc = vsubq_u32(acc, Upper ? vcgtq_s32(v, vk) : vcgtq_s32(vk, v));
+    }
+    result = vaddvq_u32(acc);
+#endif
+  } else {
+#if defined(__AVX2__)
+    __m256i vk = _mm256_set1_epi64x(k);
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 4 <= n; i += 4) {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p + i));
+      if constexpr (!std::is_signed_v<T>) {
+        v = _mm256_xor_si256(v, _mm256_set1_epi64x(INT64_MIN));
+      }
+      acc = _mm256_sub_epi64(acc, Upper ? _mm256_cmpgt_epi64(v, vk)
+                                        : _mm256_cmpgt_epi64(vk, v));
+    }
+    alignas(32) std::int64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    for (std::int64_t c : lanes) {
+      result += static_cast<std::size_t>(c);
+    }
+#elif defined(__SSE4_2__)
+    __m128i vk = _mm_set1_epi64x(k);
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 2 <= n; i += 2) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + i));
+      if constexpr (!std::is_signed_v<T>) {
+        v = _mm_xor_si128(v, _mm_set1_epi64x(INT64_MIN));
+      }
+      acc = _mm_sub_epi64(acc, Upper ? _mm_cmpgt_epi64(v, vk)
+                                     : _mm_cmpgt_epi64(vk, v));
+    }
+    alignas(16) std::int64_t lanes[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    for (std::int64_t c : lanes) {
+      result += static_cast<std::size_t>(c);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    int64x2_t vk = vdupq_n_s64(k);
+    uint64x2_t acc = vdupq_n_u64(0);
+    for (; i + 2 <= n; i += 2) {
+      int64x2_t v = vreinterpretq_s64_u64(
+          veorq_u64(vld1q_u64(reinterpret_cast<std::uint64_t const*>(p + i)),
+                    vdupq_n_u64(std::is_signed_v<T> ? 0u : 0x8000000000000000u)));
+      acc = vsubq_u64(acc, Upper ? vcgtq_s64(v, vk) : vcgtq_s64(vk, v));
+    }
+    result = static_cast<std::size_t>(vaddvq_u64(acc));
+#endif
+  }
+  if constexpr (Upper) {
+    result = i - result; // the vector loops count the greater keys
+  }
+  for (; i < n; ++i) {
+    result += Upper ? !(key < p[i]) : (p[i] < key);
+  }
+  return result;
+}
+
+// narrows [p, p + n) to at most one cache line holding the bound
+template <bool Upper, typename T>
+std::size_t bound(T const* p, std::size_t n, T key) {
+  constexpr std::size_t window = 64 / sizeof(T);
+  T const* base = p;
+  while (n > window) {
+    std::size_t half = n / 2;
+    bool right = Upper ? !(key < base[half - 1]) : (base[half - 1] < key);
+    base = right ? base + half : base;
+    n -= half;
+  }
+  return static_cast<std::size_t>(base - p) + count<Upper>(base, n, key);
+}
+
+} // namespace detail
+
+// first key in the contiguous range [first, last) not less than key
+template <typename It, typename K, typename Compare>
+It lower_bound(It first, It last, K const& key, Compare const& cmp) {
+  using T = typename std::iterator_traits<It>::value_type;
+  if constexpr (is_vectorizable<T, K, Compare>()) {
+    auto n = static_cast<std::size_t>(last - first);
+    return first + static_cast<std::ptrdiff_t>(
+        first == last ? 0 : detail::bound<false>(&*first, n, static_cast<T>(key)));
+  } else {
+    return std::lower_bound(first, last, key, cmp);
+  }
+}
+
+// first key in the contiguous range [first, last) greater than key
+template <typename It, typename K, typename Compare>
+It upper_bound(It first, It last, K const& key, Compare const& cmp) {
+  using T = typename std::iterator_traits<It>::value_type;
+  if constexpr (is_vectorizable<T, K, Compare>()) {
+    auto n = static_cast<std::size_t>(last - first);
+    return first + static_cast<std::ptrdiff_t>(
+        first == last ? 0 : detail::bound<true>(&*first, n, static_cast<T>(key)));
+  } else {
+    return std::upper_bound(first, last, key, cmp);
+  }
+}
+
+} // namespace flat_search
@@ -0,0 +1,7 @@
+#include "fork_join.h"
+
+unsigned fork_join::threads(unsigned requested, std::size_t n) noexcept {
+  std::size_t t = requested != 0 ? requested : std::thread::hardware_concurrency();
+  t = std::min(t, n / grain + 1);
+  return t == 0 ? 1u : static_cast<unsigned>(t);
+}
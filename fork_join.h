@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Fork-join helpers on plain std::thread for the parallel bulk builds:
+// one new thread per fork, no pool and no work stealing. Work is always
+// cut in equal parts, so a static split keeps the threads busy; when no
+// thread can be started the work runs on the calling one.
+namespace fork_join {
+
+// pieces of work smaller than this are not worth a thread
+inline constexpr std::size_t grain = std::size_t(1) << 14;
+
+// threads to use for n items: requested, or the hardware concurrency when
+// requested is 0, at most one per grain and at least one
+unsigned threads(unsigned requested, std::size_t n) noexcept;
+
+// runs a() on another thread and b() on this one; rethrows an exception
+// of either once both have finished, that of a first. If no thread can be
+// started, a() runs here before b(), so this throws only what they throw.
+template <typename A, typename B>
+void both(A&& a, B&& b) noexcept(std::is_nothrow_invocable_v<A&> &&
+                                 std::is_nothrow_invocable_v<B&>) {
+  std::exception_ptr a_error;
+  auto run_a = [&a, &a_error] {
+    try {
+      a();
+    } catch (...) {
+      a_error = std::current_exception();
+    }
+  };
+  std::thread t;
+  try {
+    t = std::thread(run_a);
+  } catch (...) {
+    run_a();
+  }
+  std::exception_ptr b_error;
+  try {
+    b();
+  } catch (...) {
+    b_error = std::current_exception();
+  }
+  if (t.joinable()) {
+    t.join();
+  }
+  if (a_error) {
+    std::rethrow_exception(a_error);
+  }
+  if (b_error) {
+    std::rethrow_exception(b_error);
+  }
+}
+
+// runs f(i) for every i in [0, n), each on its own thread but the last
+// which runs on this one; rethrows the first exception once all finished
+template <typename F>
+void for_each_index(std::size_t n, F const& f) {
+  if (n <= 1) {
+    if (n == 1) {
+      f(std::size_t(0));
+    }
+    return;
+  }
+  std::vector<std::exception_ptr> errors(n);
+  std::vector<std::thread> workers;
+  workers.reserve(n - 1);
+  auto run = [&f, &errors](std::size_t i) {
+    try {
+      f(i);
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  };
+  std::size_t i = 0;
+  for (; i + 1 < n; ++i) {
+    try {
+      workers.emplace_back(run, i);
+    } catch (...) {
+      break;
+    }
+  }
+  for (; i < n; ++i) {
+    run(i);
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  for (auto& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+// [first, last) of random access iterators is sorted in stable order by
+// stable sorting one part per thread, then merging the parts pairwise
+template <typename It, typename Compare>
+void stable_sort(It first, It last, Compare cmp, unsigned threads) {
+  auto const n = static_cast<std::size_t>(last - first);
+  if (threads <= 1) {
+    std::stable_sort(first, last, cmp);
+    return;
+  }
+  std::vector<It> bounds(threads + 1);
+  for (unsigned i = 0; i <= threads; ++i) {
+    bounds[i] = first + static_cast<std::ptrdiff_t>(n * i / threads);
+  }
+  for_each_index(threads, [&](std::size_t i) {
+    std::stable_sort(bounds[i], bounds[i + 1], cmp);
+  });
+  // merge neighbours until one part is left, half as many threads a round
+  for (std::size_t width = 1; width < threads; width *= 2) {
+    std::size_t const merges = (threads + 2 * width - 1) / (2 * width);
+    for_each_index(merges, [&](std::size_t i) {
+      std::size_t const lo = 2 * width * i;
+      std::size_t const mid = std::min<std::size_t>(lo + width, threads);
+      std::size_t const hi = std::min<std::size_t>(lo + 2 * width, threads);
+      if (mid < hi) {
+        std::inplace_merge(bounds[lo], bounds[mid], bounds[hi], cmp);
+      }
+    });
+  }
+}
+
+} // namespace fork_join
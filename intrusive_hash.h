@@ -0,0 +1,278 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Hook for intr_hash_table: the next element of the bucket chain and the
+// cached hash of the element's key, so rehashing never calls the hash.
+struct base_hash_element {
+    template <typename T, typename Key, typename Tag, typename Hash, typename Equal,
+              typename Allocator>
+    friend struct intr_hash_table;
+
+    base_hash_element() noexcept = default;
+
+    base_hash_element(base_hash_element const&) = delete;
+    base_hash_element& operator=(base_hash_element const&) = delete;
+
+   private:
+    base_hash_element* next{nullptr};
+    std::size_t hash{0};
+};
+
+template <typename Tag>
+struct hash_element : base_hash_element {};
+
+// Intrusive chained hash table of unique keys. Bucket count is a power of
+// two, the bucket of a hash is taken from the high bits of its Fibonacci
+// product so that weak hashes (std::hash of integers) still spread. The
+// table owns only the bucket array; elements are linked and unlinked
+// explicitly and must outlive their membership.
+template <typename Elt, typename Tag, typename Key, typename Hash, typename Equal,
+          typename Allocator = std::allocator<Elt>>
+struct intr_hash_table : Hash, Equal {
+private:
+  using untagged = base_hash_element;
+  using tagged = hash_element<Tag>;
+  using bucket_allocator =
+      typename std::allocator_traits<Allocator>::template rebind_alloc<untagged*>;
+
+  static constexpr std::size_t min_buckets = 8;
+
+public:
+  struct iterator {
+    friend intr_hash_table;
+    using iterator_category = std::forward_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = Elt;
+    using pointer = Elt*;
+    using reference = Elt&;
+
+    iterator() = default;
+
+    reference operator*() const {
+      return static_cast<Elt&>(static_cast<tagged&>(*ptr));
+    }
+    pointer operator->() const {
+      return &**this;
+    }
+
+    iterator& operator++() {
+      if (ptr->next != nullptr) {
+        ptr = ptr->next;
+      } else {
+        ptr = table->first_from(table->bucket_of(ptr->hash) + 1);
+      }
+      return *this;
+    }
+    iterator operator++(int) {
+      iterator tmp(*this);
+      ++*this;
+      return tmp;
+    }
+
+    friend bool operator==(iterator const& a, iterator const& b) {
+      return a.ptr == b.ptr;
+    }
+    friend bool operator!=(iterator const& a, iterator const& b) {
+      return a.ptr != b.ptr;
+    }
+
+  private:
+    untagged* ptr{nullptr};
+    intr_hash_table const* table{nullptr};
+
+    iterator(untagged* ptr, intr_hash_table const* table) : ptr(ptr), table(table) {}
+  };
+
+  explicit intr_hash_table(Hash const& hash = Hash(), Equal const& equal = Equal(),
+                           Allocator const& alloc = Allocator())
+      : Hash(hash), Equal(equal), buckets(bucket_allocator(alloc)) {}
+
+  // takes over the elements, other is left empty
+  intr_hash_table(intr_hash_table&& other) noexcept
+      : Hash(std::move(other)), Equal(std::move(other)),
+        buckets(std::move(other.buckets)),
+        shift(std::exchange(other.shift, 64)),
+        count(std::exchange(other.count, 0)) {
+    other.buckets.clear();
+  }
+
+  intr_hash_table& operator=(intr_hash_table&& other) noexcept {
+    if (this != &other) {
+      Hash::operator=(std::move(other));
+      Equal::operator=(std::move(other));
+      buckets = std::move(other.buckets);
+      other.buckets.clear();
+      shift = std::exchange(other.shift, 64);
+      count = std::exchange(other.count, 0);
+    }
+    return *this;
+  }
+
+  void swap(intr_hash_table& other) noexcept {
+    using std::swap;
+    swap(static_cast<Hash&>(*this), static_cast<Hash&>(other));
+    swap(static_cast<Equal&>(*this), static_cast<Equal&>(other));
+    buckets.swap(other.buckets);
+    swap(shift, other.shift);
+    swap(count, other.count);
+  }
+
+  Hash const& hash_function() const {
+    return *this;
+  }
+
+  Equal const& key_eq() const {
+    return *this;
+  }
+
+  template <typename K>
+  std::size_t hash_of(K const& key) const {
+    return Hash::operator()(key);
+  }
+
+  iterator find(Key const& key) const {
+    return find(key, hash_of(key));
+  }
+
+  iterator find(Key const& key, std::size_t hash) const {
+    if (buckets.empty()) {
+      return end();
+    }
+    for (untagged* p = buckets[bucket_of(hash)]; p != nullptr; p = p->next) {
+      if (p->hash == hash && Equal::operator()(get_key(p), key)) {
+        return iterator(p, this);
+      }
+    }
+    return end();
+  }
+
+  // makes room for n elements, so that linking them cannot throw
+  void reserve(std::size_t n) {
+    if (n > buckets.size()) {
+      std::size_t target = std::max(buckets.size(), min_buckets);
+      while (target < n) {
+        target *= 2;
+      }
+      rehash(target);
+    }
+  }
+
+  // the key of elt must hash to hash and be absent; needs room reserved
+  iterator link(Elt& elt, std::size_t hash) noexcept {
+    untagged* p = &static_cast<tagged&>(elt);
+    p->hash = hash;
+    untagged*& head = buckets[bucket_of(hash)];
+    p->next = head;
+    head = p;
+    ++count;
+    return iterator(p, this);
+  }
+
+  void unlink(Elt const& elt) noexcept {
+    untagged const* p = &static_cast<tagged const&>(elt);
+    untagged** link = &buckets[bucket_of(p->hash)];
+    while (*link != p) {
+      link = &(*link)->next;
+    }
+    *link = p->next;
+    --count;
+  }
+
+  static std::size_t cached_hash(Elt const& elt) noexcept {
+    return static_cast<tagged const&>(elt).hash;
+  }
+
+  static iterator as_iterator(Elt const& elt, intr_hash_table const& table) noexcept {
+    return iterator(&static_cast<tagged&>(const_cast<Elt&>(elt)), &table);
+  }
+
+  // forgets all elements without touching them
+  void release() noexcept {
+    std::fill(buckets.begin(), buckets.end(), nullptr);
+    count = 0;
+  }
+
+  // calls dispose on every element, which may destroy it
+  template <typename Disposer>
+  void clear_and_dispose(Disposer dispose) noexcept {
+    for (auto& head : buckets) {
+      untagged* p = head;
+      head = nullptr;
+      while (p != nullptr) {
+        untagged* next = p->next;
+        dispose(&static_cast<Elt&>(static_cast<tagged&>(*p)));
+        p = next;
+      }
+    }
+    count = 0;
+  }
+
+  std::size_t size() const noexcept {
+    return count;
+  }
+
+  bool empty() const noexcept {
+    return count == 0;
+  }
+
+  std::size_t bucket_count() const noexcept {
+    return buckets.size();
+  }
+
+  iterator begin() const {
+    return iterator(first_from(0), this);
+  }
+
+  iterator end() const {
+    return iterator(nullptr, this);
+  }
+
+private:
+  std::vector<untagged*, bucket_allocator> buckets;
+  unsigned shift{64}; // 64 - log2(bucket count)
+  std::size_t count{0};
+
+  std::size_t bucket_of(std::size_t hash) const noexcept {
+    return static_cast<std::size_t>(
+        (static_cast<std::uint64_t>(hash) * 0x9E3779B97F4A7C15ull) >> shift);
+  }
+
+  untagged* first_from(std::size_t bucket) const noexcept {
+    for (; bucket < buckets.size(); ++bucket) {
+      if (buckets[bucket] != nullptr) {
+        return buckets[bucket];
+      }
+    }
+    return nullptr;
+  }
+
+  void rehash(std::size_t n) {
+    std::vector<untagged*, bucket_allocator> old(n, nullptr, buckets.get_allocator());
+    old.swap(buckets);
+    shift = 64;
+    for (std::size_t b = n; b > 1; b /= 2) {
+      --shift;
+    }
+    for (untagged* head : old) {
+      while (head != nullptr) {
+        untagged* next = head->next;
+        untagged*& bucket = buckets[bucket_of(head->hash)];
+        head->next = bucket;
+        bucket = head;
+        head = next;
+      }
+    }
+  }
+
+  Key const& get_key(untagged const* node) const {
+    return static_cast<Elt const*>(static_cast<tagged const*>(node))->template key<Tag>();
+  }
+};
@@ -12,15 +12,16 @@ base_tree_element& base_tree_element::operator=(base_tree_element&& other) noexc
   return *this;
 }
 
-// only for sentinel
+// only for sentinel, whose right is the first element and not a child
 void base_tree_element::move_from(base_tree_element& other) noexcept {
   link_left(this, other.left);
-  link_right(this, other.right);
-  other.left = other.right = other.parent = nullptr;
+  right = other.right;
+  other.left = other.right = nullptr;
+  other.set_parent(nullptr);
 }
 
 bool base_tree_element::in_tree() const noexcept {
-  return !(parent == nullptr && left == nullptr && right == nullptr);
+  return !(parent() == nullptr && left == nullptr && right == nullptr);
 }
 
 base_tree_element::~base_tree_element() {
@@ -31,7 +32,7 @@ void base_tree_element::link_left(base_tree_element* parent, base_tree_element*
   if (parent) {
     parent->left = left;
     if (left) {
-      left->parent = parent;
+      left->set_parent(parent);
     }
   }
 }
@@ -40,7 +41,7 @@ void base_tree_element::link_right(base_tree_element* parent, base_tree_element*
   if (parent) {
     parent->right = right;
     if (right) {
-      right->parent = parent;
+      right->set_parent(parent);
     }
   }
 }
@@ -60,13 +61,16 @@ base_tree_element* base_tree_element::min_in_subtree(base_tree_element* p) {
 }
 
 base_tree_element* base_tree_element::prev(base_tree_element* p) {
+  if (p->parent() == nullptr) {
+    return static_cast<sentinel*>(p)->last;
+  }
   if (p->left) {
     return max_in_subtree(p->left);
   } else {
     while (p->is_left_child()) {
-      p = p->parent;
+      p = p->parent();
     }
-    p = p->parent;
+    p = p->parent();
   }
 
   return p;
@@ -77,9 +81,9 @@ base_tree_element* base_tree_element::next(base_tree_element* p) {
     return min_in_subtree(p->right);
   } else {
     while (!p->is_left_child()) {
-      p = p->parent;
+      p = p->parent();
     }
-    p = p->parent;
+    p = p->parent();
   }
 
   return p;
@@ -95,7 +99,7 @@ bool base_tree_element::has_one_child() const noexcept {
 }
 
 bool base_tree_element::is_left_child() const noexcept {
-  return parent->left == this;
+  return parent()->left == this;
 }
 
 base_tree_element* base_tree_element::get_only_child() noexcept {
@@ -104,26 +108,408 @@ base_tree_element* base_tree_element::get_only_child() noexcept {
 
 void base_tree_element::link_with_parent(base_tree_element* node) noexcept {
   if (is_left_child()) {
-    link_left(parent, node);
+    link_left(parent(), node);
   } else {
-    link_right(parent, node);
+    link_right(parent(), node);
+  }
+}
+
+bool base_tree_element::is_red(base_tree_element const* p) noexcept {
+  return p != nullptr && p->red();
+}
+
+void base_tree_element::update_path(base_tree_element* p, update_fn update) noexcept {
+  if (update) {
+    for (; p->parent() != nullptr; p = p->parent()) {
+      update(p);
+    }
+  }
+}
+
+void base_tree_element::rotate_left(base_tree_element* x, update_fn update) noexcept {
+  auto* y = x->right;
+  link_right(x, y->left);
+  x->link_with_parent(y);
+  link_left(y, x);
+  if (update) {
+    update(x);
+    update(y);
+  }
+}
+
+void base_tree_element::rotate_right(base_tree_element* x, update_fn update) noexcept {
+  auto* y = x->left;
+  link_left(x, y->right);
+  x->link_with_parent(y);
+  link_right(y, x);
+  if (update) {
+    update(x);
+    update(y);
+  }
+}
+
+// x is a freshly linked leaf
+unsigned base_tree_element::balance_after_insert(base_tree_element* x,
+                                                 update_fn update) noexcept {
+  update_path(x, update);
+  x->set_red(true);
+  bool grown = false;
+  return fix_double_red(x, update, grown);
+}
+
+unsigned base_tree_element::fix_double_red(base_tree_element* x, update_fn update,
+                                           bool& grown) noexcept {
+  unsigned rotations = 0;
+  // parent of a red node is never the sentinel, so grandparent exists
+  while (is_red(x->parent())) {
+    auto* p = x->parent();
+    auto* g = p->parent();
+    if (p->is_left_child()) {
+      auto* uncle = g->right;
+      if (is_red(uncle)) {
+        p->set_red(false);
+        uncle->set_red(false);
+        g->set_red(true);
+        x = g;
+      } else {
+        if (!x->is_left_child()) {
+          rotate_left(p, update);
+          ++rotations;
+          p = x;
+        }
+        p->set_red(false);
+        g->set_red(true);
+        rotate_right(g, update);
+        ++rotations;
+        break;
+      }
+    } else {
+      auto* uncle = g->left;
+      if (is_red(uncle)) {
+        p->set_red(false);
+        uncle->set_red(false);
+        g->set_red(true);
+        x = g;
+      } else {
+        if (x->is_left_child()) {
+          rotate_right(p, update);
+          ++rotations;
+          p = x;
+        }
+        p->set_red(false);
+        g->set_red(true);
+        rotate_left(g, update);
+        ++rotations;
+        break;
+      }
+    }
+  }
+
+  // root is the left child of the sentinel
+  if (x->parent()->parent() == nullptr) {
+    grown = x->red();
+    x->set_red(false);
+  }
+  return rotations;
+}
+
+// x (possibly null) took the place of a removed black node and is short of
+// one black on its paths
+unsigned base_tree_element::balance_after_erase(base_tree_element* x,
+                                                base_tree_element* x_parent,
+                                                update_fn update) noexcept {
+  unsigned rotations = 0;
+  while (x_parent->parent() != nullptr && !is_red(x)) {
+    if (x == x_parent->left) {
+      auto* w = x_parent->right;
+      if (w->red()) {
+        w->set_red(false);
+        x_parent->set_red(true);
+        rotate_left(x_parent, update);
+        ++rotations;
+        w = x_parent->right;
+      }
+      if (!is_red(w->left) && !is_red(w->right)) {
+        w->set_red(true);
+        x = x_parent;
+        x_parent = x_parent->parent();
+      } else {
+        if (!is_red(w->right)) {
+          w->left->set_red(false);
+          w->set_red(true);
+          rotate_right(w, update);
+          ++rotations;
+          w = x_parent->right;
+        }
+        w->set_red(x_parent->red());
+        x_parent->set_red(false);
+        w->right->set_red(false);
+        rotate_left(x_parent, update);
+        ++rotations;
+        return rotations;
+      }
+    } else {
+      auto* w = x_parent->left;
+      if (w->red()) {
+        w->set_red(false);
+        x_parent->set_red(true);
+        rotate_right(x_parent, update);
+        ++rotations;
+        w = x_parent->left;
+      }
+      if (!is_red(w->left) && !is_red(w->right)) {
+        w->set_red(true);
+        x = x_parent;
+        x_parent = x_parent->parent();
+      } else {
+        if (!is_red(w->left)) {
+          w->right->set_red(false);
+          w->set_red(true);
+          rotate_left(w, update);
+          ++rotations;
+          w = x_parent->left;
+        }
+        w->set_red(x_parent->red());
+        x_parent->set_red(false);
+        w->left->set_red(false);
+        rotate_right(x_parent, update);
+        ++rotations;
+        return rotations;
+      }
+    }
   }
+
+  if (x) {
+    x->set_red(false);
+  }
+  return rotations;
 }
 
-void base_tree_element::unlink() noexcept {
-  if (!in_tree()) {
-    return;
+unsigned base_tree_element::unlink(update_fn update) noexcept {
+  if (!in_tree() || parent() == nullptr) {
+    return 0;
   }
 
+  // the sentinel keeps the first element as its right and the last one: only
+  // a node missing a child on that side can be one of them, and each walk
+  // up stops at the first child of the other side, after two steps on
+  // average
+  if (left == nullptr) {
+    base_tree_element* p = this;
+    while (p->parent()->parent() != nullptr && p->is_left_child()) {
+      p = p->parent();
+    }
+    base_tree_element* s = p->parent();
+    if (s->parent() == nullptr) {
+      // without a left child the next element is the right leaf or the parent
+      s->right = right != nullptr ? right : parent() != s ? parent() : nullptr;
+    }
+  }
+  if (right == nullptr) {
+    base_tree_element* p = this;
+    while (p->parent()->parent() != nullptr && !p->is_left_child()) {
+      p = p->parent();
+    }
+    base_tree_element* s = p->parent();
+    if (s->parent() == nullptr) {
+      static_cast<sentinel*>(s)->last = left != nullptr ? left
+                                        : parent() != s ? parent()
+                                                        : nullptr;
+    }
+  }
+
+  base_tree_element* x;
+  base_tree_element* x_parent;
+  bool removed_black;
+
   if (is_leaf() || has_one_child()) {
-    link_with_parent(get_only_child());
+    x = get_only_child();
+    x_parent = parent();
+    removed_black = !red();
+    link_with_parent(x);
   } else {
-    auto* n = next(this);
-    n->unlink();
-    link_left(n, left);
-    link_right(n, right);
+    // successor takes this node's place and color
+    auto* n = min_in_subtree(right);
+    x = n->right;
+    removed_black = !n->red();
+    if (n->parent() == this) {
+      x_parent = n;
+    } else {
+      x_parent = n->parent();
+      link_left(n->parent(), x);
+      link_right(n, right);
+    }
     link_with_parent(n);
+    link_left(n, left);
+    n->set_red(red());
+  }
+
+  left = right = nullptr;
+  set_parent(nullptr);
+  set_red(false);
+
+  update_path(x_parent, update);
+  if (removed_black) {
+    return balance_after_erase(x, x_parent, update);
+  }
+  return 0;
+}
+
+std::size_t base_tree_element::height(base_tree_element const* root) noexcept {
+  // walks down and up through parent links, without a stack
+  std::size_t result = 0;
+  std::size_t depth = 0;
+  base_tree_element const* p = root;
+  base_tree_element const* from = root != nullptr ? root->parent() : nullptr;
+  while (p != nullptr) {
+    if (from == p->parent()) {
+      ++depth;
+      result = depth > result ? depth : result;
+      if (p->left != nullptr) {
+        from = p;
+        p = p->left;
+        continue;
+      }
+      from = p->left;
+    }
+    if (from == p->left && p->right != nullptr) {
+      from = p;
+      p = p->right;
+      continue;
+    }
+    if (p == root) {
+      break;
+    }
+    from = p;
+    p = p->parent();
+    --depth;
+  }
+  return result;
+}
+
+std::size_t base_tree_element::black_height(base_tree_element const* root) noexcept {
+  std::size_t result = 0;
+  for (auto const* p = root; p != nullptr; p = p->left) {
+    result += !p->red();
+  }
+  return result;
+}
+
+bool base_tree_element::is_valid(base_tree_element const* root) noexcept {
+  if (root == nullptr) {
+    return true;
+  }
+  if (root->red()) {
+    return false;
+  }
+  std::size_t const expected = black_height(root);
+  base_tree_element const* const above = root->parent();
+  for (auto* p = min_in_subtree(const_cast<base_tree_element*>(root)); p != above; p = next(p)) {
+    for (base_tree_element const* child : {p->left, p->right}) {
+      if (child != nullptr && (child->parent() != p || (p->red() && child->red()))) {
+        return false;
+      }
+    }
+    if (p->left == nullptr || p->right == nullptr) {
+      // a path ends below p, it must hold as many black nodes as the others
+      std::size_t blacks = 0;
+      for (base_tree_element const* q = p; q != above; q = q->parent()) {
+        blacks += !q->red();
+      }
+      if (blacks != expected) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void base_tree_element::make_root_black(detached_tree& t) noexcept {
+  if (t.root != nullptr && t.root->red()) {
+    t.root->set_red(false);
+    ++t.black_height;
+  }
+}
+
+base_tree_element::detached_tree base_tree_element::join(detached_tree a,
+                                                         base_tree_element* mid,
+                                                         detached_tree b,
+                                                         update_fn update) noexcept {
+  make_root_black(a);
+  make_root_black(b);
+  if (a.black_height == b.black_height) {
+    link_left(mid, a.root);
+    link_right(mid, b.root);
+    mid->set_red(false);
+    if (update) {
+      update(mid);
+    }
+    return {mid, a.black_height + 1};
+  }
+
+  // mid goes red on the inner spine of the taller tree, above the first
+  // black node as black-high as the other tree; a local sentinel lets the
+  // insertion fixup run unchanged
+  bool const left_taller = a.black_height > b.black_height;
+  detached_tree const& tall = left_taller ? a : b;
+  std::size_t const low = left_taller ? b.black_height : a.black_height;
+  base_tree_element sentinel;
+  link_left(&sentinel, tall.root);
 
-    left = right = parent = nullptr;
+  base_tree_element* p = nullptr;
+  base_tree_element* c = tall.root;
+  std::size_t h = tall.black_height;
+  while (c != nullptr && (c->red() || h > low)) {
+    h -= !c->red();
+    p = c;
+    c = left_taller ? c->right : c->left;
+  }
+  if (left_taller) {
+    link_left(mid, c);
+    link_right(mid, b.root);
+    link_right(p, mid);
+  } else {
+    link_left(mid, a.root);
+    link_right(mid, c);
+    link_left(p, mid);
+  }
+  update_path(mid, update);
+  mid->set_red(true);
+  bool grown = false;
+  fix_double_red(mid, update, grown);
+
+  detached_tree result{sentinel.left, tall.black_height + grown};
+  sentinel.left = nullptr;
+  return result;
+}
+
+base_tree_element::split_result base_tree_element::split(base_tree_element* pos,
+                                                         update_fn update) noexcept {
+  // both children of a node are equally black-high
+  std::size_t h = black_height(pos->left);
+  split_result result{{pos->left, h}, {pos->right, h}};
+  h += !pos->red();
+
+  base_tree_element* parent = pos->parent();
+  bool from_left = pos->is_left_child();
+  result.after = join({nullptr, 0}, pos, result.after, update);
+
+  // each ancestor joins the side the path came from with its other subtree
+  while (parent->parent() != nullptr) {
+    base_tree_element* next = parent->parent();
+    bool const next_from_left = parent->is_left_child();
+    bool const black = !parent->red();
+    if (from_left) {
+      result.after = join(result.after, parent, {parent->right, h}, update);
+    } else {
+      result.before = join({parent->left, h}, parent, result.before, update);
+    }
+    h += black;
+    parent = next;
+    from_left = next_from_left;
   }
+  parent->left = nullptr;
+  make_root_black(result.before);
+  make_root_black(result.after);
+  return result;
 }
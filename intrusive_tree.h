@@ -1,10 +1,23 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <iterator>
+#include <type_traits>
+#include <utility>
+#include "fork_join.h"
+#include "key_prefix.h"
+#include "tree_stats.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define INTR_TREE_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define INTR_TREE_PREFETCH(p) ((void)(p))
+#endif
 
 struct base_tree_element {
-    template <typename T, typename Key, typename Tag, typename Comparator>
+    template <typename T, typename Key, typename Tag, typename Comparator, bool Counted,
+              typename Stats>
     friend struct intr_tree;
 
     base_tree_element() noexcept = default;
@@ -18,22 +31,106 @@ struct base_tree_element {
 
     bool in_tree() const noexcept;
 
-    virtual ~base_tree_element();
+    // not virtual: hooks are never deleted through a base pointer,
+    // and a vptr per hook would double the size of small nodes
+    ~base_tree_element();
 
    private:
     base_tree_element* left{nullptr};
     base_tree_element* right{nullptr};
-    base_tree_element* parent{nullptr};
+    // parent pointer with the color in its lowest bit, always free as
+    // hooks are pointer aligned
+    std::uintptr_t parent_and_color{0};
+
+    base_tree_element* parent() const noexcept {
+      return reinterpret_cast<base_tree_element*>(parent_and_color & ~std::uintptr_t(1));
+    }
+
+    void set_parent(base_tree_element* p) noexcept {
+      parent_and_color = reinterpret_cast<std::uintptr_t>(p) | (parent_and_color & 1);
+    }
+
+    bool red() const noexcept {
+      return parent_and_color & 1;
+    }
+
+    void set_red(bool r) noexcept {
+      parent_and_color = (parent_and_color & ~std::uintptr_t(1)) | std::uintptr_t(r);
+    }
 
     void move_from(base_tree_element& other) noexcept;
 
+    // the sentinel of a tree, see below
+    struct sentinel;
+
     static void link_left(base_tree_element* parent, base_tree_element* left);
 
     static void link_right(base_tree_element* parent, base_tree_element* right);
 
     void link_with_parent(base_tree_element* node) noexcept;
 
-    void unlink() noexcept;
+    // recomputes data an augmented tree keeps in a node from its children,
+    // nullptr for plain trees
+    using update_fn = void (*)(base_tree_element*) noexcept;
+
+    // returns the number of rotations done to rebalance
+    unsigned unlink(update_fn update = nullptr) noexcept;
+
+    // calls update on p and all its ancestors below the sentinel
+    static void update_path(base_tree_element* p, update_fn update) noexcept;
+
+    // red-black rebalancing, the sentinel (parent == nullptr) is never touched
+    static void rotate_left(base_tree_element* x, update_fn update) noexcept;
+
+    static void rotate_right(base_tree_element* x, update_fn update) noexcept;
+
+    // both return the number of rotations done
+    static unsigned balance_after_insert(base_tree_element* x, update_fn update) noexcept;
+
+    static unsigned balance_after_erase(base_tree_element* x,
+                                        base_tree_element* x_parent,
+                                        update_fn update) noexcept;
+
+    // restores the red-black rules above the red node x; grown is set when
+    // the root had to turn black, adding one to the black height
+    static unsigned fix_double_red(base_tree_element* x, update_fn update,
+                                   bool& grown) noexcept;
+
+    // a tree taken off its sentinel with the black height of its root,
+    // 0 when empty; the parent of root is meaningless
+    struct detached_tree {
+        base_tree_element* root;
+        std::size_t black_height;
+    };
+
+    struct split_result {
+        detached_tree before;
+        detached_tree after;
+    };
+
+    static void make_root_black(detached_tree& t) noexcept;
+
+    // all of a, then mid, then all of b as one tree, in
+    // O(|a.black_height - b.black_height| + 1)
+    static detached_tree join(detached_tree a, base_tree_element* mid,
+                              detached_tree b, update_fn update) noexcept;
+
+    // the elements before pos and those from pos on, in O(log n); the
+    // sentinel of pos's tree is left empty
+    static split_result split(base_tree_element* pos, update_fn update) noexcept;
+
+    // number of nodes on the longest path down from root, O(n)
+    static std::size_t height(base_tree_element const* root) noexcept;
+
+    // black nodes on any path down from root, O(log n); the height is
+    // between it and twice it
+    static std::size_t black_height(base_tree_element const* root) noexcept;
+
+    // the red-black rules and the parent links below root, the left child
+    // of its sentinel, O(n log n)
+    static bool is_valid(base_tree_element const* root) noexcept;
+
+    static bool is_red(base_tree_element const* p) noexcept;
 
     static base_tree_element* next(base_tree_element* p);
 
@@ -52,13 +149,59 @@ struct base_tree_element {
     base_tree_element* get_only_child() noexcept;
 };
 
+// left is the root of the tree, right its first element and last its last
+// one, both null when empty; partner is the sentinel of a tree paired by
+// intr_tree::pair_ends, which moves leave alone
+struct base_tree_element::sentinel : base_tree_element {
+    sentinel() noexcept = default;
+
+    sentinel(sentinel&& other) noexcept : base_tree_element(std::move(other)) {
+      last = other.last;
+      other.last = nullptr;
+    }
+
+    sentinel& operator=(sentinel&& other) noexcept {
+      base_tree_element::operator=(std::move(other));
+      last = other.last;
+      other.last = nullptr;
+      return *this;
+    }
+
+    base_tree_element* last{nullptr};
+    base_tree_element* partner{nullptr};
+};
+
+static_assert(alignof(base_tree_element) > 1,
+              "color is stored in the lowest bit of the parent pointer");
+static_assert(sizeof(base_tree_element) == 3 * sizeof(void*));
+
 template <typename Tag>
 struct tree_element : base_tree_element {};
 
-template <typename Elt, typename Tag, typename Key, typename Comparator>
-struct intr_tree : Comparator {
+// hook of trees with order statistics
+template <typename Tag>
+struct counted_tree_element : tree_element<Tag> {
+  template <typename T, typename Key, typename Tg, typename Comparator, bool Counted,
+            typename Stats>
+  friend struct intr_tree;
+
+ private:
+  std::size_t subtree_size{0};
+};
+
+// Counted trees keep subtree sizes in counted_tree_element hooks, giving
+// O(log n) rank and select. Elements of a counted tree must be removed
+// through the tree, not by their hook's destructor.
+//
+// Stats = tree_stats counts comparisons, descent depths and rotations,
+// see stats(); the default no_stats compiles the counting out.
+template <typename Elt, typename Tag, typename Key, typename Comparator,
+          bool Counted = false, typename Stats = no_stats>
+struct intr_tree : Comparator,
+                   stats_holder<Stats, intr_tree<Elt, Tag, Key, Comparator, Counted, Stats>> {
   using untagged = base_tree_element;
-  using tagged = tree_element<Tag>;
+  using tagged = std::conditional_t<Counted, counted_tree_element<Tag>,
+                                    tree_element<Tag>>;
 
   struct iterator {
     friend intr_tree;
@@ -71,6 +214,7 @@ struct intr_tree : Comparator {
 
     iterator() = default;
     iterator(iterator const& other) : ptr(other.ptr) {}
+    iterator& operator=(iterator const& other) = default;
 
     reference operator*() const {
       return *static_cast<pointer>(static_cast<tagged*>(ptr));
@@ -139,73 +283,624 @@ struct intr_tree : Comparator {
   }
 
   bool empty() const {
-    return root.left == nullptr && root.right == nullptr;
+    return root.left == nullptr;
+  }
+
+  // nodes on the longest root-to-leaf path, walking the whole tree in O(n)
+  std::size_t exact_height() const noexcept {
+    return untagged::height(root.left);
+  }
+
+  // black nodes on every root-to-leaf path, O(log n); exact_height() lies
+  // between it and twice it
+  std::size_t black_height() const noexcept {
+    return untagged::black_height(root.left);
+  }
+
+  // upper bound on exact_height(), O(log n): no red node has a red child,
+  // so a path holds at most as many red nodes as black ones
+  std::size_t height() const noexcept {
+    return 2 * black_height();
+  }
+
+  // checks the red-black rules, the parent links, the key order, the
+  // subtree sizes of counted trees, the cached key prefixes and the ends
+  // the sentinel keeps; O(n log n), meant for tests and debugging
+  bool verify() const {
+    if (!untagged::is_valid(root.left)) {
+      return false;
+    }
+    if (root.left == nullptr) {
+      return root.right == nullptr && root.last == nullptr;
+    }
+    if (root.left->parent() != &root ||
+        root.right != untagged::min_in_subtree(root.left) ||
+        root.last != untagged::max_in_subtree(root.left)) {
+      return false;
+    }
+    untagged const* prev = nullptr;
+    for (untagged const* p = untagged::min_in_subtree(root.left); p != &root;
+         p = untagged::next(const_cast<untagged*>(p))) {
+      if (prev != nullptr && !Comparator::operator()(get_key(prev), get_key(p))) {
+        return false;
+      }
+      if constexpr (Counted) {
+        if (subtree_size(p) != subtree_size(p->left) + subtree_size(p->right) + 1) {
+          return false;
+        }
+      }
+      if constexpr (cached_prefix) {
+        if (node_prefix(p) != query_prefix(get_key(p))) {
+          return false;
+        }
+      }
+      prev = p;
+    }
+    return true;
+  }
+
+  template <typename S = Stats, typename = std::enable_if_t<S::enabled>>
+  Stats const& stats() const noexcept {
+    return this->stats_ref();
+  }
+
+  template <typename S = Stats, typename = std::enable_if_t<S::enabled>>
+  void reset_stats() noexcept {
+    this->stats_ref().reset();
   }
 
   static iterator as_iterator(Elt const& elt) noexcept {
     return iterator(&static_cast<tagged&>(const_cast<Elt&>(elt)));
   }
 
+  // pairs the ends of this tree and other, a tree of the same elements on
+  // another hook, so that flip takes end() to end(); a move constructed
+  // tree is not paired, move assignment and swap keep the pairs
+  template <typename Tree>
+  void pair_ends(Tree& other) noexcept {
+    root.partner = &other.root;
+    other.root.partner = &root;
+  }
+
+  // it in Tree, a tree paired by pair_ends, in O(1) without the trees
+  template <typename Tree>
+  static typename Tree::iterator flip(iterator it) noexcept {
+    if (it.ptr->parent() == nullptr) {
+      return Tree::at(static_cast<sentinel const*>(it.ptr)->partner);
+    }
+    return Tree::as_iterator(*it);
+  }
+
   iterator find(Key const& key) const noexcept {
-    untagged* cur = root.left;
-    for (;;) {
-      if (cur == nullptr) {
-        return end();
+    return find_(key);
+  }
+
+  // heterogeneous lookup, only with comparators defining is_transparent
+  template <typename K, typename C = Comparator, typename = typename C::is_transparent>
+  iterator find(K const& key) const noexcept {
+    return find_(key);
+  }
+
+  // looks up every key of the forward range [first, last) and calls visit(iterator) for
+  // each in order; up to batch_width descents advance in lockstep, each
+  // prefetching its next node, so their cache misses overlap. Each lookup
+  // compares and counts like find
+  template <typename KeyIt, typename Visitor>
+  void find_batch(KeyIt first, KeyIt last, Visitor visit) const {
+    static constexpr std::size_t batch_width = 16;
+    KeyIt keys[batch_width];
+    prefix_type prefixes[batch_width];
+    std::size_t depths[batch_width];
+    untagged const* cur[batch_width];
+    untagged const* found[batch_width];
+    while (first != last) {
+      std::size_t n = 0;
+      for (; n < batch_width && first != last; ++n, ++first) {
+        keys[n] = first;
+        prefixes[n] = query_prefix(*first);
+        depths[n] = 0;
+        cur[n] = root.left;
+        found[n] = &root;
+        if (root.left == nullptr) {
+          count_descent(0);
+        }
       }
+      for (std::size_t active = n; active != 0;) {
+        active = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+          untagged const* c = cur[i];
+          if (c == nullptr) {
+            continue;
+          }
+          ++depths[i];
+          if (node_less(c, *keys[i], prefixes[i])) {
+            c = c->right;
+          } else if (key_less(*keys[i], c, prefixes[i])) {
+            c = c->left;
+          } else {
+            found[i] = c;
+            c = nullptr;
+          }
+          if (c != nullptr) {
+            INTR_TREE_PREFETCH(c);
+            INTR_TREE_PREFETCH(&get_key(c));
+            ++active;
+          } else {
+            count_descent(depths[i]);
+          }
+          cur[i] = c;
+        }
+      }
+      for (std::size_t i = 0; i < n; ++i) {
+        visit(iterator(found[i]));
+      }
+    }
+  }
 
-      if (cmp_key(get_key(cur), key)) {
+  // result of a single descent: the element with an equal key,
+  // or the free slot where such a key would be linked
+  struct insert_position {
+    iterator found;
+    untagged* parent;
+    bool left;
+  };
+
+  insert_position find_insert_position(Key const& key) const {
+    untagged* parent = &root;
+    untagged* cur = root.left;
+    bool left = true;
+    std::size_t depth = 0;
+    prefix_type const prefix = query_prefix(key);
+    while (cur != nullptr) {
+      ++depth;
+      if (node_less(cur, key, prefix)) {
+        parent = cur;
         cur = cur->right;
-      } else if (cmp_key(key, get_key(cur))) {
+        left = false;
+      } else if (key_less(key, cur, prefix)) {
+        parent = cur;
         cur = cur->left;
+        left = true;
       } else {
-        return iterator(cur);
+        count_descent(depth);
+        return {iterator(cur), nullptr, false};
       }
     }
+    count_descent(depth);
+    return {end(), parent, left};
   }
 
-  iterator insert(Elt const& elt) {
-    untagged* cur = root.left;
+  // the element a key linked at pos would precede, end() if none; a hint
+  // for find_insert_position(hint, key) as long as that element stays
+  iterator next_of(insert_position const& pos) const noexcept {
+    return iterator(pos.left ? pos.parent : untagged::next(pos.parent));
+  }
+
+  // same as find_insert_position(key), but only compares with the
+  // neighbours of hint when key belongs right before it; amortized O(1)
+  // with a correct hint, end() included since the sentinel keeps the last
+  // element. Placed by the hint, it counts as a descent through the nodes
+  // compared; a wrong hint counts only the descent from the root after it
+  insert_position find_insert_position(iterator hint, Key const& key) const {
+    untagged* h = hint.ptr;
+    prefix_type const prefix = query_prefix(key);
+    if (h == &root || key_less(key, h, prefix)) {
+      untagged* before = h == &root ? root.last : prev_or_null(h);
+      if (before == nullptr || node_less(before, key, prefix)) {
+        count_descent(std::size_t(h != &root) + (before != nullptr));
+        if (h->left == nullptr) {
+          return {end(), h, true};
+        }
+        return {end(), before, false};
+      }
+    } else if (node_less(h, key, prefix)) {
+      untagged* after = untagged::next(h);
+      if (after == &root || key_less(key, after, prefix)) {
+        count_descent(1 + std::size_t(after != &root));
+        if (h->right == nullptr) {
+          return {end(), h, false};
+        }
+        return {end(), after, true};
+      }
+    } else {
+      count_descent(1);
+      return {hint, nullptr, false};
+    }
+    return find_insert_position(key);
+  }
+
+  // pos must come from find_insert_position for elt's key with no
+  // modifications of the tree in between
+  iterator insert_at(insert_position const& pos, Elt const& elt) noexcept {
     untagged* elt_p = static_cast<tagged*>(const_cast<Elt*>(&elt));
-    if (cur == nullptr) {
-      untagged::link_left(&root, elt_p);
-      return iterator(cur);
+    if (pos.left) {
+      if (pos.parent == &root) {
+        root.right = root.last = elt_p;
+      } else if (pos.parent == root.right) {
+        root.right = elt_p;
+      }
+      untagged::link_left(pos.parent, elt_p);
+    } else {
+      if (pos.parent == root.last) {
+        root.last = elt_p;
+      }
+      untagged::link_right(pos.parent, elt_p);
     }
+    count_rotations(untagged::balance_after_insert(elt_p, update));
+    return as_iterator(elt);
+  }
 
-    for (;;) {
-      if (cmp_node(cur, elt_p)) {
-        if (cur->right) {
-          cur = cur->right;
-        } else {
-          untagged::link_right(cur, elt_p);
-          return as_iterator(elt);
-        }
-      } else if (cmp_node(elt_p, cur)) {
-        if (cur->left) {
-          cur = cur->left;
+  iterator insert(Elt const& elt) {
+    auto pos = find_insert_position(get_key(&static_cast<tagged const&>(elt)));
+    if (pos.found != end()) {
+      return end();
+    }
+    return insert_at(pos, elt);
+  }
+
+  iterator insert(iterator hint, Elt const& elt) {
+    auto pos = find_insert_position(hint, get_key(&static_cast<tagged const&>(elt)));
+    if (pos.found != end()) {
+      return end();
+    }
+    return insert_at(pos, elt);
+  }
+
+  // tree must be empty, [first, last) holds pointers to elements in
+  // strictly increasing key order; links them into a perfectly balanced
+  // tree with the incomplete bottom level colored red
+  template <typename It>
+  void build_from_sorted(It first, It last) noexcept {
+    auto const n = static_cast<std::size_t>(last - first);
+    int full_levels = 0;
+    while ((std::size_t(2) << full_levels) - 1 <= n) {
+      ++full_levels;
+    }
+    untagged::link_left(&root, build_subtree(first, last, 0, full_levels));
+    find_ends();
+  }
+
+  // the same, the subtrees below the top levels linked on up to threads
+  // threads at once; those that cannot be started leave their part to
+  // the thread forking them
+  template <typename It>
+  void build_from_sorted(It first, It last, unsigned threads) noexcept {
+    auto const n = static_cast<std::size_t>(last - first);
+    int full_levels = 0;
+    while ((std::size_t(2) << full_levels) - 1 <= n) {
+      ++full_levels;
+    }
+    untagged::link_left(&root, build_subtree(first, last, 0, full_levels, threads));
+    find_ends();
+  }
+
+  // detaches every element without rebalancing, in O(n) time and O(1)
+  // memory; dispose(Elt*) is called on each element once it is detached
+  template <typename Disposer>
+  void clear_and_dispose(Disposer dispose) noexcept {
+    untagged* p = root.left;
+    while (p != nullptr) {
+      if (p->left) {
+        p = p->left;
+      } else if (p->right) {
+        p = p->right;
+      } else {
+        untagged* parent = p->parent();
+        if (parent->left == p) {
+          parent->left = nullptr;
         } else {
-          untagged::link_left(cur, elt_p);
-          return as_iterator(elt);
+          parent->right = nullptr;
         }
+        p->set_parent(nullptr);
+        p->set_red(false);
+        dispose(static_cast<Elt*>(static_cast<tagged*>(p)));
+        p = (parent != &root) ? parent : nullptr;
+      }
+    }
+    root.right = root.last = nullptr;
+  }
+
+  // forgets all elements in O(1) without touching them; each of them
+  // must then go through unhook before being destroyed or reinserted
+  void release() noexcept {
+    root.left = root.right = root.last = nullptr;
+  }
+
+  // moves the elements from pos on into tail, which must be empty;
+  // O(log n)
+  void split(iterator pos, intr_tree& tail) noexcept {
+    if (pos == end()) {
+      return;
+    }
+    auto parts = untagged::split(pos.ptr, update);
+    untagged::link_left(&root, parts.before.root);
+    untagged::link_left(&tail.root, parts.after.root);
+    find_ends();
+    tail.find_ends();
+  }
+
+  // appends the elements of tail, whose keys must all be greater than
+  // those here, leaving tail empty; O(log n)
+  void join(intr_tree& tail) noexcept {
+    if (tail.empty()) {
+      return;
+    }
+    untagged* mid = untagged::min_in_subtree(tail.root.left);
+    mid->unlink(update);
+    untagged::detached_tree a{root.left, untagged::black_height(root.left)};
+    untagged::detached_tree b{tail.root.left, untagged::black_height(tail.root.left)};
+    tail.root.left = tail.root.right = tail.root.last = nullptr;
+    untagged::link_left(&root, untagged::join(a, mid, b, update).root);
+    find_ends();
+  }
+
+  // positional access, only for counted trees
+
+  // number of elements before it
+  static std::size_t index_of(iterator it) noexcept {
+    static_assert(Counted, "needs a counted tree");
+    untagged const* p = it.ptr;
+    if (p->parent() == nullptr) {
+      return subtree_size(p->left);
+    }
+    std::size_t index = subtree_size(p->left);
+    for (; p->parent()->parent() != nullptr; p = p->parent()) {
+      if (!p->is_left_child()) {
+        index += subtree_size(p->parent()->left) + 1;
+      }
+    }
+    return index;
+  }
+
+  // element with the given index, end() if there is none
+  iterator nth(std::size_t index) const noexcept {
+    return nth_(&root, index);
+  }
+
+  // the iterator index positions away from it, found without the tree
+  static iterator advance(iterator it, std::ptrdiff_t n) noexcept {
+    auto index = static_cast<std::ptrdiff_t>(index_of(it)) + n;
+    untagged* sentinel = it.ptr;
+    while (sentinel->parent() != nullptr) {
+      sentinel = sentinel->parent();
+    }
+    if (index < 0) {
+      return iterator(sentinel);
+    }
+    return nth_(sentinel, static_cast<std::size_t>(index));
+  }
+
+  std::size_t size() const noexcept {
+    static_assert(Counted, "needs a counted tree");
+    return subtree_size(root.left);
+  }
+
+  // number of elements with keys less than key
+  template <typename K>
+  std::size_t count_less(K const& key) const {
+    static_assert(Counted, "needs a counted tree");
+    std::size_t count = 0;
+    for (untagged const* cur = root.left; cur != nullptr;) {
+      if (cmp_key(get_key(cur), key)) {
+        count += subtree_size(cur->left) + 1;
+        cur = cur->right;
       } else {
-        return end();
+        cur = cur->left;
       }
     }
+    return count;
+  }
+
+  // number of elements with keys not greater than key
+  template <typename K>
+  std::size_t count_not_greater(K const& key) const {
+    static_assert(Counted, "needs a counted tree");
+    std::size_t count = 0;
+    for (untagged const* cur = root.left; cur != nullptr;) {
+      if (cmp_key(key, get_key(cur))) {
+        cur = cur->left;
+      } else {
+        count += subtree_size(cur->left) + 1;
+        cur = cur->right;
+      }
+    }
+    return count;
+  }
+
+  static void unhook(Elt& elt) noexcept {
+    untagged& hook = static_cast<tagged&>(elt);
+    hook.left = hook.right = nullptr;
+    hook.set_parent(nullptr);
+    hook.set_red(false);
   }
 
   iterator erase(Elt const& elt) noexcept  {
     auto it = as_iterator(elt);
-    elt.unlink();
-    return ++it;
+    ++it;
+    count_rotations(static_cast<tagged&>(const_cast<Elt&>(elt)).unlink(update));
+    return it;
+  }
+
+  // erase without looking for the next element
+  void unlink(Elt const& elt) noexcept {
+    count_rotations(static_cast<tagged&>(const_cast<Elt&>(elt)).unlink(update));
   }
 
   iterator lower_bound(Key const& key) const {
+    return lower_bound_(key);
+  }
+
+  template <typename K, typename C = Comparator, typename = typename C::is_transparent>
+  iterator lower_bound(K const& key) const {
+    return lower_bound_(key);
+  }
+
+  iterator upper_bound(Key const& key) const {
+    return upper_bound_(key);
+  }
+
+  template <typename K, typename C = Comparator, typename = typename C::is_transparent>
+  iterator upper_bound(K const& key) const {
+    return upper_bound_(key);
+  }
+
+  // O(1), as is --end(): the sentinel keeps the first and last elements
+  iterator begin() const {
+    return iterator(root.right != nullptr ? root.right : &root);
+  }
+
+  iterator end() const {
+    return iterator(&root);
+  }
+
+private:
+  template <typename E, typename Tg, typename K, typename C, bool Cnt, typename S>
+  friend struct intr_tree;
+
+  using sentinel = untagged::sentinel;
+
+  mutable sentinel root;
+
+  static iterator at(untagged const* p) noexcept {
+    return iterator(p);
+  }
+
+  // after linking a whole new tree under the sentinel
+  void find_ends() noexcept {
+    root.right = root.left != nullptr ? untagged::min_in_subtree(root.left) : nullptr;
+    root.last = root.left != nullptr ? untagged::max_in_subtree(root.left) : nullptr;
+  }
+
+  void clear() noexcept {
+    clear_and_dispose([](Elt*) noexcept {});
+  }
+
+  static std::size_t subtree_size(untagged const* p) noexcept {
+    return p ? static_cast<tagged const*>(p)->subtree_size : 0;
+  }
+
+  static void update_size(untagged* p) noexcept {
+    static_cast<tagged*>(p)->subtree_size =
+        subtree_size(p->left) + subtree_size(p->right) + 1;
+  }
+
+  static constexpr untagged::update_fn updater() noexcept {
+    if constexpr (Counted) {
+      return &update_size;
+    } else {
+      return nullptr;
+    }
+  }
+
+  static constexpr untagged::update_fn update = updater();
+
+  static iterator nth_(untagged const* sentinel, std::size_t index) noexcept {
+    static_assert(Counted, "needs a counted tree");
+    untagged const* cur = sentinel->left;
+    while (cur != nullptr) {
+      std::size_t left_size = subtree_size(cur->left);
+      if (index < left_size) {
+        cur = cur->left;
+      } else if (index == left_size) {
+        return iterator(cur);
+      } else {
+        index -= left_size + 1;
+        cur = cur->right;
+      }
+    }
+    return iterator(sentinel);
+  }
+
+  template <typename It>
+  static untagged* build_subtree(It first, It last, int depth, int red_depth) noexcept {
+    if (first == last) {
+      return nullptr;
+    }
+    It mid = first + (last - first) / 2;
+    untagged* node = static_cast<tagged*>(*mid);
+    untagged::link_left(node, build_subtree(first, mid, depth + 1, red_depth));
+    untagged::link_right(node, build_subtree(mid + 1, last, depth + 1, red_depth));
+    node->set_red(depth >= red_depth);
+    if constexpr (Counted) {
+      static_cast<tagged*>(node)->subtree_size = static_cast<std::size_t>(last - first);
+    }
+    return node;
+  }
+
+  template <typename It>
+  static untagged* build_subtree(It first, It last, int depth, int red_depth,
+                                 unsigned threads) noexcept {
+    if (threads <= 1 || static_cast<std::size_t>(last - first) < fork_join::grain) {
+      return build_subtree(first, last, depth, red_depth);
+    }
+    It mid = first + (last - first) / 2;
+    untagged* node = static_cast<tagged*>(*mid);
+    untagged* left = nullptr;
+    untagged* right = nullptr;
+    auto build_left = [&]() noexcept {
+      left = build_subtree(first, mid, depth + 1, red_depth, threads / 2);
+    };
+    auto build_right = [&]() noexcept {
+      right = build_subtree(mid + 1, last, depth + 1, red_depth, threads - threads / 2);
+    };
+    // a thread that cannot be started makes both run here, it never throws
+    static_assert(noexcept(fork_join::both(build_left, build_right)));
+    fork_join::both(build_left, build_right);
+    untagged::link_left(node, left);
+    untagged::link_right(node, right);
+    node->set_red(depth >= red_depth);
+    if constexpr (Counted) {
+      static_cast<tagged*>(node)->subtree_size = static_cast<std::size_t>(last - first);
+    }
+    return node;
+  }
+
+  // predecessor of p, nullptr for the minimum
+  static untagged* prev_or_null(untagged* p) noexcept {
+    if (p->left) {
+      return untagged::max_in_subtree(p->left);
+    }
+    while (p->parent() != nullptr && p->is_left_child()) {
+      p = p->parent();
+    }
+    return p->parent();
+  }
+
+  template <typename K>
+  iterator find_(K const& key) const noexcept {
+    untagged* cur = root.left;
+    std::size_t depth = 0;
+    prefix_type const prefix = query_prefix(key);
+    for (;;) {
+      if (cur == nullptr) {
+        count_descent(depth);
+        return end();
+      }
+
+      ++depth;
+      if (node_less(cur, key, prefix)) {
+        cur = cur->right;
+      } else if (key_less(key, cur, prefix)) {
+        cur = cur->left;
+      } else {
+        count_descent(depth);
+        return iterator(cur);
+      }
+    }
+  }
+
+  template <typename K>
+  iterator lower_bound_(K const& key) const {
     untagged const* res = &root;
     untagged* cur = root.left;
+    std::size_t depth = 0;
+    prefix_type const prefix = query_prefix(key);
     for (;;) {
       if (cur == nullptr) {
         break;
       }
-      if (cmp_key(get_key(cur), key)) {
+      ++depth;
+      if (node_less(cur, key, prefix)) {
         cur = cur->right;
       } else {
         res = cur;
@@ -213,17 +908,22 @@ struct intr_tree : Comparator {
       }
     }
 
+    count_descent(depth);
     return iterator(res);
   }
 
-  iterator upper_bound(Key const& key) const {
+  template <typename K>
+  iterator upper_bound_(K const& key) const {
     untagged const* res = &root;
     untagged* cur = root.left;
+    std::size_t depth = 0;
+    prefix_type const prefix = query_prefix(key);
     for (;;) {
       if (cur == nullptr) {
         break;
       }
-      if (cmp_key(key, get_key(cur))) {
+      ++depth;
+      if (key_less(key, cur, prefix)) {
         res = cur;
         cur = cur->left;
       } else {
@@ -231,34 +931,70 @@ struct intr_tree : Comparator {
       }
     }
 
+    count_descent(depth);
     return iterator(res);
   }
 
-  iterator begin() const {
-    return iterator(untagged::min_in_subtree(&root));
+  template <typename A, typename B>
+  bool cmp_key(A const& a, B const& b) const {
+    if constexpr (Stats::enabled) {
+      ++this->stats_ref().comparisons;
+    }
+    return Comparator::operator()(a, b);
   }
 
-  iterator end() const {
-    return iterator(&root);
+  // with a caching comparator, node keys are first compared by the prefix
+  // the element keeps; comparisons counts only the full ones
+  static constexpr bool cached_prefix = has_key_prefix_v<Comparator>;
+  using prefix_type = typename key_prefix_type<Comparator>::type;
+
+  template <typename K>
+  static prefix_type query_prefix(K const& key) noexcept {
+    if constexpr (cached_prefix) {
+      return Comparator::prefix(key);
+    } else {
+      return {};
+    }
   }
 
-private:
-  mutable untagged root;
+  static prefix_type node_prefix(untagged const* node) noexcept {
+    return static_cast<Elt const*>(static_cast<tagged const*>(node))->template key_prefix<Tag>();
+  }
 
-  void delete_subtree(untagged* p) {
-    if (p) {
-      delete_subtree(p->left);
-      delete_subtree(p->right);
-      p->unlink();
+  template <typename K>
+  bool node_less(untagged const* node, K const& key, prefix_type prefix) const {
+    if constexpr (cached_prefix) {
+      prefix_type const p = node_prefix(node);
+      if (p != prefix) {
+        return p < prefix;
+      }
     }
+    return cmp_key(get_key(node), key);
   }
 
-  void clear() {
-    delete_subtree(&root);
+  template <typename K>
+  bool key_less(K const& key, untagged const* node, prefix_type prefix) const {
+    if constexpr (cached_prefix) {
+      prefix_type const p = node_prefix(node);
+      if (p != prefix) {
+        return prefix < p;
+      }
+    }
+    return cmp_key(key, get_key(node));
   }
 
-  bool cmp_key(Key const& a, Key const& b) const {
-    return Comparator::operator()(a, b);
+  void count_descent(std::size_t depth) const noexcept {
+    if constexpr (Stats::enabled) {
+      auto& stats = this->stats_ref();
+      ++stats.descents;
+      ++stats.depth_histogram[depth < Stats::max_depth ? depth : Stats::max_depth - 1];
+    }
+  }
+
+  void count_rotations(unsigned rotations) const noexcept {
+    if constexpr (Stats::enabled) {
+      this->stats_ref().rotations += rotations;
+    }
   }
 
   bool cmp_node(untagged const* a, untagged const* b) const {
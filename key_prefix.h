@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string_view>
+#include <type_traits>
+
+// Opt-in key prefix caching for the tree sides of bimap. A comparator that
+// caches (one with a prefix_type and a static prefix(key)) has bimap keep
+// prefix(key) of every node in the side's hook, next to its links. Descents
+// compare the prefix of the searched key with those first and only call the
+// comparator when they are equal, so most levels do not touch key data out
+// of the node, such as the heap buffer of a string.
+//
+// Prefixes must agree with the comparator: prefix_type is ordered by <,
+// and prefix(a) < prefix(b) implies compare(a, b). Equal prefixes decide
+// nothing, keys sharing one are told apart by the comparator; so it is not
+// required that compare(a, b) gives prefix(a) < prefix(b), only that it
+// never gives prefix(b) < prefix(a).
+
+template <typename Compare, typename = void>
+struct has_key_prefix : std::false_type {};
+
+template <typename Compare>
+struct has_key_prefix<Compare, std::void_t<typename Compare::prefix_type>>
+    : std::true_type {};
+
+template <typename Compare>
+inline constexpr bool has_key_prefix_v = has_key_prefix<Compare>::value;
+
+// prefix_type of Compare, an empty type when it caches none
+template <typename Compare, bool = has_key_prefix_v<Compare>>
+struct key_prefix_type {
+  struct type {};
+};
+
+template <typename Compare>
+struct key_prefix_type<Compare, true> {
+  using type = typename Compare::prefix_type;
+};
+
+// the first 8 bytes of a string as a big-endian number, zero padded: the
+// order of std::less on strings, which compares bytes as unsigned char
+struct string_prefix {
+  using prefix_type = std::uint64_t;
+
+  static prefix_type prefix(std::string_view s) noexcept {
+    unsigned char bytes[8] = {};
+    if (!s.empty()) {
+      std::memcpy(bytes, s.data(), std::min<std::size_t>(s.size(), sizeof(bytes)));
+    }
+    prefix_type p = 0;
+    for (unsigned char b : bytes) {
+      p = (p << 8) | b;
+    }
+    return p;
+  }
+};
+
+// Compare with the prefixes of Prefix cached, e.g.
+// bimap<std::string, std::uint64_t, prefix_compare<std::less<std::string>>>
+template <typename Compare, typename Prefix = string_prefix>
+struct prefix_compare : Compare {
+  using prefix_type = typename Prefix::prefix_type;
+
+  prefix_compare() = default;
+  explicit prefix_compare(Compare const& cmp) : Compare(cmp) {}
+
+  template <typename K>
+  static prefix_type prefix(K const& key) noexcept(noexcept(Prefix::prefix(key))) {
+    return Prefix::prefix(key);
+  }
+};
+
+// Hook with room for the cached prefix when Compare caches one
+template <typename Hook, typename Compare, bool = has_key_prefix_v<Compare>>
+struct prefix_hook : Hook {};
+
+template <typename Hook, typename Compare>
+struct prefix_hook<Hook, Compare, true> : Hook {
+  typename Compare::prefix_type key_prefix{};
+};
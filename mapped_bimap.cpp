@@ -0,0 +1,137 @@
+#include "mapped_bimap.h"
+
+#include <cerrno>
+#include <system_error>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+char const file_magic[8] = "BIMAPv1";
+std::uint32_t const native_byte_order = 0x01020304;
+std::uint64_t const section_align = 64;
+
+std::uint64_t align_up(std::uint64_t n) {
+  return (n + section_align - 1) / section_align * section_align;
+}
+
+[[noreturn]] void bad_file(char const* what) {
+  throw std::runtime_error(std::string("not a serialized bimap: ") + what);
+}
+
+} // namespace
+
+bimap_file_header bimap_file_layout(std::uint64_t count, std::size_t left_size,
+                                    std::size_t right_size) {
+  bimap_file_header h{};
+  std::memcpy(h.magic, file_magic, sizeof(h.magic));
+  h.byte_order = native_byte_order;
+  h.index_size = sizeof(std::uint32_t);
+  h.left_size = static_cast<std::uint32_t>(left_size);
+  h.right_size = static_cast<std::uint32_t>(right_size);
+  h.count = count;
+  h.left_keys = align_up(sizeof(bimap_file_header));
+  h.left_other = align_up(h.left_keys + count * left_size);
+  h.right_keys = align_up(h.left_other + count * h.index_size);
+  h.right_other = align_up(h.right_keys + count * right_size);
+  h.file_size = h.right_other + count * h.index_size;
+  return h;
+}
+
+bimap_file_header const& bimap_file_check(void const* data, std::size_t size,
+                                          std::size_t left_size, std::size_t right_size) {
+  if (reinterpret_cast<std::uintptr_t>(data) % section_align != 0) {
+    throw std::invalid_argument("serialized bimap must be aligned to 64 bytes");
+  }
+  if (size < sizeof(bimap_file_header)) {
+    bad_file("too short");
+  }
+  auto const& h = *static_cast<bimap_file_header const*>(data);
+  if (std::memcmp(h.magic, file_magic, sizeof(h.magic)) != 0) {
+    bad_file("bad magic");
+  }
+  if (h.byte_order != native_byte_order) {
+    bad_file("other byte order");
+  }
+  if (h.index_size != sizeof(std::uint32_t) || h.left_size != left_size ||
+      h.right_size != right_size) {
+    bad_file("other key types");
+  }
+  if (h.count > std::numeric_limits<std::uint32_t>::max()) {
+    bad_file("bad count");
+  }
+  bimap_file_header const expected = bimap_file_layout(h.count, left_size, right_size);
+  if (h.left_keys != expected.left_keys || h.left_other != expected.left_other ||
+      h.right_keys != expected.right_keys || h.right_other != expected.right_other ||
+      h.file_size != expected.file_size) {
+    bad_file("bad layout");
+  }
+  if (h.file_size > size) {
+    bad_file("truncated");
+  }
+  // lookups index the key arrays with these, so they must be inverse
+  // permutations of 0..count-1; the keys' order is left to the reader
+  auto const* base = static_cast<unsigned char const*>(data);
+  auto const* left_other = reinterpret_cast<std::uint32_t const*>(base + h.left_other);
+  auto const* right_other = reinterpret_cast<std::uint32_t const*>(base + h.right_other);
+  for (std::uint64_t i = 0; i < h.count; ++i) {
+    if (left_other[i] >= h.count || right_other[left_other[i]] != i) {
+      bad_file("bad index");
+    }
+  }
+  return h;
+}
+
+mapped_file::mapped_file(std::string const& path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(), path);
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    int err = errno;
+    ::close(fd);
+    throw std::system_error(err, std::generic_category(), path);
+  }
+  size_ = static_cast<std::size_t>(st.st_size);
+  if (size_ != 0) {
+    void* p = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      int err = errno;
+      ::close(fd);
+      throw std::system_error(err, std::generic_category(), path);
+    }
+    data_ = p;
+  }
+  // the mapping stays valid without the descriptor
+  ::close(fd);
+}
+
+mapped_file::mapped_file(mapped_file&& other) noexcept
+    : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+mapped_file& mapped_file::operator=(mapped_file&& other) noexcept {
+  if (this != &other) {
+    if (data_ != nullptr) {
+      ::munmap(data_, size_);
+    }
+    data_ = std::exchange(other.data_, nullptr);
+    size_ = std::exchange(other.size_, 0);
+  }
+  return *this;
+}
+
+mapped_file::~mapped_file() {
+  if (data_ != nullptr) {
+    ::munmap(data_, size_);
+  }
+}
+
+void mapped_file::will_need() const noexcept {
+  if (data_ != nullptr) {
+    ::madvise(data_, size_, MADV_WILLNEED);
+  }
+}
@@ -0,0 +1,440 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "bimap.h"
+#include "flat_search.h"
+
+// On-disk format of a bimap, in native byte order. Each side is stored as
+// its keys in order, then for every key the position of its pair in the
+// other side's keys, the layout of flat_bimap. Every array starts at a
+// multiple of 64 bytes from the start of the file.
+struct bimap_file_header {
+  char magic[8];
+  std::uint32_t byte_order;
+  std::uint32_t index_size;
+  std::uint32_t left_size;
+  std::uint32_t right_size;
+  std::uint64_t count;
+  // byte offsets of the arrays
+  std::uint64_t left_keys;
+  std::uint64_t left_other;
+  std::uint64_t right_keys;
+  std::uint64_t right_other;
+  std::uint64_t file_size;
+};
+
+// header of a file holding count pairs of keys of the given sizes
+bimap_file_header bimap_file_layout(std::uint64_t count, std::size_t left_size,
+                                    std::size_t right_size);
+
+// the header of the serialized map at data, aligned to 64 bytes; throws
+// std::runtime_error if it is not one with keys of the given sizes or if
+// its index arrays point outside the keys. Reads both index arrays, O(n).
+bimap_file_header const& bimap_file_check(void const* data, std::size_t size,
+                                          std::size_t left_size, std::size_t right_size);
+
+// Read-only mapping of a whole file. POSIX only.
+struct mapped_file {
+  mapped_file() noexcept = default;
+
+  // throws std::system_error if the file cannot be opened or mapped
+  explicit mapped_file(std::string const& path);
+
+  mapped_file(mapped_file&& other) noexcept;
+  mapped_file& operator=(mapped_file&& other) noexcept;
+
+  mapped_file(mapped_file const&) = delete;
+  mapped_file& operator=(mapped_file const&) = delete;
+
+  ~mapped_file();
+
+  void const* data() const noexcept {
+    return data_;
+  }
+
+  std::size_t size() const noexcept {
+    return size_;
+  }
+
+  // asks the kernel to read the whole file ahead of the first lookups
+  void will_need() const noexcept;
+
+ private:
+  void* data_{nullptr};
+  std::size_t size_{0};
+};
+
+// Serializes map (a bimap or flat_bimap) for mapped_bimap. compare_right
+// must order right keys as the map does. Holds a copy of the keys while
+// writing; at most 2^32 - 1 pairs.
+template <typename Map,
+          typename CompareRight = typename Map::template Comparator<right_tag>>
+void write_bimap(std::ostream& out, Map const& map,
+                 CompareRight compare_right = CompareRight()) {
+  using left_t = typename Map::left_t;
+  using right_t = typename Map::right_t;
+  static_assert(std::is_trivially_copyable_v<left_t> &&
+                    std::is_trivially_copyable_v<right_t>,
+                "keys are written as their bytes");
+  if (map.size() > std::numeric_limits<std::uint32_t>::max()) {
+    throw std::length_error("bimap is too large to be written");
+  }
+
+  std::vector<left_t> lefts;
+  std::vector<right_t> paired;
+  std::vector<right_t> rights;
+  lefts.reserve(map.size());
+  paired.reserve(map.size());
+  rights.reserve(map.size());
+  for (auto it = map.begin_left(); it != map.end_left(); ++it) {
+    lefts.push_back(*it);
+    paired.push_back(*it.flip());
+  }
+  for (auto it = map.begin_right(); it != map.end_right(); ++it) {
+    rights.push_back(*it);
+  }
+
+  // the right positions are found by search, the left ones are their inverse
+  std::vector<std::uint32_t> left_other(lefts.size());
+  std::vector<std::uint32_t> right_other(lefts.size());
+  for (std::size_t i = 0; i < lefts.size(); ++i) {
+    auto q = static_cast<std::uint32_t>(
+        flat_search::lower_bound(rights.begin(), rights.end(), paired[i], compare_right) -
+        rights.begin());
+    left_other[i] = q;
+    right_other[q] = static_cast<std::uint32_t>(i);
+  }
+
+  bimap_file_header const header =
+      bimap_file_layout(lefts.size(), sizeof(left_t), sizeof(right_t));
+  std::uint64_t written = 0;
+  auto put = [&](std::uint64_t offset, void const* data, std::size_t size) {
+    static char const zeros[64] = {};
+    out.write(zeros, static_cast<std::streamsize>(offset - written));
+    out.write(static_cast<char const*>(data), static_cast<std::streamsize>(size));
+    written = offset + size;
+  };
+  put(0, &header, sizeof(header));
+  put(header.left_keys, lefts.data(), lefts.size() * sizeof(left_t));
+  put(header.left_other, left_other.data(), left_other.size() * sizeof(std::uint32_t));
+  put(header.right_keys, rights.data(), rights.size() * sizeof(right_t));
+  put(header.right_other, right_other.data(), right_other.size() * sizeof(std::uint32_t));
+  put(header.file_size, nullptr, 0);
+  if (!out) {
+    throw std::runtime_error("bimap could not be written");
+  }
+}
+
+// writes map to the file at path, replacing it
+template <typename Map,
+          typename CompareRight = typename Map::template Comparator<right_tag>>
+void write_bimap(std::string const& path, Map const& map,
+                 CompareRight compare_right = CompareRight()) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::runtime_error("cannot open " + path);
+  }
+  write_bimap(out, map, compare_right);
+}
+
+// Read-only bimap served from a file written by write_bimap, mapped into
+// memory: opening it only checks the index arrays, and each lookup is a
+// binary search over the mapped keys, so their pages are read as the
+// searches touch them. Keys out of order make lookups miss, never read
+// outside the file.
+// Iterators are random access, as for flat_bimap.
+template <typename Left, typename Right,
+          typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>>
+struct mapped_bimap {
+  using left_t = Left;
+  using right_t = Right;
+  template <typename Side>
+  using key_t = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      left_t,
+      right_t>;
+
+  template <typename Side>
+  using Comparator = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      CompareLeft,
+      CompareRight>;
+
+  static_assert(std::is_trivially_copyable_v<left_t> &&
+                    std::is_trivially_copyable_v<right_t>,
+                "keys are read as their bytes");
+  static_assert(alignof(left_t) <= 64 && alignof(right_t) <= 64,
+                "arrays are aligned to 64 bytes");
+
+private:
+  using index_t = std::uint32_t;
+
+  template <typename Side>
+  struct side_t : Comparator<Side> {
+    key_t<Side> const* keys{nullptr};
+    index_t const* other{nullptr};
+
+    explicit side_t(Comparator<Side> const& cmp) : Comparator<Side>(cmp) {}
+
+    Comparator<Side> const& comparator() const {
+      return *this;
+    }
+  };
+
+public:
+  template <typename Side>
+  struct base_iterator {
+    friend mapped_bimap;
+    using iterator_category = std::random_access_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = key_t<Side>;
+    using pointer = value_type const*;
+    using reference = value_type const&;
+
+    base_iterator() = default;
+
+    reference operator*() const {
+      return map_p->template side<Side>().keys[pos];
+    }
+    pointer operator->() const {
+      return &**this;
+    }
+    reference operator[](difference_type n) const {
+      return *(*this + n);
+    }
+
+    base_iterator& operator++() {
+      ++pos;
+      return *this;
+    }
+    base_iterator operator++(int) {
+      base_iterator tmp(*this);
+      ++*this;
+      return tmp;
+    }
+
+    base_iterator& operator--() {
+      --pos;
+      return *this;
+    }
+    base_iterator operator--(int) {
+      base_iterator tmp(*this);
+      --*this;
+      return tmp;
+    }
+
+    base_iterator& operator+=(difference_type n) {
+      pos = static_cast<std::size_t>(static_cast<difference_type>(pos) + n);
+      return *this;
+    }
+    base_iterator& operator-=(difference_type n) {
+      return *this += -n;
+    }
+
+    friend base_iterator operator+(base_iterator a, difference_type n) {
+      return a += n;
+    }
+    friend base_iterator operator+(difference_type n, base_iterator a) {
+      return a += n;
+    }
+    friend base_iterator operator-(base_iterator a, difference_type n) {
+      return a -= n;
+    }
+    friend difference_type operator-(base_iterator const& a, base_iterator const& b) {
+      return static_cast<difference_type>(a.pos) - static_cast<difference_type>(b.pos);
+    }
+
+    base_iterator<Other<Side>> flip() const {
+      if (pos == map_p->count) {
+        return base_iterator<Other<Side>>(map_p, pos);
+      }
+      return base_iterator<Other<Side>>(map_p, map_p->template side<Side>().other[pos]);
+    }
+
+    friend bool operator==(base_iterator const& a, base_iterator const& b) {
+      return a.pos == b.pos;
+    }
+    friend bool operator!=(base_iterator const& a, base_iterator const& b) {
+      return !(a == b);
+    }
+    friend bool operator<(base_iterator const& a, base_iterator const& b) {
+      return a.pos < b.pos;
+    }
+    friend bool operator>(base_iterator const& a, base_iterator const& b) {
+      return b < a;
+    }
+    friend bool operator<=(base_iterator const& a, base_iterator const& b) {
+      return !(b < a);
+    }
+    friend bool operator>=(base_iterator const& a, base_iterator const& b) {
+      return !(a < b);
+    }
+
+  private:
+    mapped_bimap const* map_p{nullptr};
+    std::size_t pos{0};
+
+    base_iterator(mapped_bimap const* p, std::size_t pos) : map_p(p), pos(pos) {}
+  };
+
+  using left_iterator = base_iterator<left_tag>;
+  using right_iterator = base_iterator<right_tag>;
+  template <typename Side>
+  using iterator = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      left_iterator,
+      right_iterator>;
+
+  // maps the file at path
+  explicit mapped_bimap(std::string const& path,
+                        CompareLeft compare_left = CompareLeft(),
+                        CompareRight compare_right = CompareRight())
+      : file(path), left_side(compare_left), right_side(compare_right) {
+    attach(file.data(), file.size());
+  }
+
+  // view of a serialized map already in memory, aligned to 64 bytes; the
+  // memory must outlive the view
+  mapped_bimap(void const* data, std::size_t size,
+               CompareLeft compare_left = CompareLeft(),
+               CompareRight compare_right = CompareRight())
+      : left_side(compare_left), right_side(compare_right) {
+    attach(data, size);
+  }
+
+  // iterators refer to the view, so it is not movable
+  mapped_bimap(mapped_bimap const&) = delete;
+  mapped_bimap& operator=(mapped_bimap const&) = delete;
+
+  // reads the whole file ahead when it was mapped from a path
+  void will_need() const noexcept {
+    file.will_need();
+  }
+
+  left_iterator find_left(left_t const& left) const {
+    return find<left_tag>(left);
+  }
+  right_iterator find_right(right_t const& right) const {
+    return find<right_tag>(right);
+  }
+
+  right_t const& at_left(left_t const& key) const {
+    return at<left_tag>(key);
+  }
+  left_t const& at_right(right_t const& key) const {
+    return at<right_tag>(key);
+  }
+
+  left_iterator lower_bound_left(left_t const& left) const {
+    return left_iterator(this, lower_bound_pos<left_tag>(left));
+  }
+  left_iterator upper_bound_left(left_t const& left) const {
+    return left_iterator(this, upper_bound_pos<left_tag>(left));
+  }
+  right_iterator lower_bound_right(right_t const& right) const {
+    return right_iterator(this, lower_bound_pos<right_tag>(right));
+  }
+  right_iterator upper_bound_right(right_t const& right) const {
+    return right_iterator(this, upper_bound_pos<right_tag>(right));
+  }
+
+  left_iterator begin_left() const {
+    return left_iterator(this, 0);
+  }
+  left_iterator end_left() const {
+    return left_iterator(this, count);
+  }
+
+  right_iterator begin_right() const {
+    return right_iterator(this, 0);
+  }
+  right_iterator end_right() const {
+    return right_iterator(this, count);
+  }
+
+  bool empty() const {
+    return count == 0;
+  }
+
+  std::size_t size() const {
+    return count;
+  }
+
+private:
+  mapped_file file;
+  side_t<left_tag> left_side;
+  side_t<right_tag> right_side;
+  std::size_t count{0};
+
+  void attach(void const* data, std::size_t size) {
+    bimap_file_header const& header =
+        bimap_file_check(data, size, sizeof(left_t), sizeof(right_t));
+    auto const* base = static_cast<unsigned char const*>(data);
+    // the arrays are aligned in the file and checked to fit in it
+    left_side.keys = reinterpret_cast<left_t const*>(base + header.left_keys);
+    left_side.other = reinterpret_cast<index_t const*>(base + header.left_other);
+    right_side.keys = reinterpret_cast<right_t const*>(base + header.right_keys);
+    right_side.other = reinterpret_cast<index_t const*>(base + header.right_other);
+    count = static_cast<std::size_t>(header.count);
+  }
+
+  template <typename Side>
+  side_t<Side> const& side() const {
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return left_side;
+    } else {
+      return right_side;
+    }
+  }
+
+  template <typename Side, typename K>
+  std::size_t lower_bound_pos(K const& key) const {
+    auto const& s = side<Side>();
+    return static_cast<std::size_t>(
+        flat_search::lower_bound(s.keys, s.keys + count, key, s.comparator()) - s.keys);
+  }
+
+  template <typename Side, typename K>
+  std::size_t upper_bound_pos(K const& key) const {
+    auto const& s = side<Side>();
+    return static_cast<std::size_t>(
+        flat_search::upper_bound(s.keys, s.keys + count, key, s.comparator()) - s.keys);
+  }
+
+  template <typename Side, typename K>
+  iterator<Side> find(K const& key) const {
+    std::size_t pos = lower_bound_pos<Side>(key);
+    auto const& s = side<Side>();
+    if (pos != count && s.comparator()(key, s.keys[pos])) {
+      pos = count;
+    }
+    return iterator<Side>(this, pos);
+  }
+
+  template <typename Side, typename K>
+  key_t<Other<Side>> const& at(K const& key) const {
+    auto it = find<Side>(key);
+    if (it == end<Side>()) {
+      throw std::out_of_range("No such element");
+    }
+    return *it.flip();
+  }
+
+  template <typename Side>
+  iterator<Side> end() const {
+    return iterator<Side>(this, count);
+  }
+};
@@ -0,0 +1,68 @@
+#include "node_pool.h"
+
+node_pool::node_pool(std::size_t max_slab_blocks) noexcept
+    : max_slab_blocks(max_slab_blocks) {}
+
+node_pool::~node_pool() {
+  for (void* slab : slabs) {
+    ::operator delete(slab);
+  }
+}
+
+std::size_t node_pool::block_size(std::size_t size) noexcept {
+  std::size_t const align = alignof(std::max_align_t);
+  if (size < sizeof(free_block)) {
+    size = sizeof(free_block);
+  }
+  return (size + align - 1) / align * align;
+}
+
+node_pool::size_class& node_pool::get_class(std::size_t size) {
+  std::size_t const bs = block_size(size);
+  for (auto& c : classes) {
+    if (c.block_size == bs) {
+      return c;
+    }
+  }
+  classes.push_back(size_class{bs, 16, nullptr});
+  return classes.back();
+}
+
+void node_pool::grow(size_class& c) {
+  slabs.reserve(slabs.size() + 1);
+  auto* slab = static_cast<char*>(::operator new(c.block_size * c.next_slab_blocks));
+  slabs.push_back(slab);
+
+  // thread the new blocks in address order
+  for (std::size_t i = c.next_slab_blocks; i-- > 0;) {
+    auto* block = reinterpret_cast<free_block*>(slab + i * c.block_size);
+    block->next = c.free;
+    c.free = block;
+  }
+
+  if (c.next_slab_blocks < max_slab_blocks) {
+    c.next_slab_blocks *= 2;
+  }
+}
+
+void* node_pool::allocate(std::size_t size) {
+  auto& c = get_class(size);
+  if (c.free == nullptr) {
+    grow(c);
+  }
+  free_block* block = c.free;
+  c.free = block->next;
+  return block;
+}
+
+void node_pool::deallocate(void* p, std::size_t size) noexcept {
+  std::size_t const bs = block_size(size);
+  for (auto& c : classes) {
+    if (c.block_size == bs) {
+      auto* block = static_cast<free_block*>(p);
+      block->next = c.free;
+      c.free = block;
+      return;
+    }
+  }
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Slab allocator for fixed-size objects: storage is carved out of slabs
+// and released blocks are recycled through a per-size free list. Slabs are
+// returned to the system only when the pool is destroyed, addresses of
+// allocated objects never change. Not thread-safe.
+struct node_pool {
+  explicit node_pool(std::size_t max_slab_blocks = 4096) noexcept;
+
+  node_pool(node_pool const&) = delete;
+  node_pool& operator=(node_pool const&) = delete;
+
+  ~node_pool();
+
+  // size must not exceed alignof(std::max_align_t) alignment requirements
+  void* allocate(std::size_t size);
+
+  void deallocate(void* p, std::size_t size) noexcept;
+
+ private:
+  struct free_block {
+    free_block* next;
+  };
+
+  struct size_class {
+    std::size_t block_size;
+    std::size_t next_slab_blocks;
+    free_block* free;
+  };
+
+  std::size_t max_slab_blocks;
+  std::vector<size_class> classes;
+  std::vector<void*> slabs;
+
+  static std::size_t block_size(std::size_t size) noexcept;
+
+  size_class& get_class(std::size_t size);
+
+  void grow(size_class& c);
+};
+
+// Allocator front-end for node_pool. Copies and rebinds share one pool,
+// so it can be plugged into bimap as Allocator and used for node_t.
+// Arrays and over-aligned types bypass the pool.
+template <typename T>
+struct pool_allocator {
+  template <typename U>
+  friend struct pool_allocator;
+
+  using value_type = T;
+
+  using propagate_on_container_copy_assignment = std::false_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+  using is_always_equal = std::false_type;
+
+  template <typename U>
+  struct rebind {
+    using other = pool_allocator<U>;
+  };
+
+  pool_allocator() : pool(std::make_shared<node_pool>()) {}
+
+  explicit pool_allocator(std::shared_ptr<node_pool> pool) noexcept
+      : pool(std::move(pool)) {}
+
+  // a moved-from allocator still equals its old value and stays usable,
+  // so moves share the pool like copies do
+  pool_allocator(pool_allocator const& other) noexcept : pool(other.pool) {}
+  pool_allocator(pool_allocator&& other) noexcept : pool(other.pool) {}
+
+  pool_allocator& operator=(pool_allocator const& other) noexcept {
+    pool = other.pool;
+    return *this;
+  }
+  pool_allocator& operator=(pool_allocator&& other) noexcept {
+    pool = other.pool;
+    return *this;
+  }
+
+  template <typename U>
+  pool_allocator(pool_allocator<U> const& other) noexcept : pool(other.pool) {}
+
+  // copied container gets a pool of its own
+  pool_allocator select_on_container_copy_construction() const {
+    return pool_allocator();
+  }
+
+  T* allocate(std::size_t n) {
+    if (!use_pool(n)) {
+      return std::allocator<T>().allocate(n);
+    }
+    return static_cast<T*>(pool->allocate(sizeof(T)));
+  }
+
+  void deallocate(T* p, std::size_t n) noexcept {
+    if (!use_pool(n)) {
+      std::allocator<T>().deallocate(p, n);
+    } else {
+      pool->deallocate(p, sizeof(T));
+    }
+  }
+
+  template <typename A, typename B>
+  friend bool operator==(pool_allocator<A> const& a, pool_allocator<B> const& b) noexcept;
+
+ private:
+  std::shared_ptr<node_pool> pool;
+
+  static bool use_pool(std::size_t n) noexcept {
+    return n == 1 && alignof(T) <= alignof(std::max_align_t);
+  }
+};
+
+template <typename A, typename B>
+bool operator==(pool_allocator<A> const& a, pool_allocator<B> const& b) noexcept {
+  return a.pool == b.pool;
+}
+
+template <typename A, typename B>
+bool operator!=(pool_allocator<A> const& a, pool_allocator<B> const& b) noexcept {
+  return !(a == b);
+}
@@ -0,0 +1,457 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "bimap.h"
+
+// Persistent bimap: every version is immutable and copying one, or taking
+// snapshot(), is O(1). Each side is an AVL tree of reference counted nodes
+// pointing at a shared pair; a mutation copies the O(log n) nodes on its
+// search paths and shares all other nodes with the previous versions.
+//
+// Iterators pin the version they were taken from: they stay valid, and keep
+// showing that version, across later mutations of the map, as long as the
+// map object itself is alive. Distinct copies may be used by different
+// threads at the same time.
+template <typename Left, typename Right,
+          typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>>
+struct persistent_bimap {
+  using left_t = Left;
+  using right_t = Right;
+  template <typename Side>
+  using key_t = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      left_t,
+      right_t>;
+
+  template <typename Side>
+  using Comparator = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      CompareLeft,
+      CompareRight>;
+
+private:
+  using pair_t = std::pair<Left, Right>;
+
+  struct node;
+  using node_ptr = std::shared_ptr<node const>;
+
+  struct node {
+    std::shared_ptr<pair_t const> value;
+    node_ptr left;
+    node_ptr right;
+    int height;
+  };
+
+  template <typename Side>
+  static key_t<Side> const& key(pair_t const& value) noexcept {
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return value.first;
+    } else {
+      return value.second;
+    }
+  }
+
+  template <typename Side>
+  static key_t<Side> const& key(node const* n) noexcept {
+    return key<Side>(*n->value);
+  }
+
+public:
+  template <typename Side>
+  struct base_iterator {
+    friend persistent_bimap;
+    template <typename>
+    friend struct base_iterator;
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = key_t<Side>;
+    using pointer = value_type const*;
+    using reference = value_type const&;
+
+    base_iterator() = default;
+
+    reference operator*() const {
+      return key<Side>(path.back());
+    }
+    pointer operator->() const {
+      return &**this;
+    }
+
+    base_iterator& operator++() {
+      node const* n = path.back();
+      if (n->right) {
+        path.push_back(n->right.get());
+        descend<&node::left>();
+      } else {
+        ascend<&node::right>();
+      }
+      return *this;
+    }
+    base_iterator operator++(int) {
+      base_iterator tmp(*this);
+      ++*this;
+      return tmp;
+    }
+
+    base_iterator& operator--() {
+      if (path.empty()) {
+        if (root) {
+          path.push_back(root.get());
+          descend<&node::right>();
+        }
+        return *this;
+      }
+      node const* n = path.back();
+      if (n->left) {
+        path.push_back(n->left.get());
+        descend<&node::right>();
+      } else {
+        ascend<&node::left>();
+      }
+      return *this;
+    }
+    base_iterator operator--(int) {
+      base_iterator tmp(*this);
+      --*this;
+      return tmp;
+    }
+
+    base_iterator<Other<Side>> flip() const {
+      base_iterator<Other<Side>> result(map_p, other_root, root);
+      if (!path.empty()) {
+        result.seek(*path.back()->value);
+      }
+      return result;
+    }
+
+    friend bool operator==(base_iterator const& a, base_iterator const& b) {
+      return a.path.empty() ? b.path.empty()
+                            : !b.path.empty() && a.path.back() == b.path.back();
+    }
+    friend bool operator!=(base_iterator const& a, base_iterator const& b) {
+      return !(a == b);
+    }
+
+  private:
+    persistent_bimap const* map_p{nullptr};
+    node_ptr root;       // keeps the version alive
+    node_ptr other_root; // for flip
+    std::vector<node const*> path; // from the root to the current node
+
+    base_iterator(persistent_bimap const* p, node_ptr root, node_ptr other_root)
+        : map_p(p), root(std::move(root)), other_root(std::move(other_root)) {}
+
+    template <node_ptr node::*Child>
+    void descend() {
+      while (path.back()->*Child) {
+        path.push_back((path.back()->*Child).get());
+      }
+    }
+
+    // climbs while coming out of a Child subtree
+    template <node_ptr node::*Child>
+    void ascend() {
+      node const* child = path.back();
+      path.pop_back();
+      while (!path.empty() && (path.back()->*Child).get() == child) {
+        child = path.back();
+        path.pop_back();
+      }
+    }
+
+    // path to the node holding value, which must be in the tree
+    void seek(pair_t const& value) {
+      auto const& cmp = map_p->template comparator<Side>();
+      node const* n = root.get();
+      for (;;) {
+        path.push_back(n);
+        if (cmp(key<Side>(value), key<Side>(n))) {
+          n = n->left.get();
+        } else if (cmp(key<Side>(n), key<Side>(value))) {
+          n = n->right.get();
+        } else {
+          return;
+        }
+      }
+    }
+  };
+
+  using left_iterator = base_iterator<left_tag>;
+  using right_iterator = base_iterator<right_tag>;
+  template <typename Side>
+  using iterator = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      left_iterator,
+      right_iterator>;
+
+  explicit persistent_bimap(CompareLeft compare_left = CompareLeft(),
+                            CompareRight compare_right = CompareRight())
+      : compare_left(std::move(compare_left)),
+        compare_right(std::move(compare_right)) {}
+
+  // O(1), the copy shares all nodes with this version
+  persistent_bimap snapshot() const {
+    return *this;
+  }
+
+  // false if either key is already present
+  bool insert(left_t const& left, right_t const& right) {
+    if (find_node<left_tag>(left) != nullptr ||
+        find_node<right_tag>(right) != nullptr) {
+      return false;
+    }
+    auto value = std::make_shared<pair_t const>(left, right);
+    node_ptr new_left = insert<left_tag>(left_root, value);
+    node_ptr new_right = insert<right_tag>(right_root, value);
+    left_root = std::move(new_left);
+    right_root = std::move(new_right);
+    ++size_;
+    return true;
+  }
+
+  bool erase_left(left_t const& left) {
+    return erase_key<left_tag>(left);
+  }
+
+  bool erase_right(right_t const& right) {
+    return erase_key<right_tag>(right);
+  }
+
+  left_iterator find_left(left_t const& left) const {
+    return find<left_tag>(left);
+  }
+
+  right_iterator find_right(right_t const& right) const {
+    return find<right_tag>(right);
+  }
+
+  // the reference lives as long as some version holds the pair
+  right_t const& at_left(left_t const& key) const {
+    return at<left_tag>(key);
+  }
+
+  left_t const& at_right(right_t const& key) const {
+    return at<right_tag>(key);
+  }
+
+  left_iterator begin_left() const {
+    return begin<left_tag>();
+  }
+  left_iterator end_left() const {
+    return end<left_tag>();
+  }
+
+  right_iterator begin_right() const {
+    return begin<right_tag>();
+  }
+  right_iterator end_right() const {
+    return end<right_tag>();
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  std::size_t size() const {
+    return size_;
+  }
+
+  friend bool operator==(persistent_bimap const& a, persistent_bimap const& b) {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    if (a.left_root == b.left_root) {
+      return true;
+    }
+    for (auto i = a.begin_left(), j = b.begin_left(); i != a.end_left(); ++i, ++j) {
+      if (*i != *j || *i.flip() != *j.flip()) {
+        return false;
+      }
+    }
+    return true;
+  }
+  friend bool operator!=(persistent_bimap const& a, persistent_bimap const& b) {
+    return !(a == b);
+  }
+
+private:
+  node_ptr left_root;
+  node_ptr right_root;
+  std::size_t size_{0};
+  CompareLeft compare_left;
+  CompareRight compare_right;
+
+  template <typename Side>
+  Comparator<Side> const& comparator() const {
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return compare_left;
+    } else {
+      return compare_right;
+    }
+  }
+
+  template <typename Side>
+  node_ptr const& root() const {
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return left_root;
+    } else {
+      return right_root;
+    }
+  }
+
+  template <typename Side>
+  iterator<Side> begin() const {
+    iterator<Side> it(this, root<Side>(), root<Other<Side>>());
+    if (root<Side>()) {
+      it.path.push_back(root<Side>().get());
+      it.template descend<&node::left>();
+    }
+    return it;
+  }
+
+  template <typename Side>
+  iterator<Side> end() const {
+    return iterator<Side>(this, root<Side>(), root<Other<Side>>());
+  }
+
+  template <typename Side>
+  node const* find_node(key_t<Side> const& key) const {
+    auto const& cmp = comparator<Side>();
+    node const* n = root<Side>().get();
+    while (n != nullptr) {
+      if (cmp(key, persistent_bimap::key<Side>(n))) {
+        n = n->left.get();
+      } else if (cmp(persistent_bimap::key<Side>(n), key)) {
+        n = n->right.get();
+      } else {
+        break;
+      }
+    }
+    return n;
+  }
+
+  template <typename Side>
+  iterator<Side> find(key_t<Side> const& key) const {
+    iterator<Side> it = end<Side>();
+    if (node const* n = find_node<Side>(key)) {
+      it.seek(*n->value);
+    }
+    return it;
+  }
+
+  template <typename Side>
+  key_t<Other<Side>> const& at(key_t<Side> const& key) const {
+    node const* n = find_node<Side>(key);
+    if (n == nullptr) {
+      throw std::out_of_range("No such element");
+    }
+    return persistent_bimap::key<Other<Side>>(n);
+  }
+
+  template <typename Side>
+  bool erase_key(key_t<Side> const& key) {
+    node const* n = find_node<Side>(key);
+    if (n == nullptr) {
+      return false;
+    }
+    std::shared_ptr<pair_t const> value = n->value;
+    node_ptr new_root = erase<Side>(root<Side>(), *value);
+    node_ptr new_other = erase<Other<Side>>(root<Other<Side>>(), *value);
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      left_root = std::move(new_root);
+      right_root = std::move(new_other);
+    } else {
+      right_root = std::move(new_root);
+      left_root = std::move(new_other);
+    }
+    --size_;
+    return true;
+  }
+
+  static int height(node_ptr const& n) noexcept {
+    return n ? n->height : 0;
+  }
+
+  static node_ptr make_node(std::shared_ptr<pair_t const> const& value,
+                            node_ptr left, node_ptr right) {
+    int h = 1 + std::max(height(left), height(right));
+    return std::make_shared<node const>(node{value, std::move(left), std::move(right), h});
+  }
+
+  // new node over subtrees whose heights differ by at most two
+  static node_ptr balance(std::shared_ptr<pair_t const> const& value,
+                          node_ptr left, node_ptr right) {
+    int const hl = height(left);
+    int const hr = height(right);
+    if (hl > hr + 1) {
+      if (height(left->left) >= height(left->right)) {
+        return make_node(left->value, left->left,
+                         make_node(value, left->right, std::move(right)));
+      }
+      node const* lr = left->right.get();
+      return make_node(lr->value, make_node(left->value, left->left, lr->left),
+                       make_node(value, lr->right, std::move(right)));
+    }
+    if (hr > hl + 1) {
+      if (height(right->right) >= height(right->left)) {
+        return make_node(right->value, make_node(value, std::move(left), right->left),
+                         right->right);
+      }
+      node const* rl = right->left.get();
+      return make_node(rl->value, make_node(value, std::move(left), rl->left),
+                       make_node(right->value, rl->right, right->right));
+    }
+    return make_node(value, std::move(left), std::move(right));
+  }
+
+  // value's key must not be in the tree
+  template <typename Side>
+  node_ptr insert(node_ptr const& t, std::shared_ptr<pair_t const> const& value) const {
+    if (!t) {
+      return make_node(value, nullptr, nullptr);
+    }
+    if (comparator<Side>()(key<Side>(*value), key<Side>(t.get()))) {
+      return balance(t->value, insert<Side>(t->left, value), t->right);
+    }
+    return balance(t->value, t->left, insert<Side>(t->right, value));
+  }
+
+  // value's key must be in the tree
+  template <typename Side>
+  node_ptr erase(node_ptr const& t, pair_t const& value) const {
+    auto const& cmp = comparator<Side>();
+    if (cmp(key<Side>(value), key<Side>(t.get()))) {
+      return balance(t->value, erase<Side>(t->left, value), t->right);
+    }
+    if (cmp(key<Side>(t.get()), key<Side>(value))) {
+      return balance(t->value, t->left, erase<Side>(t->right, value));
+    }
+    if (!t->left) {
+      return t->right;
+    }
+    if (!t->right) {
+      return t->left;
+    }
+    node const* successor = t->right.get();
+    while (successor->left) {
+      successor = successor->left.get();
+    }
+    return balance(successor->value, t->left, erase_min(t->right));
+  }
+
+  static node_ptr erase_min(node_ptr const& t) {
+    if (!t->left) {
+      return t->right;
+    }
+    return balance(t->value, erase_min(t->left), t->right);
+  }
+};
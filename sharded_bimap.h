@@ -0,0 +1,379 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "bimap.h"
+
+// bimap split into N independently locked shards for write-heavy use from
+// many threads. A pair is one node linked into the left tree of the shard
+// its left key hashes to and into the right tree of the shard its right
+// key hashes to, so both lookups lock one shard. Insertion locks the (at
+// most two) shards owning its keys and checks both for duplicates before
+// linking, which keeps both sides unique across shards.
+//
+// With MergedIteration, begin_left/begin_right walk all shards in key
+// order by merging them, O(N) per step. Iterators are only valid while the
+// guard from lock_shared() is held.
+template <typename Left, typename Right, std::size_t N,
+          typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>,
+          typename HashLeft = std::hash<Left>,
+          typename HashRight = std::hash<Right>,
+          bool MergedIteration = false>
+struct sharded_bimap {
+  static_assert(N > 0, "sharded_bimap needs at least one shard");
+
+  using left_t = Left;
+  using right_t = Right;
+
+private:
+  template <typename Side>
+  using key_t = std::conditional_t<std::is_same_v<Side, left_tag>, left_t, right_t>;
+  template <typename Side>
+  using Comparator =
+      std::conditional_t<std::is_same_v<Side, left_tag>, CompareLeft, CompareRight>;
+  template <typename Side>
+  using hook_type = prefix_hook<tree_element<Side>, Comparator<Side>>;
+
+  struct node : hook_type<left_tag>, hook_type<right_tag> {
+    node(left_t const& left, right_t const& right) : lr(left, right) {
+      if constexpr (has_key_prefix_v<CompareLeft>) {
+        static_cast<hook_type<left_tag>&>(*this).key_prefix = CompareLeft::prefix(lr.first);
+      }
+      if constexpr (has_key_prefix_v<CompareRight>) {
+        static_cast<hook_type<right_tag>&>(*this).key_prefix = CompareRight::prefix(lr.second);
+      }
+    }
+
+    template <typename Side>
+    auto key_prefix() const noexcept {
+      return static_cast<hook_type<Side> const&>(*this).key_prefix;
+    }
+
+    template <typename Side>
+    key_t<Side> const& key() const {
+      if constexpr (std::is_same_v<Side, left_tag>) {
+        return lr.first;
+      } else {
+        return lr.second;
+      }
+    }
+
+    std::pair<left_t, right_t> lr;
+  };
+
+  template <typename Side>
+  using tree_type = intr_tree<node, Side, key_t<Side>, Comparator<Side>>;
+
+  struct alignas(64) shard {
+    mutable std::shared_mutex mutex;
+    tree_type<left_tag> by_left;   // pairs whose left key is owned by this shard
+    tree_type<right_tag> by_right; // pairs whose right key is owned by this shard
+    std::size_t count{0};          // pairs in by_left
+  };
+
+  template <typename Side>
+  struct merged_iterator {
+    friend sharded_bimap;
+    using shard_iterator = typename tree_type<Side>::iterator;
+    using iterator_category = std::forward_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = key_t<Side>;
+    using pointer = value_type const*;
+    using reference = value_type const&;
+
+    merged_iterator() = default;
+
+    reference operator*() const {
+      return cur[min]->template key<Side>();
+    }
+    pointer operator->() const {
+      return &**this;
+    }
+
+    // key paired with the current one
+    key_t<Other<Side>> const& paired() const {
+      return cur[min]->template key<Other<Side>>();
+    }
+
+    merged_iterator& operator++() {
+      ++cur[min];
+      select();
+      return *this;
+    }
+    merged_iterator operator++(int) {
+      merged_iterator tmp(*this);
+      ++*this;
+      return tmp;
+    }
+
+    friend bool operator==(merged_iterator const& a, merged_iterator const& b) {
+      return a.min == b.min && (a.min == N || a.cur[a.min] == b.cur[b.min]);
+    }
+    friend bool operator!=(merged_iterator const& a, merged_iterator const& b) {
+      return !(a == b);
+    }
+
+  private:
+    std::array<shard_iterator, N> cur{};
+    std::array<shard_iterator, N> end{};
+    Comparator<Side> const* cmp{nullptr};
+    std::size_t min{N}; // shard holding the current key, N at the end
+
+    void select() {
+      min = N;
+      for (std::size_t i = 0; i < N; ++i) {
+        if (cur[i] != end[i] &&
+            (min == N || (*cmp)(cur[i]->template key<Side>(), cur[min]->template key<Side>()))) {
+          min = i;
+        }
+      }
+    }
+  };
+
+public:
+  using left_iterator = merged_iterator<left_tag>;
+  using right_iterator = merged_iterator<right_tag>;
+
+  explicit sharded_bimap(CompareLeft compare_left = CompareLeft(),
+                         CompareRight compare_right = CompareRight(),
+                         HashLeft hash_left = HashLeft(),
+                         HashRight hash_right = HashRight())
+      : compare_left(compare_left), compare_right(compare_right),
+        hash_left(hash_left), hash_right(hash_right) {
+    // trees only copy their comparator
+    tree_type<left_tag> const left_proto(compare_left);
+    tree_type<right_tag> const right_proto(compare_right);
+    for (auto& s : shards) {
+      s.by_left = left_proto;
+      s.by_right = right_proto;
+    }
+  }
+
+  sharded_bimap(sharded_bimap const&) = delete;
+  sharded_bimap& operator=(sharded_bimap const&) = delete;
+
+  // a node may sit in the right tree of another shard than its left one,
+  // so every right tree lets go before the nodes are freed
+  ~sharded_bimap() {
+    for (auto& s : shards) {
+      s.by_right.release();
+    }
+    for (auto& s : shards) {
+      s.by_left.clear_and_dispose([](node* n) noexcept {
+        tree_type<right_tag>::unhook(*n);
+        delete n;
+      });
+    }
+  }
+
+  // false if either key is already present
+  bool insert(left_t const& left, right_t const& right) {
+    shard& ls = left_shard(left);
+    shard& rs = right_shard(right);
+    auto lock = lock_pair(ls, rs);
+    auto left_pos = ls.by_left.find_insert_position(left);
+    if (left_pos.found != ls.by_left.end()) {
+      return false;
+    }
+    auto right_pos = rs.by_right.find_insert_position(right);
+    if (right_pos.found != rs.by_right.end()) {
+      return false;
+    }
+    node* n = new node(left, right);
+    ls.by_left.insert_at(left_pos, *n);
+    rs.by_right.insert_at(right_pos, *n);
+    ++ls.count;
+    return true;
+  }
+
+  bool erase_left(left_t const& left) {
+    return erase<left_tag>(left);
+  }
+
+  bool erase_right(right_t const& right) {
+    return erase<right_tag>(right);
+  }
+
+  std::optional<right_t> find_left(left_t const& left) const {
+    return find<left_tag>(left);
+  }
+
+  std::optional<left_t> find_right(right_t const& right) const {
+    return find<right_tag>(right);
+  }
+
+  right_t at_left(left_t const& key) const {
+    auto right = find_left(key);
+    if (!right) {
+      throw std::out_of_range("No such element");
+    }
+    return *right;
+  }
+
+  left_t at_right(right_t const& key) const {
+    auto left = find_right(key);
+    if (!left) {
+      throw std::out_of_range("No such element");
+    }
+    return *left;
+  }
+
+  // sum over the shards, exact only without concurrent writers
+  std::size_t size() const {
+    std::size_t result = 0;
+    for (auto const& s : shards) {
+      std::shared_lock<std::shared_mutex> lock(s.mutex);
+      result += s.count;
+    }
+    return result;
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  // shared locks on all shards, in shard order
+  std::array<std::shared_lock<std::shared_mutex>, N> lock_shared() const {
+    std::array<std::shared_lock<std::shared_mutex>, N> locks;
+    for (std::size_t i = 0; i < N; ++i) {
+      locks[i] = std::shared_lock<std::shared_mutex>(shards[i].mutex);
+    }
+    return locks;
+  }
+
+  template <bool M = MergedIteration, typename = std::enable_if_t<M>>
+  left_iterator begin_left() const {
+    return merged_begin<left_tag>(compare_left);
+  }
+  template <bool M = MergedIteration, typename = std::enable_if_t<M>>
+  left_iterator end_left() const {
+    return left_iterator();
+  }
+
+  template <bool M = MergedIteration, typename = std::enable_if_t<M>>
+  right_iterator begin_right() const {
+    return merged_begin<right_tag>(compare_right);
+  }
+  template <bool M = MergedIteration, typename = std::enable_if_t<M>>
+  right_iterator end_right() const {
+    return right_iterator();
+  }
+
+private:
+  std::array<shard, N> shards;
+  CompareLeft compare_left;
+  CompareRight compare_right;
+  HashLeft hash_left;
+  HashRight hash_right;
+
+  shard& left_shard(left_t const& left) {
+    return shards[hash_left(left) % N];
+  }
+  shard const& left_shard(left_t const& left) const {
+    return shards[hash_left(left) % N];
+  }
+  shard& right_shard(right_t const& right) {
+    return shards[hash_right(right) % N];
+  }
+  shard const& right_shard(right_t const& right) const {
+    return shards[hash_right(right) % N];
+  }
+
+  // exclusive locks on both shards, taken without deadlocking
+  static std::pair<std::unique_lock<std::shared_mutex>, std::unique_lock<std::shared_mutex>>
+  lock_pair(shard& a, shard& b) {
+    std::pair<std::unique_lock<std::shared_mutex>, std::unique_lock<std::shared_mutex>> locks;
+    if (&a == &b) {
+      locks.first = std::unique_lock<std::shared_mutex>(a.mutex);
+    } else {
+      locks.first = std::unique_lock<std::shared_mutex>(a.mutex, std::defer_lock);
+      locks.second = std::unique_lock<std::shared_mutex>(b.mutex, std::defer_lock);
+      std::lock(locks.first, locks.second);
+    }
+    return locks;
+  }
+
+  template <typename Side>
+  shard& shard_of(key_t<Side> const& key) {
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return left_shard(key);
+    } else {
+      return right_shard(key);
+    }
+  }
+  template <typename Side>
+  shard const& shard_of(key_t<Side> const& key) const {
+    return const_cast<sharded_bimap&>(*this).shard_of<Side>(key);
+  }
+
+  template <typename Side>
+  static tree_type<Side>& tree(shard& s) {
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return s.by_left;
+    } else {
+      return s.by_right;
+    }
+  }
+  template <typename Side>
+  static tree_type<Side> const& tree(shard const& s) {
+    return tree<Side>(const_cast<shard&>(s));
+  }
+
+  template <typename Side>
+  std::optional<key_t<Other<Side>>> find(key_t<Side> const& key) const {
+    shard const& s = shard_of<Side>(key);
+    std::shared_lock<std::shared_mutex> lock(s.mutex);
+    auto it = tree<Side>(s).find(key);
+    if (it == tree<Side>(s).end()) {
+      return std::nullopt;
+    }
+    return it->template key<Other<Side>>();
+  }
+
+  template <typename Side>
+  bool erase(key_t<Side> const& key) {
+    shard& s = shard_of<Side>(key);
+    for (;;) {
+      std::optional<key_t<Other<Side>>> other = find<Side>(key);
+      if (!other) {
+        return false;
+      }
+      shard& os = shard_of<Other<Side>>(*other);
+      auto lock = lock_pair(s, os);
+      // the pair may have been replaced while no lock was held
+      auto it = tree<Side>(s).find(key);
+      if (it == tree<Side>(s).end()) {
+        return false;
+      }
+      node& n = *it;
+      if (&shard_of<Other<Side>>(n.template key<Other<Side>>()) == &os) {
+        tree<Side>(s).unlink(n);
+        tree<Other<Side>>(os).unlink(n);
+        --(std::is_same_v<Side, left_tag> ? s : os).count;
+        delete &n;
+        return true;
+      }
+    }
+  }
+
+  template <typename Side>
+  merged_iterator<Side> merged_begin(Comparator<Side> const& cmp) const {
+    merged_iterator<Side> it;
+    it.cmp = &cmp;
+    for (std::size_t i = 0; i < N; ++i) {
+      it.cur[i] = tree<Side>(shards[i]).begin();
+      it.end[i] = tree<Side>(shards[i]).end();
+    }
+    it.select();
+    return it;
+  }
+};
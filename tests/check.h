@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+// Checks that stay on in release builds. CHECK reports a failure and goes
+// on, REQUIRE stops the test program, for conditions the rest relies on;
+// test_result() is the exit status of main.
+
+inline int& check_failures() {
+  static int failures = 0;
+  return failures;
+}
+
+inline bool check_report(bool ok, char const* what, char const* file, int line) {
+  if (!ok) {
+    std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+    ++check_failures();
+  }
+  return ok;
+}
+
+inline int test_result() {
+  if (check_failures() != 0) {
+    std::fprintf(stderr, "%d checks failed\n", check_failures());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+#define CHECK(cond) check_report(static_cast<bool>(cond), #cond, __FILE__, __LINE__)
+
+#define REQUIRE(cond)          \
+  do {                         \
+    if (!CHECK(cond)) {        \
+      std::exit(test_result()); \
+    }                          \
+  } while (false)
+
+#define CHECK_THROWS(expr, exception)                                          \
+  do {                                                                         \
+    bool thrown = false;                                                       \
+    try {                                                                      \
+      (void)(expr);                                                            \
+    } catch (exception const&) {                                               \
+      thrown = true;                                                           \
+    }                                                                          \
+    check_report(thrown, #expr " throws " #exception, __FILE__, __LINE__);     \
+  } while (false)
@@ -0,0 +1,241 @@
+// Checks of the multi-threaded containers and builders: concurrent_bimap
+// readers racing a writer, sharded_bimap writers racing each other, the
+// background bimap_builder and the parallel bulk constructors, each
+// against the map the sequential path builds.
+
+#include <atomic>
+#include <future>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "bimap.h"
+#include "bimap_builder.h"
+#include "concurrent_bimap.h"
+#include "flat_bimap.h"
+#include "node_pool.h"
+#include "reference.h"
+#include "sharded_bimap.h"
+
+namespace {
+
+void concurrent_readers_see_consistent_maps() {
+  concurrent_bimap<int, int> m;
+  std::atomic<bool> stop{false};
+  std::atomic<bool> consistent{true};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&] {
+      while (!stop.load()) {
+        for (int k = 0; k < 200; ++k) {
+          auto right = m.find_left(k);
+          if (right && *right != k + 1000) {
+            consistent = false;
+          }
+          auto left = m.find_right(k + 1000);
+          if (left && *left != k) {
+            consistent = false;
+          }
+        }
+        m.read([&](auto const& b) {
+          std::size_t n = 0;
+          for (auto it = b.begin_left(); it != b.end_left(); ++it, ++n) {
+            if (*it.flip() != *it + 1000) {
+              consistent = false;
+            }
+          }
+          if (n != b.size() || !b.verify()) {
+            consistent = false;
+          }
+        });
+      }
+    });
+  }
+  for (int round = 0; round < 2000; ++round) {
+    int const k = round % 200;
+    if (round / 200 % 2 == 0) {
+      CHECK(m.insert(k, k + 1000));
+    } else {
+      CHECK(m.erase_left(k));
+    }
+  }
+  m.modify([](auto& b) { b.insert(500, 1500); });
+  stop = true;
+  for (auto& t : readers) {
+    t.join();
+  }
+  CHECK(consistent);
+  CHECK(m.size() == 1u);
+  CHECK(m.at_left(500) == 1500);
+  CHECK_THROWS(m.at_right(3), std::out_of_range);
+}
+
+void sharded_writers_keep_both_sides_unique() {
+  sharded_bimap<int, int, 8, std::less<int>, std::less<int>, std::hash<int>, std::hash<int>,
+                true>
+      m;
+  // threads race to claim the same rights, each is taken exactly once
+  std::atomic<int> won{0};
+  std::vector<std::thread> writers;
+  for (int t = 0; t < 8; ++t) {
+    writers.emplace_back([&, t] {
+      for (int i = 0; i < 2000; ++i) {
+        won += m.insert(t * 100000 + i, i);
+      }
+    });
+  }
+  for (auto& t : writers) {
+    t.join();
+  }
+  CHECK(won == 2000);
+  REQUIRE(m.size() == 2000u);
+  std::map<int, int> ref;
+  for (int r = 0; r < 2000; ++r) {
+    int const l = m.at_right(r);
+    CHECK(m.at_left(l) == r);
+    ref.emplace(l, r);
+  }
+  {
+    auto guard = m.lock_shared();
+    auto it = m.begin_left();
+    for (auto const& [l, r] : ref) {
+      REQUIRE(it != m.end_left());
+      CHECK(*it == l);
+      CHECK(it.paired() == r);
+      ++it;
+    }
+    CHECK(it == m.end_left());
+    int expected = 0;
+    for (auto jt = m.begin_right(); jt != m.end_right(); ++jt) {
+      CHECK(*jt == expected++);
+    }
+  }
+  writers.clear();
+  for (int t = 0; t < 4; ++t) {
+    writers.emplace_back([&, t] {
+      for (int r = t; r < 2000; r += 4) {
+        if (r % 2 != 0) {
+          m.erase_right(r);
+        } else {
+          m.erase_left(m.at_right(r));
+        }
+      }
+    });
+  }
+  for (auto& t : writers) {
+    t.join();
+  }
+  CHECK(m.empty());
+}
+
+// the first pair of each left wins, then the first of each right
+template <typename Map>
+Map sequential_build(std::vector<std::pair<int, int>> const& pairs) {
+  std::map<int, int> firsts;
+  for (auto const& [l, r] : pairs) {
+    firsts.emplace(l, r);
+  }
+  return Map(sorted_unique, firsts.begin(), firsts.end());
+}
+
+void bimap_builder_matches_the_sequential_build() {
+  key_source keys(51, 15000);
+  for (std::size_t chunk : {1u, 7u, 100u, 1000u, 100000u}) {
+    std::vector<std::pair<int, int>> pairs;
+    for (int i = 0; i < 20000; ++i) {
+      pairs.emplace_back(keys(), keys());
+    }
+    bimap_builder<bimap<int, int>> tree_builder(chunk);
+    bimap_builder<flat_bimap<int, int>> flat_builder(chunk);
+    for (auto const& [l, r] : pairs) {
+      tree_builder.push(l, r);
+      flat_builder.push(l, r);
+    }
+    CHECK(tree_builder.pushed() == pairs.size());
+    bimap<int, int> tree = tree_builder.finish().get();
+    CHECK(tree.verify());
+    CHECK((tree == sequential_build<bimap<int, int>>(pairs)));
+    flat_bimap<int, int> const flat = flat_builder.finish().get();
+    CHECK((flat == sequential_build<flat_bimap<int, int>>(pairs)));
+  }
+}
+
+void bimap_builder_finish_rules() {
+  bimap_builder<bimap<int, int>> empty(10);
+  CHECK(empty.finish().get().empty());
+  CHECK_THROWS(empty.push(1, 2), std::logic_error);
+  {
+    // abandoned with spilled runs
+    bimap_builder<bimap<int, int>> abandoned(10);
+    for (int i = 0; i < 95; ++i) {
+      abandoned.push(i, i);
+    }
+  }
+  std::future<bimap<int, int>> result;
+  {
+    bimap_builder<bimap<int, int>> b(10);
+    for (int i = 0; i < 95; ++i) {
+      b.push(i, -i);
+    }
+    result = b.finish();
+  }
+  CHECK(result.get().size() == 95u);
+
+  concurrent_bimap<int, int> published;
+  published.insert(1, 1);
+  bimap_builder<bimap<int, int>> b;
+  for (int i = 0; i < 1000; ++i) {
+    b.push(i, -i);
+  }
+  published.assign(b.finish().get());
+  CHECK(published.size() == 1000u);
+  CHECK(*published.find_left(5) == -5);
+}
+
+void parallel_build_matches_the_sequential_build() {
+  using counted_map = bimap<int, int, std::less<int>, std::less<int>,
+                            std::allocator<std::pair<int, int>>, true>;
+  using pooled_map =
+      bimap<int, int, std::less<int>, std::less<int>, pool_allocator<std::pair<int, int>>>;
+  key_source keys(52, 1);
+  for (int n : {0, 1, 100, 50000}) {
+    keys.range = n + 1;
+    std::vector<std::pair<int, int>> pairs;
+    for (int i = 0; i < n; ++i) {
+      pairs.emplace_back(keys(), keys());
+    }
+    bimap<int, int> const sequential(pairs.begin(), pairs.end());
+    for (unsigned threads : {1u, 2u, 3u, 8u}) {
+      bimap<int, int> built(parallel_t{threads}, pairs.begin(), pairs.end());
+      CHECK(built.verify());
+      CHECK(built == sequential);
+      bimap<int, int> copied(parallel_t{threads}, built);
+      CHECK(copied.verify());
+      CHECK(copied == sequential);
+
+      counted_map counted(parallel_t{threads}, pairs.begin(), pairs.end());
+      CHECK(counted.verify());
+      for (std::size_t i = 0; i < counted.size(); i += 97) {
+        CHECK(*counted.nth_left(i) == *std::next(sequential.begin_left(), i));
+      }
+      pooled_map pooled(parallel_t{threads}, pairs.begin(), pairs.end());
+      CHECK(pooled.verify());
+      CHECK(pooled.size() == sequential.size());
+    }
+  }
+}
+
+} // namespace
+
+int main() {
+  concurrent_readers_see_consistent_maps();
+  sharded_writers_keep_both_sides_unique();
+  bimap_builder_matches_the_sequential_build();
+  bimap_builder_finish_rules();
+  parallel_build_matches_the_sequential_build();
+  return test_result();
+}
@@ -0,0 +1,474 @@
+// Randomized checks of the other storage engines against std::map models:
+// flat_bimap, its range erase and its vectorized search, the batched
+// lookups, compact_bimap, persistent_bimap with its snapshots,
+// unordered_bimap and the mapped_bimap file format.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "bimap.h"
+#include "compact_bimap.h"
+#include "flat_bimap.h"
+#include "flat_search.h"
+#include "key_prefix.h"
+#include "mapped_bimap.h"
+#include "node_pool.h"
+#include "persistent_bimap.h"
+#include "reference.h"
+#include "unordered_bimap.h"
+
+namespace {
+
+// inserts and erasures through the interface every engine shares
+template <typename Map, typename Check>
+void run_random_operations(unsigned seed, int steps, Check check) {
+  key_source keys(seed, 200);
+  Map m;
+  reference_bimap ref;
+  for (int step = 0; step < steps; ++step) {
+    int const l = keys();
+    int const r = keys();
+    switch (keys.below(6)) {
+      case 0:
+      case 1:
+      case 2: {
+        bool const expected = ref.insert(l, r);
+        if constexpr (std::is_same_v<decltype(m.insert(l, r)), bool>) {
+          REQUIRE(m.insert(l, r) == expected);
+        } else {
+          REQUIRE(inserted(m, l, r) == expected);
+        }
+        break;
+      }
+      case 3:
+        REQUIRE(m.erase_left(l) == ref.erase_left(l));
+        break;
+      case 4:
+        REQUIRE(m.erase_right(r) == ref.erase_right(r));
+        break;
+      default:
+        REQUIRE((m.find_left(l) != m.end_left()) == (ref.left.count(l) != 0));
+        REQUIRE((m.find_right(r) != m.end_right()) == (ref.right.count(r) != 0));
+        break;
+    }
+    if (step % 250 == 0) {
+      check(m, ref);
+    }
+  }
+  check(m, ref);
+  Map copy(m);
+  check(copy, ref);
+  CHECK(copy == m);
+  CHECK_THROWS(m.at_left(1000), std::out_of_range);
+}
+
+auto const ordered_check = [](auto const& m, reference_bimap const& ref) {
+  expect_same_pairs(m, ref);
+};
+
+void flat_bimap_random_operations_match_std_map() {
+  run_random_operations<flat_bimap<int, int>>(31, 5000, ordered_check);
+}
+
+void flat_bimap_range_erase_and_defaults() {
+  key_source keys(32, 60);
+  flat_bimap<int, int> m;
+  reference_bimap ref;
+  for (int step = 0; step < 4000; ++step) {
+    int const a = keys();
+    int const b = keys();
+    switch (keys.below(4)) {
+      case 0:
+      case 1:
+        REQUIRE(inserted(m, a, b) == ref.insert(a, b));
+        break;
+      case 2: {
+        int const hi = std::max(a, b);
+        m.erase_right(m.lower_bound_right(a), m.lower_bound_right(hi));
+        for (auto it = ref.right.lower_bound(a); it != ref.right.end() && it->first < hi;) {
+          ref.left.erase(it->second);
+          it = ref.right.erase(it);
+        }
+        break;
+      }
+      default:
+        REQUIRE(m.at_left_or_default(a) == ref.at_left_or_default(a));
+        REQUIRE(m.at_right_or_default(b) == ref.at_right_or_default(b));
+        break;
+    }
+    if (step % 100 == 0) {
+      expect_same_pairs(m, ref);
+    }
+  }
+  std::vector<std::pair<int, int>> sorted(ref.left.begin(), ref.left.end());
+  flat_bimap<int, int> bulk(sorted_unique, sorted.begin(), sorted.end());
+  expect_same_pairs(bulk, ref);
+  CHECK(bulk == m);
+  auto it = bulk.begin_left();
+  CHECK((bulk.end_left() - it) == static_cast<std::ptrdiff_t>(ref.size()));
+}
+
+template <typename T>
+void expect_vectorized_search_matches(std::mt19937_64& rng) {
+  T const lowest = std::numeric_limits<T>::min();
+  T const highest = std::numeric_limits<T>::max();
+  for (int round = 0; round < 200; ++round) {
+    std::vector<T> v(rng() % 200);
+    for (auto& x : v) {
+      x = rng() % 3 == 0 ? (rng() % 2 ? highest : lowest) : static_cast<T>(rng() % 100) - T(50);
+    }
+    std::sort(v.begin(), v.end());
+    for (int q = 0; q < 100; ++q) {
+      T const k = q < 2 ? (q == 0 ? lowest : highest) : static_cast<T>(rng() % 120) - T(60);
+      CHECK(flat_search::lower_bound(v.begin(), v.end(), k, std::less<T>()) == std::lower_bound(v.begin(), v.end(), k));
+      CHECK(flat_search::upper_bound(v.begin(), v.end(), k, std::less<>()) == std::upper_bound(v.begin(), v.end(), k));
+    }
+  }
+}
+
+void flat_search_matches_std_bounds() {
+  std::mt19937_64 rng(33);
+  expect_vectorized_search_matches<std::int32_t>(rng);
+  expect_vectorized_search_matches<std::uint32_t>(rng);
+  expect_vectorized_search_matches<std::int64_t>(rng);
+  expect_vectorized_search_matches<std::uint64_t>(rng);
+}
+
+template <typename Map>
+void expect_batches_match(Map const& m, std::vector<int> const& keys) {
+  std::vector<typename Map::left_iterator> found;
+  m.find_left_batch(keys.begin(), keys.end(), std::back_inserter(found));
+  REQUIRE(found.size() == keys.size());
+  std::vector<typename Map::right_iterator> found_right(keys.size());
+  CHECK(m.find_right_batch(keys.begin(), keys.end(), found_right.begin()) == found_right.end());
+  std::vector<int> present;
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    CHECK(found[i] == m.find_left(keys[i]));
+    CHECK(found_right[i] == m.find_right(keys[i]));
+    if (found[i] != m.end_left()) {
+      present.push_back(keys[i]);
+    }
+  }
+  std::vector<int> values;
+  m.at_left_batch(present.begin(), present.end(), std::back_inserter(values));
+  REQUIRE(values.size() == present.size());
+  for (std::size_t i = 0; i < present.size(); ++i) {
+    CHECK(values[i] == m.at_left(present[i]));
+  }
+  if (present.size() != keys.size()) {
+    CHECK_THROWS(m.at_left_batch(keys.begin(), keys.end(), std::back_inserter(values)), std::out_of_range);
+  }
+}
+
+void batch_lookups_match_single_lookups() {
+  key_source keys(34, 5000);
+  bimap<int, int> tree;
+  flat_bimap<int, int> flat;
+  for (int i = 0; i < 3000; ++i) {
+    int const l = keys();
+    int const r = keys();
+    tree.insert(l, r);
+    flat.insert(l, r);
+  }
+  std::vector<int> queries(1000);
+  for (auto& q : queries) {
+    q = keys();
+  }
+  expect_batches_match(tree, queries);
+  expect_batches_match(flat, queries);
+  expect_batches_match(bimap<int, int>(), queries);
+}
+
+void batch_lookups_count_like_single_lookups() {
+  using stats_map = bimap<std::string, int, prefix_compare<std::less<std::string>>,
+                          std::less<int>, std::allocator<std::pair<std::string, int>>, false,
+                          tree_stats>;
+  key_source keys(41, 3000);
+  stats_map m;
+  std::vector<std::string> queries;
+  for (int i = 0; i < 2000; ++i) {
+    // half of the keys share a prefix longer than the cached one
+    std::string const n = std::to_string(keys());
+    std::string const key = i % 2 == 0 ? "shared-prefix-" + n : n + "-tail";
+    m.insert(key, i);
+    queries.push_back(key + (i % 3 == 0 ? "x" : ""));
+  }
+  m.reset_stats();
+  for (auto const& q : queries) {
+    m.find_left(q);
+  }
+  tree_stats const single = m.stats();
+  m.reset_stats();
+  std::vector<stats_map::left_iterator> found;
+  m.find_left_batch(queries.begin(), queries.end(), std::back_inserter(found));
+  tree_stats const batched = m.stats();
+  CHECK(batched.descents == queries.size());
+  CHECK(batched.comparisons == single.comparisons);
+  CHECK(std::equal(std::begin(batched.depth_histogram), std::end(batched.depth_histogram),
+                   std::begin(single.depth_histogram)));
+
+  stats_map empty;
+  empty.find_left_batch(queries.begin(), queries.end(), std::back_inserter(found));
+  CHECK(empty.stats().descents == queries.size());
+}
+
+void compact_bimap_random_operations_match_std_map() {
+  run_random_operations<compact_bimap<std::uint32_t, std::uint32_t>>(
+      35, 20000, [](auto const& m, reference_bimap const& ref) {
+        REQUIRE(m.verify());
+        REQUIRE(m.size() == ref.size());
+        auto it = m.begin_left();
+        for (auto const& [l, r] : ref.left) {
+          CHECK(*it == static_cast<std::uint32_t>(l));
+          CHECK(*it.flip() == static_cast<std::uint32_t>(r));
+          ++it;
+        }
+        CHECK(it == m.end_left());
+        auto jt = m.begin_right();
+        for (auto const& [r, l] : ref.right) {
+          CHECK(*jt == static_cast<std::uint32_t>(r));
+          CHECK(*jt.flip() == static_cast<std::uint32_t>(l));
+          ++jt;
+        }
+        CHECK(jt == m.end_right());
+        // backwards along the threads
+        for (auto kt = ref.right.rbegin(); kt != ref.right.rend(); ++kt) {
+          --jt;
+          CHECK(*jt == static_cast<std::uint32_t>(kt->first));
+        }
+        CHECK(jt == m.begin_right());
+      });
+}
+
+void compact_bimap_grows_across_blocks() {
+  using map_type = compact_bimap<std::uint64_t, std::uint64_t>;
+  // around the first block's doublings and the 64K block boundary
+  for (std::size_t n : {1u, 63u, 64u, 65u, 128u, 65535u, 65536u, 65537u, 150000u}) {
+    map_type m;
+    for (std::uint64_t i = 0; i < n; ++i) {
+      REQUIRE(inserted(m, i * 7 % 1000003, i));
+    }
+    REQUIRE(m.verify());
+    map_type copy(m);
+    CHECK(copy == m);
+    CHECK(copy.verify());
+    for (std::uint64_t i = 0; i < n; i += 97) {
+      CHECK(copy.at_left(i * 7 % 1000003) == i);
+      CHECK(copy.at_right(i) == (i * 7 % 1000003));
+    }
+    for (std::uint64_t i = 0; i < n; i += 2) {
+      REQUIRE(m.erase_right(i));
+    }
+    CHECK(m.verify());
+    CHECK(m.size() == (n / 2));
+    // every other pair by iterator, each erase returning the next one
+    std::size_t left = 0;
+    for (auto it = copy.begin_left(); it != copy.end_left(); ++left) {
+      auto const following = std::next(it);
+      it = copy.erase_left(it);
+      CHECK(it == following);
+      if (it != copy.end_left()) {
+        ++it;
+      }
+    }
+    CHECK(copy.verify());
+    CHECK(copy.size() == n / 2);
+    CHECK(left == (n + 1) / 2);
+  }
+}
+
+void persistent_snapshots_keep_their_pairs() {
+  using map_type = persistent_bimap<int, int>;
+  key_source keys(36, 300);
+  map_type m;
+  reference_bimap ref;
+  std::vector<std::pair<map_type, reference_bimap>> versions;
+  for (int step = 0; step < 6000; ++step) {
+    int const l = keys();
+    int const r = keys();
+    switch (keys.below(3)) {
+      case 0:
+      case 1:
+        REQUIRE(m.insert(l, r) == ref.insert(l, r));
+        break;
+      default:
+        REQUIRE(m.erase_left(l) == ref.erase_left(l));
+        break;
+    }
+    if (step % 500 == 0) {
+      versions.emplace_back(m.snapshot(), ref);
+    }
+  }
+  expect_same_pairs(m, ref);
+  for (auto const& [version, version_ref] : versions) {
+    expect_same_pairs(version, version_ref);
+  }
+  // an iterator pins the version it walks
+  auto it = m.find_left(ref.left.begin()->first);
+  int const key = *it;
+  m.erase_left(key);
+  CHECK(*it == key);
+  CHECK(m.find_left(key) == m.end_left());
+}
+
+template <typename Map>
+void expect_same_unordered_pairs(Map const& m, reference_bimap const& ref) {
+  REQUIRE(m.size() == ref.size());
+  std::size_t n = 0;
+  for (auto it = m.begin_left(); it != m.end_left(); ++it, ++n) {
+    REQUIRE(ref.left.count(*it) == 1u);
+    CHECK(ref.left.at(*it) == *it.flip());
+    CHECK(it.flip().flip() == it);
+  }
+  CHECK(n == ref.size());
+  n = 0;
+  for (auto it = m.begin_right(); it != m.end_right(); ++it, ++n) {
+    REQUIRE(ref.right.count(*it) == 1u);
+    CHECK(ref.right.at(*it) == *it.flip());
+  }
+  CHECK(n == ref.size());
+  for (auto const& [l, r] : ref.left) {
+    CHECK(m.at_left(l) == r);
+    CHECK(m.at_right(r) == l);
+  }
+}
+
+void unordered_bimap_random_operations_match_std_map() {
+  auto const check = [](auto const& m, reference_bimap const& ref) {
+    expect_same_unordered_pairs(m, ref);
+  };
+  run_random_operations<unordered_bimap<int, int>>(37, 20000, check);
+  run_random_operations<unordered_bimap<int, int, std::hash<int>, std::hash<int>,
+                                        std::equal_to<int>, std::equal_to<int>,
+                                        pool_allocator<std::pair<int, int>>>>(38, 20000, check);
+}
+
+void unordered_bimap_defaults_rekey() {
+  key_source keys(39, 100);
+  unordered_bimap<int, int> m;
+  reference_bimap ref;
+  for (int step = 0; step < 5000; ++step) {
+    int const l = keys();
+    int const r = keys();
+    if (keys.below(2) == 0) {
+      REQUIRE(inserted(m, l, r) == ref.insert(l, r));
+    } else if (keys.below(2) == 0) {
+      REQUIRE(m.at_left_or_default(l) == ref.at_left_or_default(l));
+    } else {
+      REQUIRE(m.at_right_or_default(r) == ref.at_right_or_default(r));
+    }
+  }
+  expect_same_unordered_pairs(m, ref);
+}
+
+using aligned_buffer = std::unique_ptr<void, decltype(&std::free)>;
+
+aligned_buffer copy_aligned(std::string const& bytes) {
+  aligned_buffer buffer(std::aligned_alloc(64, (bytes.size() + 63) / 64 * 64), &std::free);
+  std::memcpy(buffer.get(), bytes.data(), bytes.size());
+  return buffer;
+}
+
+void mapped_bimap_serves_the_written_pairs() {
+  key_source keys(40, 1 << 30);
+  bimap<int, int> m;
+  reference_bimap ref;
+  for (int i = 0; i < 10000; ++i) {
+    int const l = keys();
+    int const r = keys();
+    REQUIRE(inserted(m, l, r) == ref.insert(l, r));
+  }
+  std::ostringstream out;
+  write_bimap(out, m);
+  std::string const bytes = out.str();
+  aligned_buffer buffer = copy_aligned(bytes);
+  mapped_bimap<int, int> mapped(buffer.get(), bytes.size());
+  expect_same_pairs(mapped, ref);
+  CHECK((mapped.end_left() - mapped.begin_left()) == static_cast<std::ptrdiff_t>(ref.size()));
+  for (int q = 0; q < 1000; ++q) {
+    int const k = keys();
+    auto lb = ref.right.lower_bound(k);
+    auto it = mapped.lower_bound_right(k);
+    REQUIRE((it == mapped.end_right()) == (lb == ref.right.end()));
+    if (lb != ref.right.end()) {
+      CHECK(*it == lb->first);
+      CHECK(*it.flip() == lb->second);
+    }
+  }
+  CHECK_THROWS(mapped.at_left(-1), std::out_of_range);
+
+  // a flat_bimap writes the same format
+  flat_bimap<int, int> flat;
+  for (auto const& [l, r] : ref.left) {
+    flat.insert(l, r);
+  }
+  std::ostringstream flat_out;
+  write_bimap(flat_out, flat);
+  CHECK(flat_out.str() == bytes);
+}
+
+void mapped_bimap_rejects_bad_images() {
+  flat_bimap<int, int> m;
+  for (int i = 0; i < 100; ++i) {
+    m.insert(i, 1000 - 3 * i);
+  }
+  std::ostringstream out;
+  write_bimap(out, m);
+  std::string const bytes = out.str();
+  aligned_buffer buffer = copy_aligned(bytes);
+  using int_image = mapped_bimap<int, int>;
+  using long_image = mapped_bimap<long, int>;
+  CHECK_THROWS(long_image(buffer.get(), bytes.size()), std::runtime_error);
+  CHECK_THROWS(int_image(buffer.get(), bytes.size() - 1), std::runtime_error);
+  static_cast<char*>(buffer.get())[0] = 'X';
+  CHECK_THROWS(int_image(buffer.get(), bytes.size()), std::runtime_error);
+
+  // index entries past the keys, or not the inverse of the other side's
+  bimap_file_header const header = bimap_file_layout(100, sizeof(int), sizeof(int));
+  for (std::uint32_t const bad : {100u, 0xffffffffu, 7u}) {
+    aligned_buffer corrupt = copy_aligned(bytes);
+    auto* left_other = reinterpret_cast<std::uint32_t*>(
+        static_cast<char*>(corrupt.get()) + header.left_other);
+    left_other[3] = bad;
+    CHECK_THROWS(int_image(corrupt.get(), bytes.size()), std::runtime_error);
+  }
+
+  std::ostringstream empty_out;
+  write_bimap(empty_out, bimap<int, int>());
+  std::string const empty_bytes = empty_out.str();
+  aligned_buffer empty_buffer = copy_aligned(empty_bytes);
+  mapped_bimap<int, int> empty(empty_buffer.get(), empty_bytes.size());
+  CHECK(empty.empty());
+  CHECK(empty.begin_left() == empty.end_left());
+}
+
+} // namespace
+
+int main() {
+  flat_bimap_random_operations_match_std_map();
+  flat_bimap_range_erase_and_defaults();
+  flat_search_matches_std_bounds();
+  batch_lookups_match_single_lookups();
+  batch_lookups_count_like_single_lookups();
+  compact_bimap_random_operations_match_std_map();
+  compact_bimap_grows_across_blocks();
+  persistent_snapshots_keep_their_pairs();
+  unordered_bimap_random_operations_match_std_map();
+  unordered_bimap_defaults_rekey();
+  mapped_bimap_serves_the_written_pairs();
+  mapped_bimap_rejects_bad_images();
+  return test_result();
+}
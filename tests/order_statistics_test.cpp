@@ -0,0 +1,184 @@
+// Randomized checks of the counted trees against sorted std::map keys:
+// rank, select, range counts and random access iterators, including after
+// the mutations that relink subtrees wholesale.
+
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include "bimap.h"
+#include "reference.h"
+
+namespace {
+
+using counted_map = bimap<int, int, std::less<int>, std::less<int>,
+                          std::allocator<std::pair<int, int>>, true>;
+
+void expect_ranks(counted_map const& m, reference_bimap const& ref, key_source& keys) {
+  REQUIRE(m.verify());
+  expect_same_pairs(m, ref);
+  std::size_t i = 0;
+  for (auto const& [l, r] : ref.left) {
+    CHECK(m.rank_left(l) == i);
+    CHECK(*m.nth_left(i) == l);
+    CHECK((m.begin_left() + static_cast<std::ptrdiff_t>(i)) == m.nth_left(i));
+    CHECK((m.nth_left(i) - m.begin_left()) == static_cast<std::ptrdiff_t>(i));
+    CHECK(m.begin_left()[static_cast<std::ptrdiff_t>(i)] == l);
+    ++i;
+  }
+  CHECK(m.nth_left(ref.size()) == m.end_left());
+  i = 0;
+  for (auto const& [r, l] : ref.right) {
+    CHECK(m.rank_right(r) == i);
+    CHECK(*m.nth_right(i) == r);
+    ++i;
+  }
+  for (int q = 0; q < 50; ++q) {
+    int const lo = keys() - 1;
+    int const hi = keys() - 1;
+    std::size_t in_range = 0;
+    std::size_t below = 0;
+    for (auto const& [l, r] : ref.left) {
+      in_range += lo <= l && l <= hi;
+      below += l < lo;
+    }
+    CHECK(m.count_range_left(lo, hi) == in_range);
+    CHECK(m.rank_left(lo) == below);
+    std::size_t right_in_range = 0;
+    for (auto const& [r, l] : ref.right) {
+      right_in_range += lo <= r && r <= hi;
+    }
+    CHECK(m.count_range_right(lo, hi) == right_in_range);
+  }
+}
+
+void ranks_follow_random_operations() {
+  key_source keys(11, 400);
+  for (int round = 0; round < 60; ++round) {
+    counted_map m;
+    reference_bimap ref;
+    for (int i = 0; i < 400; ++i) {
+      int const l = keys();
+      int const r = keys();
+      switch (keys.below(4)) {
+        case 0:
+        case 1:
+          REQUIRE(inserted(m, l, r) == ref.insert(l, r));
+          break;
+        case 2:
+          REQUIRE(m.erase_left(l) == ref.erase_left(l));
+          break;
+        default:
+          REQUIRE(m.erase_right(r) == ref.erase_right(r));
+          break;
+      }
+    }
+    if (round % 3 == 1) {
+      counted_map copy(m);
+      m = std::move(copy);
+    } else if (round % 3 == 2) {
+      std::vector<std::pair<int, int>> sorted(ref.left.begin(), ref.left.end());
+      m = counted_map(sorted_unique, sorted.begin(), sorted.end());
+    }
+    expect_ranks(m, ref, keys);
+  }
+}
+
+void ranks_survive_merge() {
+  key_source keys(12, 2000);
+  for (int round = 0; round < 40; ++round) {
+    counted_map m;
+    counted_map other;
+    reference_bimap ref;
+    reference_bimap other_ref;
+    for (int i = 0; i < 300; ++i) {
+      int const l = keys();
+      int const r = keys();
+      m.insert(l, r);
+      ref.insert(l, r);
+      // disjoint keys in half of the rounds, so every pair of other moves in
+      int const ol = keys() + (round % 2 == 0 ? 2000 : 0);
+      int const orr = keys() + (round % 2 == 0 ? 2000 : 0);
+      if (other_ref.insert(ol, orr)) {
+        other.insert(ol, orr);
+      }
+    }
+    m.merge(other);
+    reference_bimap left_behind;
+    for (auto const& [l, r] : other_ref.left) {
+      if (!ref.insert(l, r)) {
+        left_behind.insert(l, r);
+      }
+    }
+    expect_ranks(m, ref, keys);
+    expect_ranks(other, left_behind, keys);
+  }
+}
+
+void ranks_survive_range_erase() {
+  key_source keys(13, 2000);
+  for (int round = 0; round < 200; ++round) {
+    counted_map m;
+    reference_bimap ref;
+    for (int i = 0; i < 300; ++i) {
+      int const l = keys();
+      int const r = keys();
+      m.insert(l, r);
+      ref.insert(l, r);
+    }
+    // short ranges unlink the right tree, long ones rebuild it
+    int const lo = keys();
+    int const hi = lo + static_cast<int>(keys.below(round % 2 == 0 ? 100 : 2000));
+    m.erase_left(m.lower_bound_left(lo), m.lower_bound_left(hi));
+    for (auto it = ref.left.lower_bound(lo); it != ref.left.lower_bound(hi);) {
+      ref.right.erase(it->second);
+      it = ref.left.erase(it);
+    }
+    expect_ranks(m, ref, keys);
+  }
+}
+
+void ranks_survive_split_and_join() {
+  key_source keys(14, 2000);
+  for (int round = 0; round < 200; ++round) {
+    counted_map m;
+    reference_bimap ref;
+    for (int i = 0; i < 300; ++i) {
+      int const l = keys();
+      int const r = keys();
+      m.insert(l, r);
+      ref.insert(l, r);
+    }
+    int const cut = keys();
+    counted_map tail = m.split_left(cut);
+    reference_bimap tail_ref;
+    for (auto it = ref.left.lower_bound(cut); it != ref.left.end();) {
+      tail_ref.insert(it->first, it->second);
+      ref.right.erase(it->second);
+      it = ref.left.erase(it);
+    }
+    expect_ranks(m, ref, keys);
+    expect_ranks(tail, tail_ref, keys);
+    // either map may be the larger one
+    if (round % 2 == 0) {
+      m.join(std::move(tail));
+    } else {
+      tail.join(std::move(m));
+      m.swap(tail);
+    }
+    for (auto const& [l, r] : tail_ref.left) {
+      ref.insert(l, r);
+    }
+    expect_ranks(m, ref, keys);
+  }
+}
+
+} // namespace
+
+int main() {
+  ranks_follow_random_operations();
+  ranks_survive_merge();
+  ranks_survive_range_erase();
+  ranks_survive_split_and_join();
+  return test_result();
+}
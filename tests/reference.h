@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <random>
+#include <utility>
+
+#include "check.h"
+
+// A bimap modelled by a pair of std::maps, the reference the randomized
+// tests compare every engine against.
+struct reference_bimap {
+  std::map<int, int> left;
+  std::map<int, int> right;
+
+  bool insert(int l, int r) {
+    if (left.count(l) != 0 || right.count(r) != 0) {
+      return false;
+    }
+    left.emplace(l, r);
+    right.emplace(r, l);
+    return true;
+  }
+
+  bool erase_left(int l) {
+    auto it = left.find(l);
+    if (it == left.end()) {
+      return false;
+    }
+    right.erase(it->second);
+    left.erase(it);
+    return true;
+  }
+
+  bool erase_right(int r) {
+    auto it = right.find(r);
+    if (it == right.end()) {
+      return false;
+    }
+    left.erase(it->second);
+    right.erase(it);
+    return true;
+  }
+
+  // what at_left_or_default does to a missing key: pairs it with int(),
+  // evicting the pair that held int() on the right
+  int at_left_or_default(int l) {
+    auto it = left.find(l);
+    if (it != left.end()) {
+      return it->second;
+    }
+    erase_right(0);
+    insert(l, 0);
+    return 0;
+  }
+
+  int at_right_or_default(int r) {
+    auto it = right.find(r);
+    if (it != right.end()) {
+      return it->second;
+    }
+    erase_left(0);
+    insert(0, r);
+    return 0;
+  }
+
+  std::size_t size() const {
+    return left.size();
+  }
+};
+
+// whether m.insert(args...) added a pair; end_left() is read after the
+// insertion, which may move the end of a flat engine
+template <typename Map, typename... Args>
+bool inserted(Map& m, Args&&... args) {
+  auto it = m.insert(std::forward<Args>(args)...);
+  return it != m.end_left();
+}
+
+// both sides of an ordered engine against the reference, through
+// iteration in both directions, flip and the point lookups
+template <typename Map>
+void expect_same_pairs(Map const& m, reference_bimap const& ref) {
+  REQUIRE(m.size() == ref.size());
+  REQUIRE(m.empty() == (ref.size() == 0));
+  auto it = m.begin_left();
+  for (auto const& [l, r] : ref.left) {
+    REQUIRE(it != m.end_left());
+    CHECK(*it == l);
+    CHECK(*it.flip() == r);
+    CHECK(it.flip().flip() == it);
+    ++it;
+  }
+  CHECK(it == m.end_left());
+  auto jt = m.end_right();
+  for (auto r = ref.right.rbegin(); r != ref.right.rend(); ++r) {
+    REQUIRE(jt != m.begin_right());
+    --jt;
+    CHECK(*jt == r->first);
+    CHECK(*jt.flip() == r->second);
+  }
+  CHECK(jt == m.begin_right());
+  CHECK(m.end_left().flip() == m.end_right());
+  CHECK(m.end_right().flip() == m.end_left());
+  for (auto const& [l, r] : ref.left) {
+    CHECK(m.at_left(l) == r);
+    CHECK(m.at_right(r) == l);
+  }
+}
+
+// random keys in [0, range), drawn from a fixed seed
+struct key_source {
+  std::mt19937 rng;
+  int range;
+
+  key_source(unsigned seed, int range) : rng(seed), range(range) {}
+
+  int operator()() {
+    return static_cast<int>(rng() % static_cast<unsigned>(range));
+  }
+
+  unsigned below(unsigned n) {
+    return rng() % n;
+  }
+};
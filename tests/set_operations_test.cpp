@@ -0,0 +1,250 @@
+// Randomized checks of the operations moving many pairs at once against
+// std::map models: merge and the set operations, with and without
+// conflicts between the two maps, range erase, split and join.
+
+#include <map>
+#include <set>
+#include <utility>
+
+#include "bimap.h"
+#include "reference.h"
+
+namespace {
+
+using pair_allocator = std::allocator<std::pair<int, int>>;
+
+using plain_map = bimap<int, int>;
+using counted_map = bimap<int, int, std::less<int>, std::less<int>, pair_allocator, true>;
+
+template <typename Map>
+Map random_map(key_source& keys, int n, reference_bimap& ref) {
+  Map m;
+  for (int i = 0; i < n; ++i) {
+    int const l = keys();
+    int const r = keys();
+    CHECK(inserted(m, l, r) == ref.insert(l, r));
+  }
+  return m;
+}
+
+std::set<std::pair<int, int>> pairs_of(reference_bimap const& ref) {
+  return {ref.left.begin(), ref.left.end()};
+}
+
+reference_bimap model_of(std::set<std::pair<int, int>> const& pairs) {
+  reference_bimap ref;
+  for (auto const& [l, r] : pairs) {
+    ref.insert(l, r);
+  }
+  return ref;
+}
+
+template <typename Map>
+void expect_model(Map const& m, reference_bimap const& ref) {
+  REQUIRE(m.verify());
+  expect_same_pairs(m, ref);
+}
+
+template <typename Map>
+void set_operations_match_std_map() {
+  key_source keys(21, 300);
+  for (int round = 0; round < 300; ++round) {
+    reference_bimap a_ref;
+    reference_bimap b_ref;
+    Map a = random_map<Map>(keys, static_cast<int>(keys.below(200)), a_ref);
+    Map b = random_map<Map>(keys, static_cast<int>(keys.below(round % 3 == 0 ? 5 : 200)), b_ref);
+    if (round % 4 == 0) {
+      // pairs present in both maps
+      for (auto const& [l, r] : a_ref.left) {
+        if (keys.below(2) == 0 && b_ref.insert(l, r)) {
+          b.insert(l, r);
+        }
+      }
+    }
+    auto const a_pairs = pairs_of(a_ref);
+    auto const b_pairs = pairs_of(b_ref);
+
+    // pairs of b that clash with a on one side stay out of the union
+    std::set<std::pair<int, int>> united = a_pairs;
+    std::set<std::pair<int, int>> left_behind;
+    std::size_t conflicts = 0;
+    for (auto const& p : b_pairs) {
+      if (a_pairs.count(p) != 0) {
+        left_behind.insert(p);
+      } else if (a_ref.left.count(p.first) != 0 || a_ref.right.count(p.second) != 0) {
+        left_behind.insert(p);
+        ++conflicts;
+      } else {
+        united.insert(p);
+      }
+    }
+    std::set<std::pair<int, int>> common;
+    std::set<std::pair<int, int>> only_a;
+    for (auto const& p : a_pairs) {
+      (b_pairs.count(p) != 0 ? common : only_a).insert(p);
+    }
+
+    {
+      Map c = a;
+      CHECK(c.union_with(b) == conflicts);
+      expect_model(c, model_of(united));
+    }
+    {
+      Map c = a;
+      Map d = b;
+      c.merge(d);
+      expect_model(c, model_of(united));
+      expect_model(d, model_of(left_behind));
+    }
+    {
+      Map c = a;
+      CHECK(c.intersect_with(b) == (a_pairs.size() - common.size()));
+      expect_model(c, model_of(common));
+    }
+    {
+      Map c = a;
+      CHECK(c.difference_with(b) == (a_pairs.size() - only_a.size()));
+      expect_model(c, model_of(only_a));
+    }
+  }
+}
+
+template <typename Map>
+void operations_with_itself() {
+  key_source keys(22, 1000);
+  reference_bimap ref;
+  Map m = random_map<Map>(keys, 100, ref);
+  m.merge(m);
+  expect_model(m, ref);
+  CHECK(m.union_with(m) == 0u);
+  expect_model(m, ref);
+  CHECK(m.intersect_with(m) == 0u);
+  expect_model(m, ref);
+  CHECK(m.difference_with(m) == ref.size());
+  expect_model(m, reference_bimap());
+}
+
+template <typename Map>
+void range_erase_matches_std_map() {
+  key_source keys(23, 1000);
+  for (int round = 0; round < 500; ++round) {
+    reference_bimap ref;
+    Map m = random_map<Map>(keys, static_cast<int>(keys.below(300)), ref);
+    for (int cut = 0; cut < 4; ++cut) {
+      int const lo = keys();
+      int const hi = lo + static_cast<int>(keys.below(keys.below(2) == 0 ? 20 : 1000));
+      if (keys.below(2) == 0) {
+        auto it = m.erase_left(m.lower_bound_left(lo), m.lower_bound_left(hi));
+        CHECK(it == m.lower_bound_left(hi));
+        for (auto jt = ref.left.lower_bound(lo); jt != ref.left.lower_bound(hi);) {
+          ref.right.erase(jt->second);
+          jt = ref.left.erase(jt);
+        }
+      } else {
+        m.erase_right(m.lower_bound_right(lo), m.lower_bound_right(hi));
+        for (auto jt = ref.right.lower_bound(lo); jt != ref.right.lower_bound(hi);) {
+          ref.left.erase(jt->second);
+          jt = ref.right.erase(jt);
+        }
+      }
+      expect_model(m, ref);
+      for (int i = 0; i < 20; ++i) {
+        int const l = keys();
+        int const r = keys();
+        REQUIRE(inserted(m, l, r) == ref.insert(l, r));
+      }
+      expect_model(m, ref);
+    }
+  }
+}
+
+template <typename Map>
+void split_and_join_match_std_map() {
+  key_source keys(24, 1000);
+  for (int round = 0; round < 1000; ++round) {
+    reference_bimap ref;
+    Map m = random_map<Map>(keys, static_cast<int>(keys.below(300)), ref);
+    int const cut = keys() + 50;
+    bool const by_right = keys.below(2) == 0;
+    Map tail = by_right ? m.split_right(cut) : m.split_left(cut);
+    reference_bimap head_ref;
+    reference_bimap tail_ref;
+    for (auto const& [l, r] : ref.left) {
+      ((by_right ? r : l) >= cut ? tail_ref : head_ref).insert(l, r);
+    }
+    expect_model(m, head_ref);
+    expect_model(tail, tail_ref);
+    if (keys.below(2) == 0) {
+      m.join(std::move(tail));
+      expect_model(m, ref);
+      CHECK(tail.empty());
+    } else {
+      tail.join(std::move(m));
+      expect_model(tail, ref);
+      CHECK(m.empty());
+    }
+  }
+}
+
+template <typename Map>
+void join_keeps_conflicting_pairs_behind() {
+  key_source keys(25, 1000);
+  for (int round = 0; round < 1000; ++round) {
+    // lefts of b all above those of a, rights drawn from the same range
+    Map a;
+    Map b;
+    reference_bimap a_ref;
+    reference_bimap b_ref;
+    for (int i = static_cast<int>(keys.below(100)); i > 0; --i) {
+      int const l = keys() / 2;
+      int const r = keys();
+      REQUIRE(inserted(a, l, r) == a_ref.insert(l, r));
+    }
+    for (int i = static_cast<int>(keys.below(100)); i > 0; --i) {
+      int const l = 500 + keys() / 2;
+      int const r = keys();
+      REQUIRE(inserted(b, l, r) == b_ref.insert(l, r));
+    }
+    reference_bimap joined = a_ref;
+    reference_bimap stayed;
+    for (auto const& [l, r] : b_ref.left) {
+      (a_ref.right.count(r) != 0 ? stayed : joined).insert(l, r);
+    }
+    a.join(std::move(b));
+    expect_model(a, joined);
+    expect_model(b, stayed);
+  }
+
+  // maps whose lefts interleave are merged
+  Map a;
+  Map b;
+  a.insert(1, 1);
+  a.insert(5, 2);
+  b.insert(3, 0);
+  b.insert(4, 9);
+  a.join(std::move(b));
+  reference_bimap all;
+  all.insert(1, 1);
+  all.insert(3, 0);
+  all.insert(4, 9);
+  all.insert(5, 2);
+  expect_model(a, all);
+}
+
+// run for maps with and without subtree sizes
+template <typename Map>
+void check_set_operations() {
+  set_operations_match_std_map<Map>();
+  operations_with_itself<Map>();
+  range_erase_matches_std_map<Map>();
+  split_and_join_match_std_map<Map>();
+  join_keeps_conflicting_pairs_behind<Map>();
+}
+
+} // namespace
+
+int main() {
+  check_set_operations<plain_map>();
+  check_set_operations<counted_map>();
+  return test_result();
+}
@@ -0,0 +1,526 @@
+// Randomized checks of the intrusive red-black trees behind bimap against
+// a pair of std::maps: the red-black rules after every kind of mutation,
+// emplace, hinted inserts and bulk construction, at_*_or_default, the tree
+// ends, the height under sorted inserts, node handles, the node pool,
+// heterogeneous lookups, cached key prefixes and the height and descent
+// instrumentation.
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "bimap.h"
+#include "key_prefix.h"
+#include "node_pool.h"
+#include "reference.h"
+
+namespace {
+
+using pair_allocator = std::allocator<std::pair<int, int>>;
+
+using plain_map = bimap<int, int>;
+using counted_map = bimap<int, int, std::less<int>, std::less<int>, pair_allocator, true>;
+using stats_map =
+    bimap<int, int, std::less<int>, std::less<int>, pair_allocator, false, tree_stats>;
+using pooled_map =
+    bimap<int, int, std::less<int>, std::less<int>, pool_allocator<std::pair<int, int>>>;
+
+// three words per hook, the color packed into the parent pointer
+static_assert(plain_map::node_size == 6 * sizeof(void*) + 2 * sizeof(int));
+
+template <typename Map>
+void expect_valid(Map const& m, reference_bimap const& ref) {
+  REQUIRE(m.verify());
+  expect_same_pairs(m, ref);
+  if (!ref.left.empty()) {
+    // the first elements and the last ones reached through --end
+    CHECK(*m.begin_left() == ref.left.begin()->first);
+    CHECK(*m.begin_right() == ref.right.begin()->first);
+    CHECK(*std::prev(m.end_left()) == ref.left.rbegin()->first);
+    CHECK(*std::prev(m.end_right()) == ref.right.rbegin()->first);
+  } else {
+    CHECK(m.begin_left() == m.end_left());
+    CHECK(m.begin_right() == m.end_right());
+  }
+}
+
+template <typename Map>
+void random_operations_match_std_map() {
+  key_source keys(1, 300);
+  Map m;
+  reference_bimap ref;
+  for (int step = 0; step < 20000; ++step) {
+    int const l = keys();
+    int const r = keys();
+    switch (keys.below(9)) {
+      case 0:
+      case 1: {
+        bool const expected = ref.insert(l, r);
+        auto it = m.insert(l, r);
+        REQUIRE((it != m.end_left()) == expected);
+        if (expected) {
+          CHECK(*it == l);
+        }
+        break;
+      }
+      case 2: {
+        // hinted at the right place, at end and at a wrong place
+        auto hint = keys.below(3) == 0 ? m.end_left()
+                                       : keys.below(2) == 0 ? m.lower_bound_left(l)
+                                                            : m.begin_left();
+        bool const expected = ref.insert(l, r);
+        REQUIRE(inserted(m, hint, l, r) == expected);
+        break;
+      }
+      case 3:
+        REQUIRE((m.emplace(l, r) != m.end_left()) == ref.insert(l, r));
+        break;
+      case 4:
+        REQUIRE(m.erase_left(l) == ref.erase_left(l));
+        break;
+      case 5: {
+        auto it = m.find_right(r);
+        REQUIRE((it != m.end_right()) == (ref.right.count(r) != 0));
+        if (it != m.end_right()) {
+          m.erase_right(it);
+          ref.erase_right(r);
+        }
+        break;
+      }
+      case 6:
+        REQUIRE(m.at_left_or_default(l) == ref.at_left_or_default(l));
+        break;
+      case 7:
+        REQUIRE(m.at_right_or_default(r) == ref.at_right_or_default(r));
+        break;
+      default: {
+        // re-keys the left of a pair through a node handle
+        auto nh = m.extract_left(l);
+        REQUIRE(nh.empty() == (ref.left.count(l) == 0));
+        if (!nh.empty()) {
+          int const right = nh.right();
+          ref.erase_left(l);
+          nh.left() = l + 1000;
+          bool const expected = ref.insert(l + 1000, right);
+          auto result = m.insert(std::move(nh));
+          REQUIRE(result.inserted == expected);
+          CHECK(result.node.empty() == expected);
+        }
+        break;
+      }
+    }
+    if (step % 500 == 0) {
+      expect_valid(m, ref);
+    }
+  }
+  expect_valid(m, ref);
+
+  Map copy(m);
+  expect_valid(copy, ref);
+  Map moved(std::move(copy));
+  expect_valid(moved, ref);
+  expect_valid(copy, reference_bimap());
+  copy = std::move(moved);
+  expect_valid(copy, ref);
+  m.swap(moved);
+  expect_valid(moved, ref);
+  expect_valid(m, reference_bimap());
+  moved.erase_left(moved.begin_left(), moved.end_left());
+  expect_valid(moved, reference_bimap());
+}
+
+template <typename Map>
+void hinted_appends_match_inserts() {
+  key_source keys(2, 5000);
+  reference_bimap ref;
+  for (int i = 0; i < 3000; ++i) {
+    ref.insert(keys(), keys());
+  }
+  // hinted appends at end() are the ordered ingest path
+  Map appended;
+  for (auto const& [l, r] : ref.left) {
+    appended.insert(appended.end_left(), l, r);
+  }
+  expect_valid(appended, ref);
+  Map emplaced;
+  for (auto it = ref.left.rbegin(); it != ref.left.rend(); ++it) {
+    emplaced.emplace_hint(emplaced.begin_left(), it->first, it->second);
+  }
+  expect_valid(emplaced, ref);
+}
+
+template <typename Map>
+void bulk_construction_matches_inserts() {
+  key_source keys(3, 5000);
+  std::vector<std::pair<int, int>> pairs;
+  for (int i = 0; i < 3000; ++i) {
+    pairs.emplace_back(keys(), keys());
+  }
+  reference_bimap ref;
+  for (auto const& [l, r] : pairs) {
+    ref.insert(l, r);
+  }
+  Map from_range(pairs.begin(), pairs.end());
+  expect_valid(from_range, ref);
+
+  std::vector<std::pair<int, int>> sorted(ref.left.begin(), ref.left.end());
+  Map from_sorted(sorted_unique, sorted.begin(), sorted.end());
+  expect_valid(from_sorted, ref);
+  CHECK(from_sorted == from_range);
+  for (std::size_t n : {0u, 1u, 2u, 3u, 7u, 8u}) {
+    // the smallest shapes of the bottom-up build
+    Map small(sorted_unique, sorted.begin(), sorted.begin() + static_cast<std::ptrdiff_t>(n));
+    CHECK(small.verify());
+    CHECK(small.size() == n);
+  }
+}
+
+template <typename Map>
+void sorted_inserts_stay_balanced() {
+  Map m;
+  reference_bimap ref;
+  int const n = 100000;
+  for (int i = 0; i < n; ++i) {
+    m.insert(i, n - i);
+    ref.insert(i, n - i);
+  }
+  expect_valid(m, ref);
+  double const bound = 2 * std::log2(n + 1.0);
+  CHECK(static_cast<double>(m.exact_height_left()) <= bound);
+  CHECK(static_cast<double>(m.exact_height_right()) <= bound);
+  m = Map();
+  CHECK(m.empty());
+}
+
+template <typename Map>
+void height_bounds_the_exact_walk() {
+  key_source keys(4, 1 << 20);
+  Map m;
+  CHECK(m.height_left() == 0u);
+  CHECK(m.exact_height_left() == 0u);
+  for (int i = 0; i < 5000; ++i) {
+    m.insert(keys(), keys());
+    if (i % 100 == 0) {
+      m.erase_left(m.begin_left());
+    }
+    CHECK(m.black_height_left() <= m.exact_height_left());
+    CHECK(m.exact_height_left() <= m.height_left());
+    CHECK(m.black_height_right() <= m.exact_height_right());
+    CHECK(m.exact_height_right() <= m.height_right());
+  }
+}
+
+void descents_are_counted() {
+  stats_map m;
+  for (int i = 1; i <= 1000; ++i) {
+    m.insert(i, i);
+  }
+  CHECK(m.stats().allocations == 1000u);
+  m.reset_stats();
+  CHECK(m.stats().descents == 0u);
+  for (int i = 1; i <= 1000; ++i) {
+    REQUIRE(m.find_left(i) != m.end_left());
+  }
+  tree_stats const s = m.stats();
+  CHECK(s.descents == 1000u);
+  CHECK(s.comparisons > 0u);
+  CHECK(s.deepest_descent() > 0u);
+  CHECK(s.deepest_descent() <= m.height_left());
+  CHECK(s.mean_depth() <= static_cast<double>(s.deepest_descent()));
+
+  m.reset_stats();
+  m.erase_left(m.begin_left(), m.end_left());
+  CHECK(m.stats().allocations == 0u);
+  CHECK(m.stats().deallocations == 1000u);
+
+  // placed by its hint, an insert descends through the one node compared
+  for (int i = 1; i <= 1000; ++i) {
+    m.insert(m.end_left(), i, -i);
+  }
+  CHECK(m.stats().descents == 2000u);
+  CHECK(m.stats().depth_histogram[1] >= 999u);
+}
+
+void defaults_rekey_the_paired_node() {
+  stats_map m;
+  for (int i = 1; i <= 1000; ++i) {
+    m.insert(i, i % 1000);
+  }
+  // a hit costs one descent
+  m.reset_stats();
+  CHECK(m.at_left_or_default(5) == 5);
+  CHECK(m.stats().descents == 1u);
+
+  // 1000 holds the default right, its node moves to the new left key:
+  // one descent per tree, then the relink next to the first slot found
+  m.reset_stats();
+  CHECK(m.at_left_or_default(5000) == 0);
+  CHECK(m.stats().descents == 3u);
+  CHECK(m.stats().allocations == 0u);
+  CHECK(m.find_left(1000) == m.end_left());
+  CHECK(m.at_right(0) == 5000);
+  CHECK(m.size() == 1000u);
+  CHECK(m.verify());
+
+  // around the old position of the node, at both ends and next to it
+  for (int key : {0, 1001, 5001, 4999, -5}) {
+    CHECK(m.at_left_or_default(key) == 0);
+    CHECK(m.at_right(0) == key);
+    CHECK(m.verify());
+  }
+  CHECK(m.stats().allocations == 0u);
+}
+
+void cached_prefixes_match_std_map() {
+  using prefix_map = bimap<std::string, int, prefix_compare<std::less<std::string>>>;
+  std::mt19937 rng(4);
+  // keys sharing long prefixes, with bytes on both sides of 0x80
+  auto random_key = [&](std::size_t common) {
+    std::string s(common, 'k');
+    for (unsigned n = rng() % 12; n > 0; --n) {
+      s += static_cast<char>(rng() % 4 == 0 ? 0 : rng() % 2 ? 'a' + rng() % 3 : 200 + rng() % 3);
+    }
+    return s;
+  };
+  for (std::size_t common : {0, 3, 8, 12}) {
+    prefix_map m;
+    std::map<std::string, int> ref;
+    for (int i = 0; i < 5000; ++i) {
+      std::string key = random_key(common);
+      if (ref.count(key) == 0) {
+        ref.emplace(key, i);
+        REQUIRE(inserted(m, key, i));
+      }
+    }
+    REQUIRE(m.verify());
+    REQUIRE(std::equal(m.begin_left(), m.end_left(), ref.begin(), ref.end(),
+                           [](std::string const& a, auto const& b) { return a == b.first; }));
+    for (int q = 0; q < 2000; ++q) {
+      std::string const key = random_key(common);
+      auto lb = ref.lower_bound(key);
+      auto ub = ref.upper_bound(key);
+      CHECK((m.find_left(key) != m.end_left()) == (ref.count(key) != 0));
+      CHECK((m.lower_bound_left(key) == m.end_left()) == (lb == ref.end()));
+      if (lb != ref.end()) {
+        CHECK(*m.lower_bound_left(key) == lb->first);
+      }
+      CHECK((m.upper_bound_left(key) == m.end_left()) == (ub == ref.end()));
+      if (ub != ref.end()) {
+        CHECK(*m.upper_bound_left(key) == ub->first);
+      }
+    }
+    // hinted inserts take the same prefix shortcuts, in order and not
+    prefix_map appended;
+    prefix_map hinted;
+    for (auto const& [key, value] : ref) {
+      appended.insert(appended.end_left(), key, value);
+      hinted.insert(hinted.lower_bound_left(key.substr(0, common + 1)), key, value);
+    }
+    CHECK(appended.verify());
+    CHECK(hinted.verify());
+    CHECK(appended == m);
+    CHECK(hinted == m);
+    CHECK(appended.insert(appended.begin_left(), ref.begin()->first, -1) == appended.end_left());
+    // the prefix cached in the hook follows a re-keyed node
+    auto nh = m.extract_left(m.begin_left());
+    nh.left() = "zzzzzzzzzz" + nh.left();
+    std::string const rekeyed = nh.left();
+    REQUIRE(m.insert(std::move(nh)).inserted);
+    CHECK(m.find_left(rekeyed) != m.end_left());
+    CHECK(m.verify());
+  }
+}
+
+void pool_allocators_share_their_pool() {
+  pool_allocator<int> a;
+  pool_allocator<long> b(a);
+  CHECK(a == b);
+  CHECK(!(a != b));
+  CHECK(!(pool_allocator<int>() == pool_allocator<long>()));
+  pool_allocator<int> c(std::move(a));
+  CHECK(a == c);
+
+  // a moved-from map keeps a usable pool
+  pooled_map m;
+  m.insert(1, 2);
+  pooled_map n(std::move(m));
+  m.insert(3, 4);
+  m.insert(5, 6);
+  CHECK(m.size() == 2u);
+  CHECK(n.size() == 1u);
+  pooled_map o;
+  o = std::move(n);
+  n.insert(7, 8);
+  CHECK(n.verify());
+  CHECK(o.at_left(1) == 2);
+}
+
+// counts the live nodes of the maps sharing it
+template <typename T>
+struct counting_allocator {
+  using value_type = T;
+
+  std::shared_ptr<std::ptrdiff_t> live = std::make_shared<std::ptrdiff_t>(0);
+
+  counting_allocator() = default;
+  template <typename U>
+  counting_allocator(counting_allocator<U> const& other) noexcept : live(other.live) {}
+
+  T* allocate(std::size_t n) {
+    *live += static_cast<std::ptrdiff_t>(n);
+    return std::allocator<T>().allocate(n);
+  }
+  void deallocate(T* p, std::size_t n) noexcept {
+    *live -= static_cast<std::ptrdiff_t>(n);
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template <typename U>
+  friend bool operator==(counting_allocator const& a, counting_allocator<U> const& b) {
+    return a.live == b.live;
+  }
+  template <typename U>
+  friend bool operator!=(counting_allocator const& a, counting_allocator<U> const& b) {
+    return !(a == b);
+  }
+};
+
+using counting_map = bimap<int, int, std::less<int>, std::less<int>,
+                           counting_allocator<std::pair<int, int>>>;
+
+void rejected_inserts_change_nothing() {
+  counting_allocator<std::pair<int, int>> alloc;
+  counting_map m(alloc);
+  reference_bimap ref;
+  for (int i = 0; i < 100; ++i) {
+    REQUIRE(inserted(m, i, 2 * i));
+    ref.insert(i, 2 * i);
+  }
+  // taken on the left, on the right and on both sides
+  CHECK(!inserted(m, 5, 1));
+  CHECK(!inserted(m, 1000, 10));
+  CHECK(!inserted(m, 5, 10));
+  CHECK(*alloc.live == 100);
+  expect_valid(m, ref);
+}
+
+void teardown_frees_every_node() {
+  counting_allocator<std::pair<int, int>> alloc;
+  {
+    counting_map m(alloc);
+    for (int i = 0; i < 100000; ++i) {
+      m.insert(i, -i);
+    }
+    counting_map copy(m);
+    CHECK(*alloc.live == 200000);
+    // assignments tear down the nodes they replace
+    copy = counting_map(alloc);
+    CHECK(*alloc.live == 100000);
+    copy = m;
+    CHECK(*alloc.live == 200000);
+    m = std::move(copy);
+    CHECK(*alloc.live == 100000);
+  }
+  CHECK(*alloc.live == 0);
+}
+
+void heterogeneous_keys() {
+  bimap<std::string, int, std::less<>> m;
+  for (int i = 0; i < 100; ++i) {
+    m.insert(std::string(20, static_cast<char>('a' + i % 26)) + std::to_string(i), i);
+  }
+  std::string const first = *m.begin_left();
+  std::string_view const key = first;
+  CHECK(m.find_left(key) == m.begin_left());
+  CHECK(m.lower_bound_left(key) == m.begin_left());
+  CHECK(m.upper_bound_left(key) == std::next(m.begin_left()));
+  CHECK(m.at_left(key) == *m.begin_left().flip());
+  CHECK(m.find_left(std::string_view("~")) == m.end_left());
+  CHECK(m.erase_left(key));
+  CHECK(!m.erase_left(key));
+  CHECK(m.verify());
+}
+
+void emplace_builds_keys_in_place() {
+  counting_allocator<std::pair<int, int>> alloc;
+  bimap<std::string, std::vector<int>, std::less<>, std::less<>,
+        counting_allocator<std::pair<std::string, std::vector<int>>>>
+      m(alloc);
+  auto it = m.emplace(std::piecewise_construct, std::forward_as_tuple(3, 'a'),
+                      std::forward_as_tuple(2, 7));
+  REQUIRE(it != m.end_left());
+  CHECK(*it == "aaa");
+  CHECK((*it.flip() == std::vector<int>{7, 7}));
+  // keys given as they are are probed before a node is allocated
+  CHECK(m.emplace(std::piecewise_construct, std::forward_as_tuple(std::string("aaa")),
+                  std::forward_as_tuple(1, 1)) == m.end_left());
+  CHECK(*alloc.live == 1);
+  // built ones are dropped after the build
+  CHECK(m.emplace(std::piecewise_construct, std::forward_as_tuple(3, 'a'),
+                  std::forward_as_tuple(5, 5)) == m.end_left());
+  CHECK(m.emplace(std::string("b"), std::vector<int>{7, 7}) == m.end_left());
+  CHECK(*alloc.live == 1);
+  CHECK(m.emplace(std::make_pair(std::string("b"), std::vector<int>{1})) != m.end_left());
+  CHECK(m.size() == 2u);
+  CHECK(m.verify());
+}
+
+void node_handles_own_their_node() {
+  counting_allocator<std::pair<int, int>> alloc;
+  counting_map m(alloc);
+  for (int i = 0; i < 10; ++i) {
+    m.insert(i, i);
+  }
+  {
+    auto nh = m.extract_right(3);
+    CHECK(nh.left() == 3);
+    CHECK(m.size() == 9u);
+    CHECK(*alloc.live == 10);
+  }
+  CHECK(*alloc.live == 9);
+  // re-keying moves the node back without allocating
+  auto nh = m.extract_left(m.find_left(4));
+  nh.right() = 100;
+  CHECK(m.insert(std::move(nh)).inserted);
+  CHECK(*alloc.live == 9);
+  CHECK(m.at_right(100) == 4);
+  CHECK(m.extract_left(42).empty());
+  CHECK(m.verify());
+}
+
+// every tree configuration goes through the same checks
+template <typename Map>
+void check_tree() {
+  random_operations_match_std_map<Map>();
+  hinted_appends_match_inserts<Map>();
+  bulk_construction_matches_inserts<Map>();
+  sorted_inserts_stay_balanced<Map>();
+  height_bounds_the_exact_walk<Map>();
+}
+
+} // namespace
+
+int main() {
+  check_tree<plain_map>();
+  check_tree<counted_map>();
+  check_tree<stats_map>();
+  check_tree<pooled_map>();
+  descents_are_counted();
+  defaults_rekey_the_paired_node();
+  pool_allocators_share_their_pool();
+  rejected_inserts_change_nothing();
+  teardown_frees_every_node();
+  heterogeneous_keys();
+  emplace_builds_keys_in_place();
+  node_handles_own_their_node();
+  cached_prefixes_match_std_map();
+  return test_result();
+}
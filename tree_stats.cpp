@@ -0,0 +1,33 @@
+#include "tree_stats.h"
+
+tree_stats& tree_stats::operator+=(tree_stats const& other) noexcept {
+  descents += other.descents;
+  comparisons += other.comparisons;
+  for (std::size_t i = 0; i < max_depth; ++i) {
+    depth_histogram[i] += other.depth_histogram[i];
+  }
+  rotations += other.rotations;
+  allocations += other.allocations;
+  deallocations += other.deallocations;
+  return *this;
+}
+
+double tree_stats::mean_depth() const noexcept {
+  if (descents == 0) {
+    return 0;
+  }
+  std::uint64_t total = 0;
+  for (std::size_t i = 0; i < max_depth; ++i) {
+    total += i * depth_histogram[i];
+  }
+  return static_cast<double>(total) / static_cast<double>(descents);
+}
+
+std::size_t tree_stats::deepest_descent() const noexcept {
+  for (std::size_t i = max_depth; i > 0; --i) {
+    if (depth_histogram[i - 1] != 0) {
+      return i - 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Instrumentation policies of intr_tree and bimap. With no_stats, the
+// default, the hooks compile to nothing and take no storage.
+struct no_stats {
+  static constexpr bool enabled = false;
+};
+
+// Counters of a tree or a bimap using the tree_stats policy. They are
+// plain integers, as unsynchronized as the containers themselves.
+struct tree_stats {
+  static constexpr bool enabled = true;
+  static constexpr std::size_t max_depth = 64;
+
+  // searches: find, bounds and insert positions, from the root or, for
+  // hinted inserts placed by their hint, from the hint
+  std::uint64_t descents{0};
+  std::uint64_t comparisons{0};
+  // descents by the number of nodes they visited, deeper ones in the last bucket
+  std::uint64_t depth_histogram[max_depth]{};
+  std::uint64_t rotations{0};
+  // nodes created and destroyed by a bimap, trees leave them at zero
+  std::uint64_t allocations{0};
+  std::uint64_t deallocations{0};
+
+  tree_stats& operator+=(tree_stats const& other) noexcept;
+
+  // mean nodes visited per descent
+  double mean_depth() const noexcept;
+
+  // nodes visited by the deepest descent so far, at most max_depth - 1
+  std::size_t deepest_descent() const noexcept;
+
+  void reset() noexcept {
+    *this = tree_stats();
+  }
+};
+
+// base of instrumented containers, empty for no_stats; Owner keeps the
+// empty bases of a container and of its members distinct, so both fold away
+template <typename Stats, typename Owner>
+struct stats_holder {
+  Stats& stats_ref() const noexcept {
+    return stats_;
+  }
+
+private:
+  mutable Stats stats_;
+};
+
+template <typename Owner>
+struct stats_holder<no_stats, Owner> {};
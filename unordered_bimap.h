@@ -0,0 +1,440 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "bimap.h"
+#include "intrusive_hash.h"
+
+// Hash-indexed bimap: expected O(1) lookup, insertion and removal on both
+// sides, no ordered iteration. As in bimap, every pair is one allocation
+// hooked into two intrusive tables, one per side, and flip() moves between
+// them without a lookup. Insertion may rehash, which invalidates iterators;
+// erasure invalidates only iterators to the erased pair.
+template <typename Left, typename Right,
+          typename HashLeft = std::hash<Left>,
+          typename HashRight = std::hash<Right>,
+          typename EqualLeft = std::equal_to<Left>,
+          typename EqualRight = std::equal_to<Right>,
+          typename Allocator = std::allocator<std::pair<Left, Right>>>
+struct unordered_bimap {
+  using left_t = Left;
+  using right_t = Right;
+  using allocator_type = Allocator;
+  template <typename Side>
+  using key_t = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      left_t,
+      right_t>;
+
+  template <typename Side>
+  using Hash = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      HashLeft,
+      HashRight>;
+
+  template <typename Side>
+  using Equal = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      EqualLeft,
+      EqualRight>;
+
+private:
+  struct node_t;
+  template <typename Side>
+  using table_type = intr_hash_table<node_t, Side, key_t<Side>, Hash<Side>, Equal<Side>,
+                                     Allocator>;
+  using node_allocator =
+      typename std::allocator_traits<Allocator>::template rebind_alloc<node_t>;
+  using node_traits = std::allocator_traits<node_allocator>;
+public:
+
+  template <typename Side>
+  struct base_iterator {
+    friend unordered_bimap;
+    using iterator_category = std::forward_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = key_t<Side>;
+    using pointer = value_type const*;
+    using reference = value_type const&;
+
+    using table_t = table_type<Side>;
+
+    base_iterator() = default;
+
+    reference operator*() const {
+      return it->template key<Side>();
+    }
+    pointer operator->() const {
+      return &(it->template key<Side>());
+    }
+
+    base_iterator& operator++() {
+      ++it;
+      return *this;
+    }
+    base_iterator operator++(int) {
+      base_iterator tmp(*this);
+      ++*this;
+      return tmp;
+    }
+
+    base_iterator<Other<Side>> flip() const {
+      auto const& other = map_p->template table<Other<Side>>();
+      if (it == map_p->template table<Side>().end()) {
+        return base_iterator<Other<Side>>(other.end(), map_p);
+      }
+      return base_iterator<Other<Side>>(table_type<Other<Side>>::as_iterator(*it, other),
+                                        map_p);
+    }
+
+    friend bool operator==(base_iterator const& a, base_iterator const& b) {
+      return a.it == b.it;
+    }
+    friend bool operator!=(base_iterator const& a, base_iterator const& b) {
+      return !(a == b);
+    }
+
+  private:
+    typename table_t::iterator it;
+    unordered_bimap const* map_p{nullptr};
+
+    base_iterator(typename table_t::iterator it, unordered_bimap const* p)
+        : it(it), map_p(p) {}
+  };
+
+  using right_iterator = base_iterator<right_tag>;
+  using left_iterator = base_iterator<left_tag>;
+  template <typename Side>
+  using iterator = std::conditional_t<
+      std::is_same_v<Side, left_tag>,
+      left_iterator,
+      right_iterator>;
+
+  explicit unordered_bimap(HashLeft hash_left = HashLeft(),
+                           HashRight hash_right = HashRight(),
+                           EqualLeft equal_left = EqualLeft(),
+                           EqualRight equal_right = EqualRight(),
+                           Allocator const& alloc = Allocator())
+      : left_table(hash_left, equal_left, alloc),
+        right_table(hash_right, equal_right, alloc),
+        alloc_(alloc) {}
+
+  explicit unordered_bimap(Allocator const& alloc)
+      : unordered_bimap(HashLeft(), HashRight(), EqualLeft(), EqualRight(), alloc) {}
+
+  unordered_bimap(unordered_bimap const& other)
+      : left_table(other.left_table.hash_function(), other.left_table.key_eq(),
+                   other.get_allocator()),
+        right_table(other.right_table.hash_function(), other.right_table.key_eq(),
+                    other.get_allocator()),
+        alloc_(node_traits::select_on_container_copy_construction(other.alloc_)) {
+    copy_from(other);
+  }
+
+  unordered_bimap(unordered_bimap&& other) noexcept
+      : left_table(std::move(other.left_table)),
+        right_table(std::move(other.right_table)),
+        alloc_(std::move(other.alloc_)) {}
+
+  unordered_bimap& operator=(unordered_bimap const& other) {
+    if (this != &other) {
+      clear();
+      if constexpr (node_traits::propagate_on_container_copy_assignment::value) {
+        alloc_ = other.alloc_;
+      }
+      // change hashes and equalities:
+      left_table = table_type<left_tag>(other.left_table.hash_function(),
+                                        other.left_table.key_eq(), get_allocator());
+      right_table = table_type<right_tag>(other.right_table.hash_function(),
+                                          other.right_table.key_eq(), get_allocator());
+      copy_from(other);
+    }
+    return *this;
+  }
+
+  unordered_bimap& operator=(unordered_bimap&& other) noexcept(
+      node_traits::propagate_on_container_move_assignment::value ||
+      node_traits::is_always_equal::value) {
+    if (this != &other) {
+      clear();
+      if constexpr (node_traits::propagate_on_container_move_assignment::value) {
+        alloc_ = std::move(other.alloc_);
+      } else if (alloc_ != other.alloc_) {
+        // nodes can't change hands, copy them into our own storage
+        *this = static_cast<unordered_bimap const&>(other);
+        other.clear();
+        return *this;
+      }
+      left_table = std::move(other.left_table);
+      right_table = std::move(other.right_table);
+    }
+    return *this;
+  }
+
+  void swap(unordered_bimap& other) {
+    left_table.swap(other.left_table);
+    right_table.swap(other.right_table);
+    if constexpr (node_traits::propagate_on_container_swap::value) {
+      std::swap(alloc_, other.alloc_);
+    }
+  }
+
+  allocator_type get_allocator() const {
+    return allocator_type(alloc_);
+  }
+
+  ~unordered_bimap() {
+    clear();
+  }
+
+  left_iterator insert(left_t const& left, right_t const& right) {
+    return insert_(left, right);
+  }
+  left_iterator insert(left_t const& left, right_t&& right) {
+    return insert_(left, std::move(right));
+  }
+  left_iterator insert(left_t&& left, right_t const& right) {
+    return insert_(std::move(left), right);
+  }
+  left_iterator insert(left_t&& left, right_t&& right) {
+    return insert_(std::move(left), std::move(right));
+  }
+
+  left_iterator erase_left(left_iterator it) {
+    return erase<left_tag>(it);
+  }
+  bool erase_left(left_t const& left) {
+    return erase_key<left_tag>(left);
+  }
+
+  right_iterator erase_right(right_iterator it) {
+    return erase<right_tag>(it);
+  }
+  bool erase_right(right_t const& right) {
+    return erase_key<right_tag>(right);
+  }
+
+  left_iterator find_left(left_t const& left) const {
+    return find<left_tag>(left);
+  }
+  right_iterator find_right(right_t const& right) const {
+    return find<right_tag>(right);
+  }
+
+  right_t const& at_left(left_t const& key) const {
+    return at<left_tag>(key);
+  }
+  left_t const& at_right(right_t const& key) const {
+    return at<right_tag>(key);
+  }
+
+  template <typename U = right_t,
+      typename = std::enable_if_t<std::is_default_constructible_v<U>>>
+  right_t const& at_left_or_default(left_t const& key) {
+    return at_or_default<left_tag>(key);
+  }
+  template <typename U = left_t,
+      typename = std::enable_if_t<std::is_default_constructible_v<U>>>
+  left_t const& at_right_or_default(right_t const& key) {
+    return at_or_default<right_tag>(key);
+  }
+
+  left_iterator begin_left() const {
+    return left_iterator(left_table.begin(), this);
+  }
+  left_iterator end_left() const {
+    return left_iterator(left_table.end(), this);
+  }
+
+  right_iterator begin_right() const {
+    return right_iterator(right_table.begin(), this);
+  }
+  right_iterator end_right() const {
+    return right_iterator(right_table.end(), this);
+  }
+
+  bool empty() const {
+    return left_table.empty();
+  }
+
+  std::size_t size() const {
+    return left_table.size();
+  }
+
+  // buckets for n pairs on both sides, no rehash until size() exceeds n
+  void reserve(std::size_t n) {
+    left_table.reserve(n);
+    right_table.reserve(n);
+  }
+
+  std::size_t bucket_count() const {
+    return left_table.bucket_count();
+  }
+
+  friend bool operator==(unordered_bimap const& a, unordered_bimap const& b) {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    for (auto it = a.begin_left(); it != a.end_left(); ++it) {
+      auto jt = b.find_left(*it);
+      if (jt == b.end_left() || !(*jt.flip() == *it.flip())) {
+        return false;
+      }
+    }
+    return true;
+  }
+  friend bool operator!=(unordered_bimap const& a, unordered_bimap const& b) {
+    return !(a == b);
+  }
+
+private:
+  struct node_t : hash_element<left_tag>, hash_element<right_tag> {
+    template <typename... Args>
+    explicit node_t(Args&&... args) : lr(std::forward<Args>(args)...) {}
+
+    template <typename Side>
+    key_t<Side> const& key() const {
+      if constexpr (std::is_same_v<Side, left_tag>) {
+        return lr.first;
+      } else {
+        return lr.second;
+      }
+    }
+
+    private:
+    std::pair<left_t, right_t> lr;
+  };
+
+public:
+  // bytes taken by one stored pair
+  static constexpr std::size_t node_size = sizeof(node_t);
+
+private:
+  table_type<left_tag> left_table;
+  table_type<right_tag> right_table;
+  node_allocator alloc_;
+
+  template <typename Side>
+  table_type<Side> const& table() const {
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return left_table;
+    } else {
+      return right_table;
+    }
+  }
+
+  template <typename Side>
+  iterator<Side> find(key_t<Side> const& key) const {
+    return iterator<Side>(table<Side>().find(key), this);
+  }
+
+  template <typename Side>
+  key_t<Other<Side>> const& at(key_t<Side> const& key) const {
+    auto it = find<Side>(key);
+    if (it == iterator<Side>(table<Side>().end(), this)) {
+      throw std::out_of_range("No such element");
+    }
+    return *it.flip();
+  }
+
+  template <typename Side>
+  iterator<Side> erase(iterator<Side> it) {
+    if (it.it == table<Side>().end()) {
+      return it;
+    }
+    node_t* node = &*it.it;
+    ++it;
+    left_table.unlink(*node);
+    right_table.unlink(*node);
+    destroy_node(node);
+    return it;
+  }
+
+  template <typename Side>
+  bool erase_key(key_t<Side> const& key) {
+    auto it = find<Side>(key);
+    if (it.it == table<Side>().end()) {
+      return false;
+    }
+    erase<Side>(it);
+    return true;
+  }
+
+  template <typename L, typename R>
+  left_iterator insert_(L&& left, R&& right) {
+    std::size_t const left_hash = left_table.hash_of(left);
+    std::size_t const right_hash = right_table.hash_of(right);
+    if (left_table.find(left, left_hash) != left_table.end() ||
+        right_table.find(right, right_hash) != right_table.end()) {
+      return end_left();
+    }
+    left_table.reserve(size() + 1);
+    right_table.reserve(size() + 1);
+    node_t* node = create_node(std::forward<L>(left), std::forward<R>(right));
+    right_table.link(*node, right_hash);
+    return left_iterator(left_table.link(*node, left_hash), this);
+  }
+
+  // an absent key takes the pair holding the default other key, if any
+  template <typename Side,
+      typename = std::enable_if_t<
+          std::is_default_constructible_v<key_t<Other<Side>>>>>
+  key_t<Other<Side>> const& at_or_default(key_t<Side> const& key) {
+    auto it_side = find<Side>(key);
+    if (it_side.it != table<Side>().end()) {
+      return *it_side.flip();
+    }
+    key_t<Other<Side>> other = key_t<Other<Side>>();
+    erase_key<Other<Side>>(other);
+    if constexpr (std::is_same_v<Side, left_tag>) {
+      return *insert_(key, std::move(other)).flip();
+    } else {
+      return *insert_(std::move(other), key);
+    }
+  }
+
+  void copy_from(unordered_bimap const& other) {
+    left_table.reserve(other.size());
+    right_table.reserve(other.size());
+    try {
+      for (auto it = other.left_table.begin(); it != other.left_table.end(); ++it) {
+        node_t* node = create_node(it->template key<left_tag>(),
+                                   it->template key<right_tag>());
+        left_table.link(*node, table_type<left_tag>::cached_hash(*it));
+        right_table.link(*node, table_type<right_tag>::cached_hash(*it));
+      }
+    } catch (...) {
+      clear();
+      throw;
+    }
+  }
+
+  template <typename... Args>
+  node_t* create_node(Args&&... args) {
+    node_t* node = node_traits::allocate(alloc_, 1);
+    try {
+      node_traits::construct(alloc_, node, std::forward<Args>(args)...);
+    } catch (...) {
+      node_traits::deallocate(alloc_, node, 1);
+      throw;
+    }
+    return node;
+  }
+
+  void destroy_node(node_t* node) noexcept {
+    node_traits::destroy(alloc_, node);
+    node_traits::deallocate(alloc_, node, 1);
+  }
+
+  void clear() noexcept {
+    right_table.release();
+    left_table.clear_and_dispose([this](node_t* node) {
+      destroy_node(node);
+    });
+  }
+};